@@ -118,6 +118,8 @@ ornament::Scene spheres(float aspectRatio)
         1000.0f,
         scene.lambertian(ornament::Color(glm::vec3(0.5f, 0.5f, 0.5f)))));
 
+    // hundreds of small spheres share one blas
+    auto smallSpheres = scene.sphereSet();
     std::vector<int> range = { -11, -10, -9, -8, -7, -6, -5, -4, -3, -2, -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
     for (auto a : range) {
         for (auto b : range) {
@@ -133,10 +135,11 @@ ornament::Scene spheres(float aspectRatio)
                 } else {
                     material = scene.dielectric(1.5f);
                 }
-                scene.attach(scene.sphere(center, 0.2f, material));
+                smallSpheres->add(center, 0.2f, material);
             }
         }
     }
+    scene.attach(smallSpheres);
 
     scene.attach(scene.sphere({ 0.0f, 1.0f, 0.0f }, 1.0f, scene.dielectric(1.5f)));
     scene.attach(scene.sphere({ -4.0f, 1.0f, 0.0f }, 1.0f, scene.lambertian(ornament::Color(glm::vec3(0.4f, 0.2f, 0.1f)))));
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <filesystem>
 #include <ornament.hpp>
+#include <string>
 
 #include "../common/examples.hpp"
 #include "../common/utils.hpp"
@@ -18,19 +19,35 @@ int main(int argc, const char* argv[])
     scene.getState().setGamma(2.2f);
     scene.getState().setFlipY(true);
     std::filesystem::path exeDirPath = std::filesystem::path(argv[0]).parent_path();
-    ornament::hip::PathTracer pathTracer(
-        std::move(scene),
-        exeDirPath.string().c_str());
-    pathTracer.render();
-    pathTracer.render();
-    pathTracer.render();
-    pathTracer.render();
+    std::string kernalsDirPath = exeDirPath.string();
+
+    // usage: consoleapp [cpu|hip], hip is the default when it is compiled in
+    ornament::RendererOptions options;
+    options.backend = ornament::isBackendAvailable(ornament::HipBackend) ? ornament::HipBackend : ornament::CpuBackend;
+    options.kernalsDirPath = kernalsDirPath.c_str();
+    if (argc > 1) {
+        std::string backend = argv[1];
+        if (backend == "cpu") {
+            options.backend = ornament::CpuBackend;
+        } else if (backend == "hip") {
+            options.backend = ornament::HipBackend;
+        } else {
+            std::cerr << "Unknown backend " << backend << ", expected cpu or hip" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto renderer = ornament::createRenderer(std::move(scene), options);
+    renderer->render();
+    renderer->render();
+    renderer->render();
+    renderer->render();
 
     {
         size_t size;
-        pathTracer.getFrameBuffer(nullptr, 0, &size);
+        renderer->getFrameBuffer(nullptr, 0, &size);
         uint8_t* img = new uint8_t[size];
-        pathTracer.getFrameBuffer(img, size, nullptr);
+        renderer->getFrameBuffer(img, size, nullptr);
         auto resultPath = exeDirPath / "result.png";
         std::filesystem::remove(resultPath);
         utils::savePngImage(resultPath.string().c_str(), img, WIDTH, HEIGHT, 4, true);
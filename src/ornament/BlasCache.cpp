@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "BlasCache.hpp"
+
+namespace ornament {
+
+// bump when the layout of entries or of the nodes and triangles in them changes
+const uint32_t blasCacheVersion = 3;
+const uint32_t blasCacheMagic = 0x626e726f; // "ornb"
+
+struct BlasCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t nodesCount;
+    uint64_t trianglesCount;
+    uint32_t rootNodeId;
+    SbvhStats sbvhStats;
+};
+
+// Read only memory mapping of a whole file, data() is null when it cannot be mapped.
+class MappedFile {
+public:
+    MappedFile(const std::string& path)
+    {
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping != nullptr) {
+                m_data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                m_size = m_data != nullptr ? (size_t)size.QuadPart : 0;
+                CloseHandle(mapping);
+            }
+        }
+        CloseHandle(file);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                m_data = data;
+                m_size = (size_t)st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        if (m_data == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap(m_data, m_size);
+#endif
+    }
+
+    const uint8_t* data() const noexcept
+    {
+        return (const uint8_t*)m_data;
+    }
+
+    size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+private:
+    void* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+static unsigned long getProcessId()
+{
+#ifdef _WIN32
+    return (unsigned long)GetCurrentProcessId();
+#else
+    return (unsigned long)getpid();
+#endif
+}
+
+// 64 bit words are mixed in one by one, meshes of millions of triangles hash in milliseconds
+uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+    auto mix = [](uint64_t h, uint64_t word) {
+        h ^= word;
+        h *= 0xff51afd7ed558ccdull;
+        return h ^ (h >> 33);
+    };
+
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes + i, sizeof(word));
+        hash = mix(hash, word);
+    }
+
+    uint64_t tail = 0;
+    if (i < size) {
+        std::memcpy(&tail, bytes + i, size - i);
+    }
+    return mix(hash, tail ^ size);
+}
+
+template <typename T>
+uint64_t hashValue(uint64_t hash, const T& value)
+{
+    return hashBytes(hash, &value, sizeof(value));
+}
+
+// An entry passing the header checks can still be truncated or damaged in place, nodes of it are
+// checked to reference only nodes after them, triangles of the mesh and leafs ending within the entry.
+// Traversal stacks only fit trees of kernals::maxBvhDepth, so depths are checked too.
+static bool isValidEntry(const MeshBvh& meshBvh, uint32_t meshTrianglesCount)
+{
+    const std::vector<kernals::BvhNode>& nodes = meshBvh.nodes;
+    const std::vector<kernals::Triangle>& triangles = meshBvh.triangles;
+    for (const kernals::Triangle& t : triangles) {
+        if ((t.triangleId & ~kernals::lastTriangleFlag) >= meshTrianglesCount) {
+            return false;
+        }
+    }
+    if (!(triangles.back().triangleId & kernals::lastTriangleFlag)) {
+        return false;
+    }
+
+    // the root is the first node, or the only leaf of a mesh with no internal nodes
+    auto isValidLeaf = [&](uint32_t nodeRef) {
+        return kernals::getNodeType(nodeRef) == kernals::TriangleType && kernals::getNodeId(nodeRef) < triangles.size();
+    };
+    if (nodes.empty()) {
+        return isValidLeaf(meshBvh.rootNodeId);
+    }
+    if (meshBvh.rootNodeId != kernals::makeNodeRef(kernals::InternalNodeType, 0)) {
+        return false;
+    }
+
+    // children follow their parent, so depths are final when a node is reached and no cycle exists
+    std::vector<uint32_t> depths(nodes.size(), 0);
+    depths[0] = 1;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        for (uint32_t childRef : { nodes[i].leftNodeId, nodes[i].rightNodeId }) {
+            if (kernals::getNodeType(childRef) != kernals::InternalNodeType) {
+                if (!isValidLeaf(childRef)) {
+                    return false;
+                }
+                continue;
+            }
+
+            uint32_t childId = kernals::getNodeId(childRef);
+            if (childId <= i || childId >= nodes.size() || depths[i] + 1 > kernals::maxBvhDepth) {
+                return false;
+            }
+            depths[childId] = std::max(depths[childId], depths[i] + 1);
+        }
+    }
+    return true;
+}
+
+BlasCache::BlasCache(const std::string& dirPath)
+    : m_dirPath(dirPath)
+{
+    // the cache only saves build time, the build goes on without it
+    std::error_code error;
+    std::filesystem::create_directories(dirPath, error);
+    if (!std::filesystem::is_directory(dirPath, error)) {
+        disableSaving("blas cache directory cannot be created");
+    }
+}
+
+uint64_t BlasCache::getKey(const Mesh& mesh, const BvhOptions& options)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hashValue(hash, blasCacheVersion);
+    hash = hashValue(hash, sizeof(kernals::BvhNode));
+    hash = hashValue(hash, sizeof(kernals::Triangle));
+    hash = hashValue(hash, mesh.bvhBuilder);
+    hash = hashValue(hash, options.sahBinsCount);
+    hash = hashValue(hash, options.maxLeafSize);
+    hash = hashValue(hash, options.treeletOptimizationPasses);
+    hash = hashValue(hash, kernals::maxBvhDepth);
+    if (mesh.bvhBuilder == SbvhBuilderType) {
+        hash = hashValue(hash, options.sbvhSplitBudget);
+        hash = hashValue(hash, options.sbvhMinOverlap);
+    }
+    hash = hashBytes(hash, mesh.vertices.data(), mesh.vertices.size() * sizeof(glm::vec3));
+    hash = hashBytes(hash, mesh.vertexIndices.data(), mesh.vertexIndices.size() * sizeof(uint32_t));
+    return hash;
+}
+
+bool BlasCache::load(uint64_t key, uint32_t meshTrianglesCount, MeshBvh& meshBvh) const
+{
+    MappedFile file(getEntryPath(key));
+    if (file.data() == nullptr || file.size() < sizeof(BlasCacheHeader)) {
+        return false;
+    }
+
+    // counts are bounded by the file size first, so the sizes below cannot overflow
+    BlasCacheHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != blasCacheMagic
+        || header.version != blasCacheVersion
+        || header.key != key
+        || header.trianglesCount == 0
+        || header.nodesCount > file.size()
+        || header.trianglesCount > file.size()) {
+        return false;
+    }
+
+    size_t nodesSize = header.nodesCount * sizeof(kernals::BvhNode);
+    size_t trianglesSize = header.trianglesCount * sizeof(kernals::Triangle);
+    if (file.size() != sizeof(header) + nodesSize + trianglesSize) {
+        return false;
+    }
+
+    const uint8_t* nodes = file.data() + sizeof(header);
+    const uint8_t* triangles = nodes + nodesSize;
+    meshBvh.nodes.resize(header.nodesCount);
+    meshBvh.triangles.resize(header.trianglesCount);
+    std::memcpy(meshBvh.nodes.data(), nodes, nodesSize);
+    std::memcpy(meshBvh.triangles.data(), triangles, trianglesSize);
+    meshBvh.rootNodeId = header.rootNodeId;
+    meshBvh.sbvhStats = header.sbvhStats;
+    if (!isValidEntry(meshBvh, meshTrianglesCount)) {
+        meshBvh = MeshBvh();
+        return false;
+    }
+    return true;
+}
+
+void BlasCache::save(uint64_t key, const MeshBvh& meshBvh)
+{
+    if (m_savingDisabled) {
+        return;
+    }
+
+    try {
+        write(key, meshBvh);
+    } catch (const std::exception& e) {
+        disableSaving(e.what());
+    }
+}
+
+// one message for all the entries not written, meshes are saved from many threads
+void BlasCache::disableSaving(const char* reason)
+{
+    if (!m_savingDisabled.exchange(true)) {
+        fprintf(stderr, "[ornament] blas cache entries are not saved: %s\n", reason);
+    }
+}
+
+void BlasCache::write(uint64_t key, const MeshBvh& meshBvh) const
+{
+    BlasCacheHeader header = {
+        .magic = blasCacheMagic,
+        .version = blasCacheVersion,
+        .key = key,
+        .nodesCount = meshBvh.nodes.size(),
+        .trianglesCount = meshBvh.triangles.size(),
+        .rootNodeId = meshBvh.rootNodeId,
+        .sbvhStats = meshBvh.sbvhStats,
+    };
+
+    // written next to the entry and renamed over it, so readers never map a partial file,
+    // the name is unique per process and thread, as equal meshes are built concurrently
+    // by the threads of one build and by other processes sharing the directory
+    std::string entryPath = getEntryPath(key);
+    std::ostringstream tmpPath;
+    tmpPath << entryPath << "." << getProcessId() << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    {
+        std::ofstream file(tmpPath.str(), std::ios::binary | std::ios::trunc);
+        file.write((const char*)&header, sizeof(header));
+        file.write((const char*)meshBvh.nodes.data(), meshBvh.nodes.size() * sizeof(kernals::BvhNode));
+        file.write((const char*)meshBvh.triangles.data(), meshBvh.triangles.size() * sizeof(kernals::Triangle));
+        if (!file) {
+            file.close();
+            std::error_code error;
+            std::filesystem::remove(tmpPath.str(), error);
+            throw std::runtime_error("blas cache entry cannot be written");
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tmpPath.str(), entryPath, error);
+    if (error) {
+        std::filesystem::remove(tmpPath.str(), error);
+        throw std::runtime_error("blas cache entry cannot be renamed");
+    }
+}
+
+std::string BlasCache::getEntryPath(uint64_t key) const
+{
+    std::ostringstream name;
+    name << std::hex << key << ".blas";
+    return (std::filesystem::path(m_dirPath) / name.str()).string();
+}
+
+}
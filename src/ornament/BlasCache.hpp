@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "Bvh.hpp"
+
+namespace ornament {
+
+// Built blas of meshes are stored in files of one directory and mapped back
+// into memory on the next build of the same mesh with the same options.
+// Errors of the cache never fail a build, the blas is built as without it.
+class BlasCache {
+public:
+    BlasCache(const std::string& dirPath);
+    BlasCache(const BlasCache&) = delete;
+    BlasCache& operator=(const BlasCache&) = delete;
+    // hash of vertices, vertex indices and of every option the blas build depends on
+    static uint64_t getKey(const Mesh& mesh, const BvhOptions& options);
+    // triangle ids of entries are relative to the first triangle of the mesh,
+    // returns false when there is no valid entry for the key
+    bool load(uint64_t key, uint32_t meshTrianglesCount, MeshBvh& meshBvh) const;
+    // the first failed write is logged and later entries are not saved
+    void save(uint64_t key, const MeshBvh& meshBvh);
+
+private:
+    std::string m_dirPath;
+    std::atomic<bool> m_savingDisabled = false;
+
+    std::string getEntryPath(uint64_t key) const;
+    void write(uint64_t key, const MeshBvh& meshBvh) const;
+    void disableSaving(const char* reason);
+};
+
+}
@@ -1,307 +1,2598 @@
-#include <random>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+#include <optional>
 #include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "BlasCache.hpp"
 #include "Bvh.hpp"
 #include "global_structs_helper.hpp"
+#include "hip/kernals/bvh.hip.hpp"
+#include "hip/kernals/packing.hip.hpp"
 
 namespace ornament {
 
-std::mt19937 gen32x;
+math::Aabb getAabb(const Leaf& l)
+{
+    math::Aabb aabb;
+    switch (l.type) {
+    case SphereType: {
+        return l.sphere->aabb;
+    }
+    case MeshType: {
+        return l.mesh->aabb;
+    }
+    case MeshInstanceType: {
+        return l.meshInstance->aabb;
+    }
+    case SphereSetType: {
+        return l.sphereSet->aabb;
+    }
+    case GroupInstanceType: {
+        return l.groupInstance->aabb;
+    }
+    default: {
+        throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+    }
+}
+
+const glm::mat4& getTransform(const Leaf& l)
+{
+    switch (l.type) {
+    case SphereType: {
+        return l.sphere->transform;
+    }
+    case MeshType: {
+        return l.mesh->transform;
+    }
+    case MeshInstanceType: {
+        return l.meshInstance->transform;
+    }
+    case SphereSetType: {
+        return l.sphereSet->transform;
+    }
+    case GroupInstanceType: {
+        return l.groupInstance->transform;
+    }
+    default: {
+        throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+    }
+}
+
+// row major 3x4 matrix the kernals transform rays with
+float3x4 toKernalTransform(const glm::mat4& transform)
+{
+    // glm matrices are column major, rows of the kernal transform are gathered from columns
+    float3x4 kernalTransform;
+    for (int row = 0; row < 3; row++) {
+        kernalTransform.r[row] = make_float4(transform[0][row], transform[1][row], transform[2][row], transform[3][row]);
+    }
+    return kernalTransform;
+}
+
+math::Aabb toAabb(const float3& min, const float3& max)
+{
+    return math::Aabb(glm::vec3(min.x, min.y, min.z), glm::vec3(max.x, max.y, max.z));
+}
+
+math::Aabb getChildrenAabb(const kernals::BvhNode& node)
+{
+    math::Aabb aabb = toAabb(node.leftAabbMin, node.leftAabbMax);
+    aabb.grow(toAabb(node.rightAabbMin, node.rightAabbMax));
+    return aabb;
+}
+
+// Surface area heuristic cost of a tree: the sum of internal nodes areas relative
+// to the root area, that is how many internal nodes a random ray is expected to visit.
+// The tree is walked from its root, nodes unlinked by detaches are not in it.
+float sahCost(const std::vector<kernals::BvhNode>& nodes, uint32_t rootNodeId)
+{
+    if (kernals::getNodeType(rootNodeId) != kernals::InternalNodeType) {
+        return 1.0f;
+    }
+
+    float rootArea = getChildrenAabb(nodes[kernals::getNodeId(rootNodeId)]).area();
+    if (rootArea <= 0.0f) {
+        return 1.0f;
+    }
+
+    float cost = 0.0f;
+    std::vector<uint32_t> stack = { kernals::getNodeId(rootNodeId) };
+    while (!stack.empty()) {
+        const kernals::BvhNode& node = nodes[stack.back()];
+        stack.pop_back();
+        cost += getChildrenAabb(node).area();
+        for (uint32_t childRef : { node.leftNodeId, node.rightNodeId }) {
+            if (kernals::getNodeType(childRef) == kernals::InternalNodeType) {
+                stack.push_back(kernals::getNodeId(childRef));
+            }
+        }
+    }
+    return cost / rootArea;
+}
+
+// no parent of a root, no new id of an element dropped by a compaction
+const uint32_t noId = std::numeric_limits<uint32_t>::max();
+
+math::Aabb getAabb(const Triangle& t)
+{
+    return t.aabb;
+}
+
+math::Aabb getAabb(const SphereLeaf& s)
+{
+    return s.aabb;
+}
+
+struct BinnedSahSplit {
+    float cost = std::numeric_limits<float>::infinity();
+    // -1 when all centroids are in one point
+    int axis = -1;
+    uint32_t bin = 0;
+    float cmin = 0.0f;
+    float scale = 0.0f;
+    math::Aabb leftAabb;
+    math::Aabb rightAabb;
+};
+
+// Binned surface area heuristic split: centroids are binned along every axis and
+// the plane with the lowest leftArea * leftCount + rightArea * rightCount cost wins.
+template <typename T>
+BinnedSahSplit findBinnedSahSplit(const std::vector<T>& leafs, size_t start, size_t end, uint32_t binsCount)
+{
+    struct Bin {
+        math::Aabb aabb;
+        size_t count = 0;
+    };
+
+    size_t leafsSize = end - start;
+    math::Aabb centroidBounds;
+    for (size_t i = start; i < end; i++) {
+        centroidBounds.grow(getAabb(leafs[i]).centroid());
+    }
+
+    std::vector<Bin> bins(binsCount);
+    std::vector<math::Aabb> rightAabbs(binsCount);
+    std::vector<float> rightCosts(binsCount);
+    BinnedSahSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+        float cmin = centroidBounds.min()[axis];
+        float extent = centroidBounds.max()[axis] - cmin;
+        if (extent <= 0.0f) {
+            continue;
+        }
+
+        float scale = binsCount / extent;
+        std::fill(bins.begin(), bins.end(), Bin {});
+        for (size_t i = start; i < end; i++) {
+            math::Aabb aabb = getAabb(leafs[i]);
+            uint32_t b = std::min((uint32_t)((aabb.centroid()[axis] - cmin) * scale), binsCount - 1);
+            bins[b].count++;
+            bins[b].aabb.grow(aabb);
+        }
+
+        math::Aabb rightAabb;
+        size_t rightCount = 0;
+        for (uint32_t b = binsCount - 1; b > 0; b--) {
+            rightAabb.grow(bins[b].aabb);
+            rightCount += bins[b].count;
+            rightAabbs[b] = rightAabb;
+            rightCosts[b] = rightAabb.area() * rightCount;
+        }
+
+        math::Aabb leftAabb;
+        size_t leftCount = 0;
+        for (uint32_t b = 0; b < binsCount - 1; b++) {
+            leftAabb.grow(bins[b].aabb);
+            leftCount += bins[b].count;
+            float cost = leftAabb.area() * leftCount + rightCosts[b + 1];
+            if (leftCount > 0 && leftCount < leafsSize && cost < best.cost) {
+                best = {
+                    .cost = cost,
+                    .axis = axis,
+                    .bin = b + 1,
+                    .cmin = cmin,
+                    .scale = scale,
+                    .leftAabb = leftAabb,
+                    .rightAabb = rightAabbs[b + 1],
+                };
+            }
+        }
+    }
+    return best;
+}
+
+// Partitions leafs in place by the split, returns the index of the first right leaf.
+template <typename T>
+size_t partitionBinnedSah(std::vector<T>& leafs, size_t start, size_t end, uint32_t binsCount, const BinnedSahSplit& split)
+{
+    // all centroids are in one point, any split is as good as another
+    if (split.axis == -1) {
+        return start + (end - start) / 2;
+    }
+
+    auto mid = std::partition(
+        leafs.begin() + start,
+        leafs.begin() + end,
+        [&](const T& l) {
+            uint32_t b = std::min((uint32_t)((getAabb(l).centroid()[split.axis] - split.cmin) * split.scale), binsCount - 1);
+            return b < split.bin;
+        });
+    return mid - leafs.begin();
+}
+
+template <typename T>
+size_t splitBinnedSah(std::vector<T>& leafs, size_t start, size_t end, uint32_t binsCount)
+{
+    if (end - start == 2) {
+        return start + 1;
+    }
+
+    return partitionBinnedSah(leafs, start, end, binsCount, findBinnedSahSplit(leafs, start, end, binsCount));
+}
+
+// Splits leafs in half by their centroids along the widest axis of them,
+// every level of such splits halves the leafs count.
+template <typename T>
+size_t splitMedian(std::vector<T>& leafs, size_t start, size_t end)
+{
+    math::Aabb centroidBounds;
+    for (size_t i = start; i < end; i++) {
+        centroidBounds.grow(getAabb(leafs[i]).centroid());
+    }
+
+    glm::vec3 extent = centroidBounds.max() - centroidBounds.min();
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    size_t mid = start + (end - start) / 2;
+    std::nth_element(
+        leafs.begin() + start,
+        leafs.begin() + mid,
+        leafs.begin() + end,
+        [axis](const T& a, const T& b) { return getAabb(a).centroid()[axis] < getAabb(b).centroid()[axis]; });
+    return mid;
+}
+
+// levels of internal nodes median splits need to bring leafsCount down to leafs of maxLeafSize
+uint32_t getMedianDepth(size_t leafsCount, uint32_t maxLeafSize)
+{
+    uint32_t depth = 0;
+    while (leafsCount > maxLeafSize) {
+        leafsCount = (leafsCount + 1) / 2;
+        depth++;
+    }
+    return depth;
+}
+
+// Bounds of the part of a triangle between two planes orthogonal to axis,
+// clipped by the bounds of the triangle reference.
+math::Aabb clipTriangle(const Triangle& t, int axis, float lo, float hi)
+{
+    const glm::vec3 vertices[3] = { t.v0, t.v1, t.v2 };
+    math::Aabb aabb;
+    for (int i = 0; i < 3; i++) {
+        const glm::vec3& a = vertices[i];
+        const glm::vec3& b = vertices[(i + 1) % 3];
+        if (a[axis] >= lo && a[axis] <= hi) {
+            aabb.grow(a);
+        }
+
+        for (float plane : { lo, hi }) {
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                glm::vec3 p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = plane;
+                aabb.grow(p);
+            }
+        }
+    }
+    return math::intersection(aabb, t.aabb);
+}
+
+struct SpatialSplit {
+    float cost = std::numeric_limits<float>::infinity();
+    // -1 when no split fits into the budget
+    int axis = -1;
+    uint32_t bin = 0;
+    float lo = 0.0f;
+    float binWidth = 0.0f;
+};
+
+uint32_t spatialBinIndex(float x, float lo, float binWidth, uint32_t binsCount)
+{
+    return std::min((uint32_t)std::max((x - lo) / binWidth, 0.0f), binsCount - 1);
+}
+
+// Spatial split: references are chopped into bins of equal width along every axis,
+// a reference crossing the split plane counts on both sides. Splits which duplicate
+// more references than splitBudget or do not make both sides smaller are skipped.
+SpatialSplit findSpatialSplit(const std::vector<Triangle>& references, const math::Aabb& aabb, uint32_t binsCount, size_t splitBudget)
+{
+    struct Bin {
+        math::Aabb aabb;
+        size_t entries = 0;
+        size_t exits = 0;
+    };
+
+    size_t referencesSize = references.size();
+    std::vector<Bin> bins(binsCount);
+    std::vector<float> rightCosts(binsCount);
+    std::vector<size_t> rightCounts(binsCount);
+    SpatialSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = aabb.min()[axis];
+        float extent = aabb.max()[axis] - lo;
+        if (extent <= 0.0f) {
+            continue;
+        }
+
+        float binWidth = extent / binsCount;
+        std::fill(bins.begin(), bins.end(), Bin {});
+        for (const Triangle& r : references) {
+            uint32_t first = spatialBinIndex(r.aabb.min()[axis], lo, binWidth, binsCount);
+            uint32_t last = spatialBinIndex(r.aabb.max()[axis], lo, binWidth, binsCount);
+            for (uint32_t b = first; b <= last; b++) {
+                float binLo = b == first ? r.aabb.min()[axis] : lo + b * binWidth;
+                float binHi = b == last ? r.aabb.max()[axis] : lo + (b + 1) * binWidth;
+                bins[b].aabb.grow(clipTriangle(r, axis, binLo, binHi));
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        math::Aabb rightAabb;
+        size_t rightCount = 0;
+        for (uint32_t b = binsCount - 1; b > 0; b--) {
+            rightAabb.grow(bins[b].aabb);
+            rightCount += bins[b].exits;
+            rightCounts[b] = rightCount;
+            rightCosts[b] = rightAabb.area() * rightCount;
+        }
+
+        math::Aabb leftAabb;
+        size_t leftCount = 0;
+        for (uint32_t b = 0; b < binsCount - 1; b++) {
+            leftAabb.grow(bins[b].aabb);
+            leftCount += bins[b].entries;
+            rightCount = rightCounts[b + 1];
+            float cost = leftAabb.area() * leftCount + rightCosts[b + 1];
+            if (leftCount > 0 && rightCount > 0
+                && leftCount < referencesSize && rightCount < referencesSize
+                && leftCount + rightCount - referencesSize <= splitBudget
+                && cost < best.cost) {
+                best = {
+                    .cost = cost,
+                    .axis = axis,
+                    .bin = b + 1,
+                    .lo = lo,
+                    .binWidth = binWidth,
+                };
+            }
+        }
+    }
+    return best;
+}
+
+// Distributes references by the bins they touch, references touching bins on both
+// sides of the split are clipped by its plane and go to both sides.
+// Returns the number of duplicated references.
+size_t partitionSpatial(const std::vector<Triangle>& references,
+    uint32_t binsCount,
+    const SpatialSplit& split,
+    std::vector<Triangle>& left,
+    std::vector<Triangle>& right)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    float position = split.lo + split.bin * split.binWidth;
+    size_t duplicatesCount = 0;
+    for (const Triangle& r : references) {
+        uint32_t first = spatialBinIndex(r.aabb.min()[split.axis], split.lo, split.binWidth, binsCount);
+        uint32_t last = spatialBinIndex(r.aabb.max()[split.axis], split.lo, split.binWidth, binsCount);
+        if (last < split.bin) {
+            left.push_back(r);
+        } else if (first >= split.bin) {
+            right.push_back(r);
+        } else {
+            Triangle leftPart = r;
+            Triangle rightPart = r;
+            leftPart.aabb = clipTriangle(r, split.axis, -inf, position);
+            rightPart.aabb = clipTriangle(r, split.axis, position, inf);
+            // a triangle touching the plane only within float error clips to nothing,
+            // the box of the reference on that side of the plane is still conservative
+            glm::vec3 planeMin = r.aabb.min();
+            glm::vec3 planeMax = r.aabb.max();
+            planeMin[split.axis] = position;
+            planeMax[split.axis] = position;
+            if (leftPart.aabb.empty()) {
+                leftPart.aabb = math::Aabb(r.aabb.min(), planeMax);
+            }
+            if (rightPart.aabb.empty()) {
+                rightPart.aabb = math::Aabb(planeMin, r.aabb.max());
+            }
+            left.push_back(leftPart);
+            right.push_back(rightPart);
+            duplicatesCount++;
+        }
+    }
+    return duplicatesCount;
+}
+
+// Splits a range of sorted morton codes where its highest differing bit flips,
+// ranges of equal codes are split in the middle.
+size_t splitMorton(const std::vector<uint64_t>& mortonCodes, size_t start, size_t end)
+{
+    uint64_t first = mortonCodes[start];
+    uint64_t last = mortonCodes[end - 1];
+    if (first == last) {
+        return start + (end - start) / 2;
+    }
+
+    uint64_t bit = uint64_t(1) << (63 - std::countl_zero(first ^ last));
+    auto mid = std::partition_point(
+        mortonCodes.begin() + start,
+        mortonCodes.begin() + end,
+        [bit](uint64_t code) { return (code & bit) == 0; });
+    return mid - mortonCodes.begin();
+}
+
+// spreads the lower 21 bits of v so there are two zero bits between every two of them
+uint64_t expandBits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+// Sorts leafs by morton codes of their centroids with lsd radix sort,
+// returns the codes in the new leafs order.
+template <typename T>
+std::vector<uint64_t> sortByMortonCodes(std::vector<T>& leafs)
+{
+    math::Aabb centroidBounds;
+    for (const T& l : leafs) {
+        centroidBounds.grow(getAabb(l).centroid());
+    }
+
+    // 30 bit codes are enough to tell apart centroids of small inputs and need half of sort passes,
+    // large inputs get 63 bit codes
+    uint32_t bitsPerAxis = leafs.size() <= (1 << 16) ? 10 : 21;
+    float maxCoord = (float)((1u << bitsPerAxis) - 1);
+    glm::vec3 extent = centroidBounds.max() - centroidBounds.min();
+    glm::vec3 scale;
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = extent[axis] > 0.0f ? maxCoord / extent[axis] : 0.0f;
+    }
+
+    size_t leafsSize = leafs.size();
+    std::vector<uint64_t> codes(leafsSize);
+    std::vector<uint32_t> indices(leafsSize);
+    for (size_t i = 0; i < leafsSize; i++) {
+        glm::vec3 p = (getAabb(leafs[i]).centroid() - centroidBounds.min()) * scale;
+        codes[i] = expandBits((uint64_t)p.x) << 2 | expandBits((uint64_t)p.y) << 1 | expandBits((uint64_t)p.z);
+        indices[i] = (uint32_t)i;
+    }
+
+    std::vector<uint64_t> sortedCodes(leafsSize);
+    std::vector<uint32_t> sortedIndices(leafsSize);
+    for (uint32_t shift = 0; shift < bitsPerAxis * 3; shift += 8) {
+        size_t offsets[257] = {};
+        for (size_t i = 0; i < leafsSize; i++) {
+            offsets[((codes[i] >> shift) & 0xff) + 1]++;
+        }
+
+        for (size_t d = 1; d < 257; d++) {
+            offsets[d] += offsets[d - 1];
+        }
+
+        for (size_t i = 0; i < leafsSize; i++) {
+            size_t dst = offsets[(codes[i] >> shift) & 0xff]++;
+            sortedCodes[dst] = codes[i];
+            sortedIndices[dst] = indices[i];
+        }
+
+        codes.swap(sortedCodes);
+        indices.swap(sortedIndices);
+    }
+
+    std::vector<T> sortedLeafs;
+    sortedLeafs.reserve(leafsSize);
+    for (uint32_t i : indices) {
+        sortedLeafs.push_back(leafs[i]);
+    }
+
+    leafs = std::move(sortedLeafs);
+    return codes;
+}
+
+template <typename T>
+kernals::Array<T> toKernalArray(const std::vector<T>& v)
+{
+    return { .ptr = (T*)v.data(), .len = (uint32_t)v.size() };
+}
+
+kernals::Triangle toKernalTriangle(const Triangle& t)
+{
+    return {
+        .v0 = kernals::glmToHipFloat3(t.v0),
+        .v1 = kernals::glmToHipFloat3(t.v1),
+        .v2 = kernals::glmToHipFloat3(t.v2),
+        .triangleId = t.triangleIndex,
+    };
+}
+
+// leaf triangle ids are relative to the first triangle of the mesh until the mesh is appended
+BuildNode makeLeafNode(const std::vector<Triangle>&, size_t start, size_t end)
+{
+    BuildNode node;
+    node.type = kernals::TriangleType;
+    node.leafNode.firstLeafId = (uint32_t)start;
+    node.leafNode.leafsCount = (uint32_t)(end - start);
+    return node;
+}
+
+// a leaf node of a sphere set holds at most one packet of spheres
+BuildNode makeLeafNode(const std::vector<SphereLeaf>&, size_t start, size_t end)
+{
+    BuildNode node;
+    node.type = kernals::SpherePacketType;
+    node.leafNode.firstLeafId = (uint32_t)start;
+    node.leafNode.leafsCount = (uint32_t)(end - start);
+    return node;
+}
+
+// leafs of the tlas and of group trees become the instances with the same ids
+BuildNode makeLeafNode(const std::vector<Leaf>& leafs, size_t start, size_t end)
+{
+    BuildNode node;
+    switch (leafs[start].type) {
+    case SphereType: {
+        node.type = kernals::SphereType;
+        break;
+    }
+    case GroupInstanceType: {
+        node.type = kernals::GroupType;
+        break;
+    }
+    default: {
+        node.type = kernals::MeshType;
+        break;
+    }
+    }
+    node.leafNode.firstLeafId = (uint32_t)start;
+    node.leafNode.leafsCount = (uint32_t)(end - start);
+    return node;
+}
+
+kernals::Instance makeInstance(const Leaf& leaf)
+{
+    kernals::Instance instance = {
+        .materialId = leaf.materialId,
+        .transformId = leaf.transformId,
+        .blasNodeId = 0,
+    };
+    switch (leaf.type) {
+    case SphereType: {
+        return instance;
+    }
+    case MeshType: {
+        instance.blasNodeId = leaf.mesh->bvhId.value();
+        return instance;
+    }
+    case MeshInstanceType: {
+        instance.blasNodeId = leaf.meshInstance->mesh->bvhId.value();
+        return instance;
+    }
+    case SphereSetType: {
+        instance.blasNodeId = leaf.sphereSet->bvhId.value();
+        return instance;
+    }
+    case GroupInstanceType: {
+        instance.blasNodeId = leaf.groupInstance->group->bvhId.value();
+        return instance;
+    }
+    default: {
+        throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+    }
+}
+
+// subtrees with fewer leafs are built on the current thread,
+// forking them costs more than the build itself
+const size_t parallelBuildMinLeafs = 4096;
+
+BuildNode makeInternalNode(const math::Aabb& leftAabb, uint32_t leftId, const math::Aabb& rightAabb, uint32_t rightId)
+{
+    BuildNode node;
+    node.type = kernals::InternalNodeType;
+    node.internalNode.leftAabbMin = kernals::glmToHipFloat3(leftAabb.min());
+    node.internalNode.leftNodeId = leftId;
+    node.internalNode.leftAabbMax = kernals::glmToHipFloat3(leftAabb.max());
+    node.internalNode.rightNodeId = rightId;
+    node.internalNode.rightAabbMin = kernals::glmToHipFloat3(rightAabb.min());
+    node.internalNode.rightAabbMax = kernals::glmToHipFloat3(rightAabb.max());
+    return node;
+}
+
+// leafs of a treelet are restructured all at once, the optimal topology search
+// visits 3^n subset pairs, so larger treelets are not worth it
+const uint32_t treeletMaxLeafs = 7;
+
+struct Treelet {
+    uint32_t leafs[treeletMaxLeafs];
+    uint32_t leafsCount;
+    // root first, the other ones are reused for the new topology
+    uint32_t internals[treeletMaxLeafs - 1];
+    uint32_t internalsCount;
+    // per subset of leafs
+    math::Aabb aabbs[1 << treeletMaxLeafs];
+    float costs[1 << treeletMaxLeafs];
+    uint32_t partitions[1 << treeletMaxLeafs];
+    uint32_t heights[1 << treeletMaxLeafs];
+};
+
+// writes the subtree of the subset of treelet leafs over the next free internal node
+// and returns its node id
+uint32_t writeTreelet(std::vector<BuildNode>& nodes,
+    std::vector<math::Aabb>& aabbs,
+    std::vector<float>& costs,
+    std::vector<uint32_t>& heights,
+    Treelet& treelet,
+    uint32_t subset,
+    uint32_t& nextInternal)
+{
+    if (std::has_single_bit(subset)) {
+        return treelet.leafs[std::countr_zero(subset)];
+    }
+
+    uint32_t nodeId = treelet.internals[nextInternal++];
+    uint32_t left = treelet.partitions[subset];
+    uint32_t right = subset ^ left;
+    uint32_t leftId = writeTreelet(nodes, aabbs, costs, heights, treelet, left, nextInternal);
+    uint32_t rightId = writeTreelet(nodes, aabbs, costs, heights, treelet, right, nextInternal);
+    nodes[nodeId] = makeInternalNode(treelet.aabbs[left], leftId, treelet.aabbs[right], rightId);
+    aabbs[nodeId] = treelet.aabbs[subset];
+    costs[nodeId] = treelet.costs[subset];
+    heights[nodeId] = treelet.heights[subset];
+    return nodeId;
+}
+
+// Grows a treelet under rootId by opening its largest internal leafs, then finds the topology
+// of the treelet leafs with the lowest sah cost over all subsets of them and writes it
+// over the treelet internal nodes if it is cheaper and no higher than maxHeight.
+// Only nodes of the subtree are touched.
+void restructureTreelet(std::vector<BuildNode>& nodes,
+    std::vector<math::Aabb>& aabbs,
+    std::vector<float>& costs,
+    std::vector<uint32_t>& heights,
+    uint32_t rootId,
+    uint32_t maxHeight)
+{
+    // subtrees below were restructured already, the height of the root follows them even if it is kept
+    const kernals::BvhNode& root = nodes[rootId].internalNode;
+    heights[rootId] = std::max(heights[root.leftNodeId], heights[root.rightNodeId]) + 1;
+
+    Treelet treelet;
+    treelet.leafs[0] = nodes[rootId].internalNode.leftNodeId;
+    treelet.leafs[1] = nodes[rootId].internalNode.rightNodeId;
+    treelet.leafsCount = 2;
+    treelet.internals[0] = rootId;
+    treelet.internalsCount = 1;
+    while (treelet.leafsCount < treeletMaxLeafs) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (uint32_t i = 0; i < treelet.leafsCount; i++) {
+            uint32_t leafId = treelet.leafs[i];
+            if (nodes[leafId].type == kernals::InternalNodeType && aabbs[leafId].area() > largestArea) {
+                largest = (int)i;
+                largestArea = aabbs[leafId].area();
+            }
+        }
+
+        if (largest == -1) {
+            break;
+        }
+
+        const BuildNode& opened = nodes[treelet.leafs[largest]];
+        treelet.internals[treelet.internalsCount++] = treelet.leafs[largest];
+        treelet.leafs[largest] = opened.internalNode.leftNodeId;
+        treelet.leafs[treelet.leafsCount++] = opened.internalNode.rightNodeId;
+    }
+
+    // two leafs have one topology only
+    if (treelet.leafsCount < 3) {
+        return;
+    }
+
+    uint32_t fullSet = (1u << treelet.leafsCount) - 1;
+    for (uint32_t subset = 1; subset <= fullSet; subset++) {
+        uint32_t lowest = subset & (0u - subset);
+        uint32_t i = std::countr_zero(subset);
+        if (subset == lowest) {
+            treelet.aabbs[subset] = aabbs[treelet.leafs[i]];
+            treelet.costs[subset] = costs[treelet.leafs[i]];
+            treelet.heights[subset] = heights[treelet.leafs[i]];
+            continue;
+        }
+
+        treelet.aabbs[subset] = treelet.aabbs[lowest];
+        treelet.aabbs[subset].grow(treelet.aabbs[subset ^ lowest]);
+
+        // every split of the subset is visited once by keeping its lowest leaf on the left
+        uint32_t rest = subset ^ lowest;
+        float bestCost = std::numeric_limits<float>::infinity();
+        uint32_t bestPartition = lowest;
+        uint32_t q = rest;
+        do {
+            q = (q - 1) & rest;
+            uint32_t left = q | lowest;
+            float cost = treelet.costs[left] + treelet.costs[subset ^ left];
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestPartition = left;
+            }
+        } while (q != 0);
+
+        treelet.costs[subset] = treelet.aabbs[subset].area() + bestCost;
+        treelet.partitions[subset] = bestPartition;
+        treelet.heights[subset] = std::max(treelet.heights[bestPartition], treelet.heights[subset ^ bestPartition]) + 1;
+    }
+
+    // a cheaper topology can be a deeper one, the traversal stack only fits trees of kernals::maxBvhDepth
+    if (!(treelet.costs[fullSet] < costs[rootId]) || treelet.heights[fullSet] > maxHeight) {
+        return;
+    }
+
+    uint32_t nextInternal = 0;
+    writeTreelet(nodes, aabbs, costs, heights, treelet, fullSet, nextInternal);
+}
+
+// Treelet restructuring (Karras and Aila 2013) of a post order tree. Subtrees of nodes
+// with the same height are disjoint, so heights are restructured bottom-up and the nodes
+// of one height in parallel. The root keeps its id, so the tree stays rooted at its last node.
+// Depths of nodes only change by restructuring above them, so a treelet whose depth plus height
+// stays within kernals::maxBvhDepth keeps the whole tree within it.
+void optimizeTreelets(std::vector<BuildNode>& nodes, ThreadPool& threadPool)
+{
+    uint32_t rootId = (uint32_t)(nodes.size() - 1);
+    if (nodes[rootId].type != kernals::InternalNodeType) {
+        return;
+    }
+
+    // sah cost of a subtree: areas of its internal nodes plus areas of its leafs times their triangles count
+    std::vector<math::Aabb> aabbs(nodes.size());
+    std::vector<float> costs(nodes.size());
+    std::vector<uint32_t> heights(nodes.size());
+    std::vector<uint32_t> depths(nodes.size());
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size());
+    std::vector<uint32_t> stack;
+    stack.push_back(rootId);
+    aabbs[rootId] = getChildrenAabb(nodes[rootId].internalNode);
+    while (!stack.empty()) {
+        uint32_t nodeId = stack.back();
+        stack.pop_back();
+        order.push_back(nodeId);
+
+        const BuildNode& node = nodes[nodeId];
+        if (node.type == kernals::InternalNodeType) {
+            const kernals::BvhNode& n = node.internalNode;
+            aabbs[n.leftNodeId] = toAabb(n.leftAabbMin, n.leftAabbMax);
+            aabbs[n.rightNodeId] = toAabb(n.rightAabbMin, n.rightAabbMax);
+            depths[n.leftNodeId] = depths[nodeId] + 1;
+            depths[n.rightNodeId] = depths[nodeId] + 1;
+            stack.push_back(n.rightNodeId);
+            stack.push_back(n.leftNodeId);
+        }
+    }
+
+    for (auto it = order.rbegin(); it != order.rend(); it++) {
+        const BuildNode& node = nodes[*it];
+        if (node.type == kernals::InternalNodeType) {
+            uint32_t leftId = node.internalNode.leftNodeId;
+            uint32_t rightId = node.internalNode.rightNodeId;
+            heights[*it] = std::max(heights[leftId], heights[rightId]) + 1;
+            costs[*it] = aabbs[*it].area() + costs[leftId] + costs[rightId];
+        } else {
+            heights[*it] = 0;
+            costs[*it] = aabbs[*it].area() * node.leafNode.leafsCount;
+        }
+    }
+
+    std::vector<std::vector<uint32_t>> levels(heights[rootId] + 1);
+    for (uint32_t nodeId : order) {
+        if (heights[nodeId] > 0) {
+            levels[heights[nodeId]].push_back(nodeId);
+        }
+    }
+
+    for (const std::vector<uint32_t>& level : levels) {
+        threadPool.parallelFor(level.size(), [&](size_t i) {
+            restructureTreelet(nodes, aabbs, costs, heights, level[i], kernals::maxBvhDepth - depths[level[i]]);
+        });
+    }
+}
+
+// Appends a subtree that was built into its own nodes array, child ids are shifted
+// by its new offset and triangle leafs by trianglesOffset. Forked subtrees are appended
+// in the same order the serial build would have pushed them, so the output does not
+// depend on threads count.
+// Returns the id of the last appended node, that is the subtree root of a post order build.
+uint32_t appendSubtree(std::vector<BuildNode>& nodes, const std::vector<BuildNode>& subtree, uint32_t trianglesOffset = 0)
+{
+    uint32_t offset = (uint32_t)nodes.size();
+    for (BuildNode node : subtree) {
+        if (node.type == kernals::InternalNodeType) {
+            node.internalNode.leftNodeId += offset;
+            node.internalNode.rightNodeId += offset;
+        } else if (node.type == kernals::TriangleType) {
+            node.leafNode.firstLeafId += trianglesOffset;
+        }
+        nodes.push_back(node);
+    }
+    return (uint32_t)(nodes.size() - 1);
+}
+
+// Builders emit nodes in post order with the root last. Only internal nodes are kept,
+// renumbered so the root comes first and an internal left child directly follows its parent,
+// a traversal then mostly reads the next node. Leafs become node references made by leafReference.
+// Returns the reference to the root.
+template <typename LeafReference>
+uint32_t compactTree(const std::vector<BuildNode>& nodes, std::vector<kernals::BvhNode>& compacted, const LeafReference& leafReference)
+{
+    struct StackEntry {
+        uint32_t nodeId;
+        uint32_t parentId;
+        bool right;
+    };
+
+    const uint32_t noParent = 0xffffffff;
+    uint32_t rootRef = 0;
+    compacted.clear();
+    compacted.reserve(nodes.size() / 2);
+    std::vector<StackEntry> stack;
+    stack.push_back({ (uint32_t)(nodes.size() - 1), noParent, false });
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        const BuildNode& node = nodes[entry.nodeId];
+        uint32_t nodeRef;
+        if (node.type == kernals::InternalNodeType) {
+            uint32_t newId = (uint32_t)compacted.size();
+            nodeRef = kernals::makeNodeRef(kernals::InternalNodeType, newId);
+            compacted.push_back(node.internalNode);
+            compacted.back()._padding0 = 0;
+            compacted.back()._padding1 = 0;
+            stack.push_back({ node.internalNode.rightNodeId, newId, true });
+            stack.push_back({ node.internalNode.leftNodeId, newId, false });
+        } else {
+            nodeRef = leafReference(node);
+        }
+
+        if (entry.parentId == noParent) {
+            rootRef = nodeRef;
+        } else if (entry.right) {
+            compacted[entry.parentId].rightNodeId = nodeRef;
+        } else {
+            compacted[entry.parentId].leftNodeId = nodeRef;
+        }
+    }
+    return rootRef;
+}
+
+// shifts a reference into the nodes and triangles or sphere packets of one blas to the buffers all blas are appended to
+uint32_t offsetNodeRef(uint32_t nodeRef, uint32_t nodesOffset, uint32_t trianglesOffset)
+{
+    return nodeRef + (kernals::getNodeType(nodeRef) == kernals::InternalNodeType ? nodesOffset : trianglesOffset);
+}
+
+// Appends the group and the groups instanced in it to groups, instanced groups first.
+// Returns the instance levels the tree of the group spans, the group itself included.
+uint32_t collectGroups(Group* group, std::unordered_map<Group*, uint32_t>& groupLevels, std::vector<Group*>& groups)
+{
+    // 0 marks a group whose instanced groups are still being collected
+    auto collected = groupLevels.try_emplace(group, 0);
+    if (!collected.second) {
+        if (collected.first->second == 0) {
+            throw std::runtime_error("[ornament] group cannot be instanced in itself.");
+        }
+        return collected.first->second;
+    }
+
+    if (group->spheres.empty() && group->meshInstances.empty() && group->groupInstances.empty()) {
+        throw std::runtime_error("[ornament] group cannot be empty.");
+    }
+
+    uint32_t levels = 1;
+    for (auto& gi : group->groupInstances) {
+        levels = std::max(levels, collectGroups(gi->group.get(), groupLevels, groups) + 1);
+    }
+    groupLevels[group] = levels;
+    groups.push_back(group);
+    return levels;
+}
+
+Bvh::Bvh(const Scene& scene)
+    : m_options(scene.getBvhOptions())
+{
+    if (m_options.sahBinsCount < 2) {
+        throw std::runtime_error("[ornament] bvh sah bins count must be at least 2.");
+    }
+    if (m_options.maxLeafSize < 1) {
+        throw std::runtime_error("[ornament] bvh max leaf size must be at least 1.");
+    }
+    if (!(m_options.sbvhSplitBudget >= 0.0f)) {
+        throw std::runtime_error("[ornament] sbvh split budget cannot be negative.");
+    }
+
+    size_t shapesCount = scene.getAttachedSpheres().size()
+        + scene.getAttachedMeshes().size()
+        + scene.getAttachedMeshInstances().size()
+        + scene.getAttachedSphereSets().size()
+        + scene.getAttachedGroupInstances().size();
+    if (shapesCount == 0) {
+        throw std::runtime_error("[ornament] scene cannot be empty.");
+    }
+
+    std::unordered_map<Group*, uint32_t> groupLevels;
+    std::vector<Group*> groups;
+    for (auto& gi : scene.getAttachedGroupInstances()) {
+        if (collectGroups(gi->group.get(), groupLevels, groups) >= kernals::maxInstanceLevels) {
+            throw std::runtime_error("[ornament] group instances are nested deeper than the traversal supports.");
+        }
+    }
+
+    // leafs are not nodes, a binary tree of n leafs has n - 1 internal nodes
+    size_t tlasNodesCount = shapesCount - 1;
+    size_t instancesCount = shapesCount;
+    for (Group* g : groups) {
+        size_t groupShapesCount = g->spheres.size() + g->meshInstances.size() + g->sphereSets.size() + g->groupInstances.size();
+        tlasNodesCount += groupShapesCount - 1;
+        instancesCount += groupShapesCount;
+        m_groupTrees.push_back({ .group = g });
+    }
+
+    // blas nodes count depends on leaf sizes, it is only a guess for the reservation
+    size_t blasNodesCount = 0;
+    size_t trianglesCount = 0;
+    size_t normalsCount = 0;
+    size_t normalIndicesCount = 0;
+    size_t uvsCount = 0;
+    size_t uvIndicesCount = 0;
+    std::unordered_set<const Mesh*> meshes;
+    for (auto& m : scene.getAttachedMeshes()) {
+        meshes.insert(m.get());
+    }
+    for (auto& mi : scene.getAttachedMeshInstances()) {
+        meshes.insert(mi->mesh.get());
+    }
+    for (Group* g : groups) {
+        for (auto& mi : g->meshInstances) {
+            meshes.insert(mi->mesh.get());
+        }
+    }
+    std::unordered_set<const SphereSet*> sphereSets;
+    for (auto& s : scene.getAttachedSphereSets()) {
+        sphereSets.insert(s.get());
+    }
+    for (Group* g : groups) {
+        for (auto& s : g->sphereSets) {
+            sphereSets.insert(s.get());
+        }
+    }
+    size_t spherePacketsCount = 0;
+    for (const SphereSet* s : sphereSets) {
+        if (s->bvhId.has_value()) {
+            continue;
+        }
+        size_t packets = s->centers.size() / kernals::spherePacketWidth + 1;
+        spherePacketsCount += packets;
+        blasNodesCount += packets;
+    }
+    for (const Mesh* m : meshes) {
+        if (m->bvhId.has_value()) {
+            continue;
+        }
+        size_t triangles = m->vertexIndices.size() / 3;
+        trianglesCount += triangles;
+        blasNodesCount += triangles / m_options.maxLeafSize + 1;
+        normalsCount += m->normals.size();
+        normalIndicesCount += m->normalIndices.size();
+        uvsCount += m->uvs.size();
+        uvIndicesCount += m->uvIndices.size();
+    }
+
+    m_tlasNodes.reserve(tlasNodesCount);
+    m_instances.reserve(instancesCount);
+    m_blasNodes.reserve(blasNodesCount);
+    m_triangles.reserve(trianglesCount);
+    m_spherePackets.reserve(spherePacketsCount);
+    if (m_options.packShadingAttributes) {
+        m_shadingRecords.reserve(trianglesCount);
+    } else {
+        m_normals.reserve(normalsCount);
+        m_normalIndices.reserve(normalIndicesCount);
+        m_uvs.reserve(uvsCount);
+        m_uvIndices.reserve(uvIndicesCount);
+    }
+    m_transforms.reserve(instancesCount);
+    m_materials.reserve(scene.getMaterials().size());
+    m_materialObjects.reserve(scene.getMaterials().size());
+    m_textures.reserve(scene.getTextures().size());
+
+    build(scene);
+
+    if (tlasNodesCount != m_tlasNodes.size()) {
+        throw std::runtime_error("[ornament] expected tlas noodes count is not equal to actual tlas noodes count.");
+    }
+}
+
+void Bvh::build(const Scene& scene)
+{
+    ThreadPool threadPool(m_options.buildThreadsCount);
+    std::vector<Leaf> leafs;
+    leafs.reserve(scene.getAttachedSpheres().size()
+        + scene.getAttachedMeshes().size()
+        + scene.getAttachedMeshInstances().size()
+        + scene.getAttachedSphereSets().size()
+        + scene.getAttachedGroupInstances().size());
+    std::vector<Mesh*> meshes;
+    std::unordered_set<Mesh*> uniqueMeshes;
+    std::vector<SphereSet*> sphereSets;
+    std::unordered_set<SphereSet*> uniqueSphereSets;
+
+    // transforms and materials are assigned up front in scene order,
+    // so the tlas build below only reads the leafs and can run in parallel
+    auto addTransform = [this](const glm::mat4& transform) {
+        appendTransform(glm::inverse(transform));
+        return (uint32_t)(m_transforms.size() - 1);
+    };
+
+    auto addMesh = [&](Mesh* mesh) {
+        if (!mesh->bvhId.has_value() && uniqueMeshes.insert(mesh).second) {
+            meshes.push_back(mesh);
+        }
+    };
+
+    auto addSphere = [&](std::vector<Leaf>& leafs, Sphere* s) {
+        leafs.push_back({
+            .type = SphereType,
+            .sphere = s,
+            .materialId = getMaterialIndex(*s->material),
+            .transformId = addTransform(s->transform),
+        });
+    };
+
+    auto addMeshInstance = [&](std::vector<Leaf>& leafs, MeshInstance* mi) {
+        leafs.push_back({
+            .type = MeshInstanceType,
+            .meshInstance = mi,
+            .materialId = getMaterialIndex(*mi->material),
+            .transformId = addTransform(mi->transform),
+        });
+        addMesh(mi->mesh.get());
+    };
+
+    // spheres of a set have materials of their own
+    auto addSphereSet = [&](std::vector<Leaf>& leafs, SphereSet* s) {
+        leafs.push_back({
+            .type = SphereSetType,
+            .sphereSet = s,
+            .materialId = 0,
+            .transformId = addTransform(s->transform),
+        });
+        if (!s->bvhId.has_value() && uniqueSphereSets.insert(s).second) {
+            sphereSets.push_back(s);
+        }
+    };
+
+    // shapes of a group have materials of their own
+    auto addGroupInstance = [&](std::vector<Leaf>& leafs, GroupInstance* gi) {
+        leafs.push_back({
+            .type = GroupInstanceType,
+            .groupInstance = gi,
+            .materialId = 0,
+            .transformId = addTransform(gi->transform),
+        });
+    };
+
+    for (auto& s : scene.getAttachedSpheres()) {
+        addSphere(leafs, s.get());
+    }
+
+    for (auto& mi : scene.getAttachedMeshInstances()) {
+        addMeshInstance(leafs, mi.get());
+    }
+
+    for (auto& m : scene.getAttachedMeshes()) {
+        leafs.push_back({
+            .type = MeshType,
+            .mesh = m.get(),
+            .materialId = getMaterialIndex(*m->material),
+            .transformId = addTransform(m->transform),
+        });
+        addMesh(m.get());
+    }
+
+    for (auto& s : scene.getAttachedSphereSets()) {
+        addSphereSet(leafs, s.get());
+    }
+
+    for (auto& gi : scene.getAttachedGroupInstances()) {
+        addGroupInstance(leafs, gi.get());
+    }
+
+    std::vector<std::vector<Leaf>> groupsLeafs(m_groupTrees.size());
+    for (size_t i = 0; i < m_groupTrees.size(); i++) {
+        Group& group = *m_groupTrees[i].group;
+        for (auto& s : group.spheres) {
+            addSphere(groupsLeafs[i], s.get());
+        }
+        for (auto& mi : group.meshInstances) {
+            addMeshInstance(groupsLeafs[i], mi.get());
+        }
+        for (auto& s : group.sphereSets) {
+            addSphereSet(groupsLeafs[i], s.get());
+        }
+        for (auto& gi : group.groupInstances) {
+            addGroupInstance(groupsLeafs[i], gi.get());
+        }
+    }
+
+    buildMeshesBvh(meshes, threadPool);
+    buildSphereSetsBvh(sphereSets, threadPool);
+    checkNodeRefIds();
+
+    // groups come inner first, bounds of the groups instanced in one are known when it is built
+    for (size_t i = 0; i < m_groupTrees.size(); i++) {
+        GroupTree& tree = m_groupTrees[i];
+        tree.firstNodeId = (uint32_t)m_tlasNodes.size();
+        tree.group->bvhId = buildInstancesTree(groupsLeafs[i], tree.group->aabb, threadPool);
+        tree.nodesCount = (uint32_t)m_tlasNodes.size() - tree.firstNodeId;
+    }
+
+    math::Aabb aabb;
+    m_tlasFirstNodeId = (uint32_t)m_tlasNodes.size();
+    m_tlasFirstLeafId = (uint32_t)m_leafs.size();
+    m_tlasRootId = buildInstancesTree(leafs, aabb, threadPool);
+    checkNodeRefIds();
+    m_tlasBuildSahCost = sahCost(m_tlasNodes, m_tlasRootId);
+    m_freedTlasNodes.assign(m_tlasNodes.size(), false);
+
+    for (const Leaf& leaf : m_leafs) {
+        m_instances.push_back(makeInstance(leaf));
+    }
+}
+
+void Bvh::checkNodeRefIds() const
+{
+    const size_t maxIds = (size_t)kernals::getNodeId(std::numeric_limits<uint32_t>::max()) + 1;
+    if (m_tlasNodes.size() > maxIds || m_leafs.size() > maxIds || m_blasNodes.size() > maxIds
+        || m_triangles.size() > maxIds || m_spherePackets.size() > maxIds) {
+        throw std::runtime_error("[ornament] bvh has too many nodes or leafs for node references.");
+    }
+}
+
+uint32_t Bvh::buildInstancesTree(std::vector<Leaf>& leafs, math::Aabb& aabb, ThreadPool& threadPool)
+{
+    // blas and group trees are built now, bounds of their instances are tightened with them
+    for (const Leaf& leaf : leafs) {
+        if (leaf.type != SphereType) {
+            updateAabb(leaf);
+        }
+    }
+
+    std::vector<uint64_t> mortonCodes;
+    if (m_options.tlasBuilder == LbvhBuilderType) {
+        mortonCodes = sortByMortonCodes(leafs);
+    }
+
+    std::vector<BuildNode> nodes;
+    nodes.reserve(leafs.size() * 2 - 1);
+    buildBvhRecursive(leafs, mortonCodes, 1, 0, leafs.size(), 0, nodes, aabb, threadPool);
+
+    // every leaf node holds a single leaf, the k-th leaf is the k-th instance
+    uint32_t leafsOffset = (uint32_t)m_leafs.size();
+    uint32_t nodesOffset = (uint32_t)m_tlasNodes.size();
+    m_leafs.insert(m_leafs.end(), leafs.begin(), leafs.end());
+
+    std::vector<kernals::BvhNode> compacted;
+    uint32_t rootRef = compactTree(nodes, compacted, [leafsOffset](const BuildNode& leaf) {
+        return kernals::makeNodeRef(leaf.type, leafsOffset + leaf.leafNode.firstLeafId);
+    });
+    for (kernals::BvhNode& node : compacted) {
+        node.leftNodeId = offsetNodeRef(node.leftNodeId, nodesOffset, 0);
+        node.rightNodeId = offsetNodeRef(node.rightNodeId, nodesOffset, 0);
+        m_tlasNodes.push_back(node);
+    }
+    return offsetNodeRef(rootRef, nodesOffset, 0);
+}
+
+void Bvh::buildMeshesBvh(const std::vector<Mesh*>& meshes, ThreadPool& threadPool)
+{
+    // shading attributes are a plain copy, appending them serially fixes
+    // the global triangle ids of every mesh before the parallel build starts
+    std::vector<BlasRange> ranges(meshes.size());
+    uint32_t trianglesOffset = 0;
+    for (size_t i = 0; i < meshes.size(); i++) {
+        Mesh& mesh = *meshes[i];
+        size_t trianglesCount = mesh.vertexIndices.size() / 3;
+        ranges[i].primitivesCount = (uint32_t)trianglesCount;
+        ranges[i].firstTriangleId = trianglesOffset;
+        ranges[i].firstNormalId = (uint32_t)m_normals.size();
+        ranges[i].normalsCount = (uint32_t)mesh.normals.size();
+        ranges[i].firstNormalIndex = (uint32_t)m_normalIndices.size();
+        ranges[i].firstUvId = (uint32_t)m_uvs.size();
+        ranges[i].uvsCount = (uint32_t)mesh.uvs.size();
+        ranges[i].firstUvIndex = (uint32_t)m_uvIndices.size();
+        trianglesOffset += (uint32_t)trianglesCount;
+
+        if (m_options.packShadingAttributes) {
+            for (size_t t = 0; t < trianglesCount; t++) {
+                kernals::ShadingRecord record;
+                for (size_t k = 0; k < 3; k++) {
+                    glm::vec3 n = mesh.normals[mesh.normalIndices[t * 3 + k]];
+                    glm::vec2 uv = mesh.uvs[mesh.uvIndices[t * 3 + k]];
+                    record.normals[k] = kernals::encodeOctahedral(kernals::glmToHipFloat3(n));
+                    record.uvs[k] = kernals::encodeHalf2(make_float2(uv.x, uv.y));
+                }
+                m_shadingRecords.push_back(record);
+            }
+            continue;
+        }
+
+        for (uint32_t ni : mesh.normalIndices) {
+            m_normalIndices.push_back(ni + m_normals.size());
+        }
+
+        for (glm::vec3& n : mesh.normals) {
+            m_normals.push_back(make_float4(kernals::glmToHipFloat3(n), 0.0f));
+        }
+
+        for (uint32_t uvi : mesh.uvIndices) {
+            m_uvIndices.push_back(uvi + m_uvs.size());
+        }
+
+        for (glm::vec2& uv : mesh.uvs) {
+            m_uvs.push_back(make_float2(uv.x, uv.y));
+        }
+    }
+
+    std::optional<BlasCache> cache;
+    if (!m_options.blasCacheDirPath.empty()) {
+        cache.emplace(m_options.blasCacheDirPath);
+    }
+
+    std::vector<MeshBvh> meshesBvh(meshes.size());
+    threadPool.parallelFor(meshes.size(), [&](size_t i) {
+        if (!cache) {
+            meshesBvh[i] = buildMeshBvh(*meshes[i], threadPool);
+            return;
+        }
+
+        uint64_t key = BlasCache::getKey(*meshes[i], m_options);
+        if (!cache->load(key, (uint32_t)(meshes[i]->vertexIndices.size() / 3), meshesBvh[i])) {
+            meshesBvh[i] = buildMeshBvh(*meshes[i], threadPool);
+            cache->save(key, meshesBvh[i]);
+        }
+    });
+
+    // sbvh meshes have more triangle references than triangles,
+    // so offsets in the triangles buffer are known only after the build
+    for (size_t i = 0; i < meshes.size(); i++) {
+        MeshBvh& meshBvh = meshesBvh[i];
+        uint32_t nodesOffset = (uint32_t)m_blasNodes.size();
+        uint32_t trianglesOffset = (uint32_t)m_triangles.size();
+        meshes[i]->bvhId = offsetNodeRef(meshBvh.rootNodeId, nodesOffset, trianglesOffset);
+        for (kernals::BvhNode node : meshBvh.nodes) {
+            node.leftNodeId = offsetNodeRef(node.leftNodeId, nodesOffset, trianglesOffset);
+            node.rightNodeId = offsetNodeRef(node.rightNodeId, nodesOffset, trianglesOffset);
+            m_blasNodes.push_back(node);
+        }
+        for (kernals::Triangle t : meshBvh.triangles) {
+            t.triangleId += ranges[i].firstTriangleId;
+            m_triangles.push_back(t);
+        }
+        ranges[i].firstNodeId = nodesOffset;
+        ranges[i].nodesCount = (uint32_t)meshBvh.nodes.size();
+        ranges[i].firstLeafId = trianglesOffset;
+        ranges[i].leafsCount = (uint32_t)meshBvh.triangles.size();
+        m_meshBlasRanges[meshes[i]] = std::move(ranges[i]);
+        m_sbvhStats.spatialSplitsCount += meshBvh.sbvhStats.spatialSplitsCount;
+        m_sbvhStats.duplicatedReferencesCount += meshBvh.sbvhStats.duplicatedReferencesCount;
+        m_sbvhStats.objectSplitOverlap += meshBvh.sbvhStats.objectSplitOverlap;
+        m_sbvhStats.overlap += meshBvh.sbvhStats.overlap;
+        meshBvh = {};
+    }
+
+    if (m_sbvhStats.objectSplitOverlap > 0.0f) {
+        m_sbvhStats.overlapReduction = 1.0f - m_sbvhStats.overlap / m_sbvhStats.objectSplitOverlap;
+    }
+}
+
+// triangle ids are relative to the first triangle of the mesh until the mesh is appended
+MeshBvh Bvh::buildMeshBvh(const Mesh& mesh, ThreadPool& threadPool) const
+{
+    size_t trianglesCount = mesh.vertexIndices.size() / 3;
+    if (trianglesCount == 0) {
+        throw std::runtime_error("[ornament] mesh cannot be empty.");
+    }
+
+    std::vector<Triangle> leafs;
+    leafs.reserve(trianglesCount);
+
+    for (size_t meshTriangleIndex = 0; meshTriangleIndex < trianglesCount; meshTriangleIndex++) {
+        auto v0 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3]];
+        auto v1 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3 + 1]];
+        auto v2 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3 + 2]];
+        math::Aabb aabb(glm::min(glm::min(v0, v1), v2), glm::max(glm::max(v0, v1), v2));
+
+        leafs.push_back({
+            .v0 = v0,
+            .v1 = v1,
+            .v2 = v2,
+            .triangleIndex = (uint32_t)meshTriangleIndex,
+            .aabb = aabb,
+        });
+    }
+
+    MeshBvh meshBvh;
+    math::Aabb aabb;
+    std::vector<BuildNode> nodes;
+    if (mesh.bvhBuilder == SbvhBuilderType) {
+        size_t splitBudget = (size_t)(trianglesCount * m_options.sbvhSplitBudget);
+        math::Aabb rootAabb;
+        for (const Triangle& t : leafs) {
+            rootAabb.grow(t.aabb);
+        }
+        float rootArea = rootAabb.area() > 0.0f ? rootAabb.area() : 1.0f;
+
+        std::vector<Triangle> references = std::move(leafs);
+        leafs = {};
+        leafs.reserve(trianglesCount + splitBudget);
+        nodes.reserve(((trianglesCount + splitBudget) / m_options.maxLeafSize + 1) * 2);
+        buildSbvhRecursive(references, splitBudget, rootArea, 0, nodes, leafs, aabb, meshBvh.sbvhStats, threadPool);
+    } else {
+        std::vector<uint64_t> mortonCodes;
+        if (mesh.bvhBuilder == LbvhBuilderType) {
+            mortonCodes = sortByMortonCodes(leafs);
+        }
+
+        nodes.reserve((trianglesCount / m_options.maxLeafSize + 1) * 2);
+        buildBvhRecursive(leafs, mortonCodes, m_options.maxLeafSize, 0, leafs.size(), 0, nodes, aabb, threadPool);
+    }
+
+    for (uint32_t pass = 0; pass < m_options.treeletOptimizationPasses; pass++) {
+        optimizeTreelets(nodes, threadPool);
+    }
+
+    // leafs are in the order of leaf nodes now, every leaf node is a contiguous range of them
+    meshBvh.triangles.reserve(leafs.size());
+    for (const Triangle& t : leafs) {
+        meshBvh.triangles.push_back(toKernalTriangle(t));
+    }
+    meshBvh.rootNodeId = compactTree(nodes, meshBvh.nodes, [&](const BuildNode& leaf) {
+        meshBvh.triangles[leaf.leafNode.firstLeafId + leaf.leafNode.leafsCount - 1].triangleId |= kernals::lastTriangleFlag;
+        return kernals::makeNodeRef(kernals::TriangleType, leaf.leafNode.firstLeafId);
+    });
+    return meshBvh;
+}
+
+void Bvh::buildSphereSetsBvh(const std::vector<SphereSet*>& sphereSets, ThreadPool& threadPool)
+{
+    // materials are assigned serially in scene order, the sets are built in parallel then
+    std::vector<std::vector<uint32_t>> materialIds(sphereSets.size());
+    for (size_t i = 0; i < sphereSets.size(); i++) {
+        for (auto& m : sphereSets[i]->materials) {
+            materialIds[i].push_back(getMaterialIndex(*m));
+        }
+    }
+
+    std::vector<SphereSetBvh> sphereSetsBvh(sphereSets.size());
+    threadPool.parallelFor(sphereSets.size(), [&](size_t i) {
+        sphereSetsBvh[i] = buildSphereSetBvh(*sphereSets[i], materialIds[i], threadPool);
+    });
+
+    // sets share the blas nodes with meshes, their leafs point into the sphere packets
+    for (size_t i = 0; i < sphereSets.size(); i++) {
+        SphereSetBvh& sphereSetBvh = sphereSetsBvh[i];
+        uint32_t nodesOffset = (uint32_t)m_blasNodes.size();
+        uint32_t packetsOffset = (uint32_t)m_spherePackets.size();
+        sphereSets[i]->bvhId = offsetNodeRef(sphereSetBvh.rootNodeId, nodesOffset, packetsOffset);
+        for (kernals::BvhNode node : sphereSetBvh.nodes) {
+            node.leftNodeId = offsetNodeRef(node.leftNodeId, nodesOffset, packetsOffset);
+            node.rightNodeId = offsetNodeRef(node.rightNodeId, nodesOffset, packetsOffset);
+            m_blasNodes.push_back(node);
+        }
+        m_spherePackets.insert(m_spherePackets.end(), sphereSetBvh.packets.begin(), sphereSetBvh.packets.end());
+        m_sphereSetBlasRanges[sphereSets[i]] = {
+            .firstNodeId = nodesOffset,
+            .nodesCount = (uint32_t)sphereSetBvh.nodes.size(),
+            .firstLeafId = packetsOffset,
+            .leafsCount = (uint32_t)sphereSetBvh.packets.size(),
+            .primitivesCount = (uint32_t)sphereSets[i]->centers.size(),
+            .sphereIds = std::move(sphereSetBvh.sphereIds),
+        };
+        sphereSetBvh = {};
+    }
+}
+
+SphereSetBvh Bvh::buildSphereSetBvh(const SphereSet& sphereSet, const std::vector<uint32_t>& materialIds, ThreadPool& threadPool) const
+{
+    size_t spheresCount = sphereSet.centers.size();
+    if (spheresCount == 0) {
+        throw std::runtime_error("[ornament] sphere set cannot be empty.");
+    }
+    if (sphereSet.bvhBuilder == SbvhBuilderType) {
+        throw std::runtime_error("[ornament] sphere set cannot be built by the sbvh builder.");
+    }
+
+    std::vector<SphereLeaf> leafs;
+    leafs.reserve(spheresCount);
+    for (size_t i = 0; i < spheresCount; i++) {
+        glm::vec3 center = sphereSet.centers[i];
+        float radius = sphereSet.radii[i];
+        leafs.push_back({
+            .center = center,
+            .radius = radius,
+            .materialId = materialIds[i],
+            .sphereId = (uint32_t)i,
+            .aabb = math::Aabb(center - glm::vec3(radius), center + glm::vec3(radius)),
+        });
+    }
+
+    std::vector<uint64_t> mortonCodes;
+    if (sphereSet.bvhBuilder == LbvhBuilderType) {
+        mortonCodes = sortByMortonCodes(leafs);
+    }
+
+    // a leaf is tested as one packet, so it holds no more spheres than a packet
+    uint32_t maxLeafSize = std::min(m_options.maxLeafSize, kernals::spherePacketWidth);
+    std::vector<BuildNode> nodes;
+    nodes.reserve((spheresCount / maxLeafSize + 1) * 2);
+    math::Aabb aabb;
+    buildBvhRecursive(leafs, mortonCodes, maxLeafSize, 0, leafs.size(), 0, nodes, aabb, threadPool);
+
+    for (uint32_t pass = 0; pass < m_options.treeletOptimizationPasses; pass++) {
+        optimizeTreelets(nodes, threadPool);
+    }
+
+    SphereSetBvh sphereSetBvh;
+    sphereSetBvh.rootNodeId = compactTree(nodes, sphereSetBvh.nodes, [&](const BuildNode& leaf) {
+        kernals::SpherePacket packet;
+        for (uint32_t lane = 0; lane < kernals::spherePacketWidth; lane++) {
+            const SphereLeaf& s = leafs[leaf.leafNode.firstLeafId + std::min(lane, leaf.leafNode.leafsCount - 1)];
+            packet.centerX[lane] = s.center.x;
+            packet.centerY[lane] = s.center.y;
+            packet.centerZ[lane] = s.center.z;
+            packet.radius[lane] = s.radius;
+            packet.materialIds[lane] = s.materialId;
+            sphereSetBvh.sphereIds.push_back(s.sphereId);
+        }
+        sphereSetBvh.packets.push_back(packet);
+        return kernals::makeNodeRef(kernals::SpherePacketType, (uint32_t)(sphereSetBvh.packets.size() - 1));
+    });
+    return sphereSetBvh;
+}
+
+template <typename T>
+uint32_t Bvh::buildBvhRecursive(std::vector<T>& leafs,
+    const std::vector<uint64_t>& mortonCodes,
+    uint32_t maxLeafSize,
+    size_t start,
+    size_t end,
+    uint32_t depth,
+    std::vector<BuildNode>& nodes,
+    math::Aabb& aabb,
+    ThreadPool& threadPool) const
+{
+    size_t leafsSize = end - start;
+    uint32_t medianDepth = getMedianDepth(leafsSize, maxLeafSize);
+    if (leafsSize == 0) {
+        throw std::runtime_error("[ornament] bvh cannot be built from zero leafs.");
+    } else if (depth + medianDepth > kernals::maxBvhDepth) {
+        throw std::runtime_error("[ornament] bvh has more leafs than its max depth can hold.");
+    } else if (leafsSize <= maxLeafSize) {
+        aabb = getAabb(leafs[start]);
+        for (size_t i = start + 1; i < end; i++) {
+            aabb.grow(getAabb(leafs[i]));
+        }
+        nodes.push_back(makeLeafNode(leafs, start, end));
+        return (uint32_t)(nodes.size() - 1);
+    } else {
+        // morton codes are given only for the lbvh build, leafs are already sorted by them then,
+        // a subtree with no depth to spare is split at the median
+        size_t mid;
+        if (depth + medianDepth >= kernals::maxBvhDepth) {
+            mid = mortonCodes.empty() ? splitMedian(leafs, start, end) : start + leafsSize / 2;
+        } else {
+            mid = mortonCodes.empty()
+                ? splitBinnedSah(leafs, start, end, m_options.sahBinsCount)
+                : splitMorton(mortonCodes, start, end);
+        }
+        uint32_t leftId;
+        uint32_t rightId;
+        math::Aabb leftAabb;
+        math::Aabb rightAabb;
+        if (leafsSize < parallelBuildMinLeafs) {
+            leftId = buildBvhRecursive(leafs, mortonCodes, maxLeafSize, start, mid, depth + 1, nodes, leftAabb, threadPool);
+            rightId = buildBvhRecursive(leafs, mortonCodes, maxLeafSize, mid, end, depth + 1, nodes, rightAabb, threadPool);
+        } else {
+            std::vector<BuildNode> rightNodes;
+            threadPool.parallelInvoke(
+                [&] { leftId = buildBvhRecursive(leafs, mortonCodes, maxLeafSize, start, mid, depth + 1, nodes, leftAabb, threadPool); },
+                [&] {
+                    rightNodes.reserve(((end - mid) / maxLeafSize + 1) * 2);
+                    buildBvhRecursive(leafs, mortonCodes, maxLeafSize, mid, end, depth + 1, rightNodes, rightAabb, threadPool);
+                });
+            rightId = appendSubtree(nodes, rightNodes);
+        }
+
+        aabb = leftAabb;
+        aabb.grow(rightAabb);
+        nodes.push_back(makeInternalNode(leftAabb, leftId, rightAabb, rightId));
+        return (uint32_t)(nodes.size() - 1);
+    }
+}
+
+// SBVH (Stich et al. 2009): every node also tries a split by a plane, references crossing it
+// are clipped and go to both children. Children of such a split do not overlap, which pays off
+// for long thin triangles. Every subtree gets its share of the split budget up front,
+// so the result does not depend on the order forked subtrees are built in.
+uint32_t Bvh::buildSbvhRecursive(std::vector<Triangle>& references,
+    size_t splitBudget,
+    float rootArea,
+    uint32_t depth,
+    std::vector<BuildNode>& nodes,
+    std::vector<Triangle>& leafs,
+    math::Aabb& aabb,
+    SbvhStats& stats,
+    ThreadPool& threadPool) const
+{
+    size_t referencesSize = references.size();
+    uint32_t medianDepth = getMedianDepth(referencesSize, m_options.maxLeafSize);
+    if (referencesSize == 0) {
+        throw std::runtime_error("[ornament] bvh cannot be built from zero leafs.");
+    }
+    if (depth + medianDepth > kernals::maxBvhDepth) {
+        throw std::runtime_error("[ornament] bvh has more leafs than its max depth can hold.");
+    }
+
+    aabb = math::Aabb();
+    for (const Triangle& r : references) {
+        aabb.grow(r.aabb);
+    }
+
+    if (referencesSize <= m_options.maxLeafSize) {
+        nodes.push_back(makeLeafNode(leafs, leafs.size(), leafs.size() + referencesSize));
+        leafs.insert(leafs.end(), references.begin(), references.end());
+        return (uint32_t)(nodes.size() - 1);
+    }
+
+    // a subtree with no depth to spare is split at the median, spatial splits would not shrink it enough
+    bool median = depth + medianDepth >= kernals::maxBvhDepth;
+    BinnedSahSplit objectSplit;
+    float objectSplitOverlap = 0.0f;
+    SpatialSplit spatialSplit;
+    if (!median) {
+        objectSplit = findBinnedSahSplit(references, 0, referencesSize, m_options.sahBinsCount);
+        objectSplitOverlap = math::intersection(objectSplit.leftAabb, objectSplit.rightAabb).area() / rootArea;
+        if (splitBudget > 0 && (objectSplit.axis == -1 || objectSplitOverlap > m_options.sbvhMinOverlap)) {
+            spatialSplit = findSpatialSplit(references, aabb, m_options.sahBinsCount, splitBudget);
+        }
+    }
+
+    std::vector<Triangle> left;
+    std::vector<Triangle> right;
+    bool spatial = spatialSplit.cost < objectSplit.cost;
+    if (median) {
+        size_t mid = splitMedian(references, 0, referencesSize);
+        left.assign(references.begin(), references.begin() + mid);
+        right.assign(references.begin() + mid, references.end());
+    } else if (spatial) {
+        size_t duplicatesCount = partitionSpatial(references, m_options.sahBinsCount, spatialSplit, left, right);
+        stats.spatialSplitsCount++;
+        stats.duplicatedReferencesCount += (uint32_t)duplicatesCount;
+        splitBudget -= duplicatesCount;
+    } else {
+        size_t mid = partitionBinnedSah(references, 0, referencesSize, m_options.sahBinsCount, objectSplit);
+        left.assign(references.begin(), references.begin() + mid);
+        right.assign(references.begin() + mid, references.end());
+    }
+    references = {};
+
+    size_t leftSplitBudget = splitBudget * left.size() / (left.size() + right.size());
+    size_t rightSplitBudget = splitBudget - leftSplitBudget;
+    uint32_t leftId;
+    uint32_t rightId;
+    math::Aabb leftAabb;
+    math::Aabb rightAabb;
+    if (referencesSize < parallelBuildMinLeafs) {
+        leftId = buildSbvhRecursive(left, leftSplitBudget, rootArea, depth + 1, nodes, leafs, leftAabb, stats, threadPool);
+        rightId = buildSbvhRecursive(right, rightSplitBudget, rootArea, depth + 1, nodes, leafs, rightAabb, stats, threadPool);
+    } else {
+        std::vector<BuildNode> rightNodes;
+        std::vector<Triangle> rightLeafs;
+        SbvhStats rightStats;
+        threadPool.parallelInvoke(
+            [&] { leftId = buildSbvhRecursive(left, leftSplitBudget, rootArea, depth + 1, nodes, leafs, leftAabb, stats, threadPool); },
+            [&] { buildSbvhRecursive(right, rightSplitBudget, rootArea, depth + 1, rightNodes, rightLeafs, rightAabb, rightStats, threadPool); });
+        rightId = appendSubtree(nodes, rightNodes, (uint32_t)leafs.size());
+        leafs.insert(leafs.end(), rightLeafs.begin(), rightLeafs.end());
+        stats.spatialSplitsCount += rightStats.spatialSplitsCount;
+        stats.duplicatedReferencesCount += rightStats.duplicatedReferencesCount;
+        stats.objectSplitOverlap += rightStats.objectSplitOverlap;
+        stats.overlap += rightStats.overlap;
+    }
+
+    // children of an object split are bounded by exactly the bins it was evaluated with
+    float overlap = math::intersection(leftAabb, rightAabb).area() / rootArea;
+    stats.objectSplitOverlap += spatial ? objectSplitOverlap : overlap;
+    stats.overlap += overlap;
+    nodes.push_back(makeInternalNode(leftAabb, leftId, rightAabb, rightId));
+    return (uint32_t)(nodes.size() - 1);
+}
+
+math::Aabb Bvh::transformTreeAabb(const std::vector<kernals::BvhNode>& nodes,
+    uint32_t rootNodeId,
+    const glm::mat4& transform,
+    const math::Aabb& notTransformedAabb) const
+{
+    if (kernals::getNodeType(rootNodeId) != kernals::InternalNodeType || m_options.instanceBoundsDepth == 0) {
+        return math::transform(transform, notTransformedAabb);
+    }
+
+    // boxes of the parts of a rotated mesh or group stick out of it much less than the box of the whole,
+    // child bounds down to instanceBoundsDepth levels are transformed one by one
+    struct StackEntry {
+        uint32_t nodeId;
+        uint32_t depth;
+    };
+
+    math::Aabb aabb;
+    std::vector<StackEntry> stack;
+    stack.push_back({ kernals::getNodeId(rootNodeId), 1 });
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+
+        const kernals::BvhNode& node = nodes[entry.nodeId];
+        auto addChild = [&](uint32_t childRef, const float3& min, const float3& max) {
+            if (kernals::getNodeType(childRef) == kernals::InternalNodeType && entry.depth < m_options.instanceBoundsDepth) {
+                stack.push_back({ kernals::getNodeId(childRef), entry.depth + 1 });
+            } else {
+                aabb.grow(math::transform(transform, toAabb(min, max)));
+            }
+        };
+        addChild(node.leftNodeId, node.leftAabbMin, node.leftAabbMax);
+        addChild(node.rightNodeId, node.rightAabbMin, node.rightAabbMax);
+    }
+    return aabb;
+}
+
+// recomputes the world space aabb of a leaf object after its transform was changed
+void Bvh::updateAabb(const Leaf& l) const
+{
+    switch (l.type) {
+    case SphereType: {
+        l.sphere->aabb = math::transform(l.sphere->transform, math::Aabb(glm::vec3(-1.0f), glm::vec3(1.0f)));
+        break;
+    }
+    case MeshType: {
+        l.mesh->aabb = transformTreeAabb(m_blasNodes, l.mesh->bvhId.value(), l.mesh->transform, l.mesh->notTransformedAabb);
+        break;
+    }
+    case MeshInstanceType: {
+        const Mesh& mesh = *l.meshInstance->mesh;
+        l.meshInstance->aabb = transformTreeAabb(m_blasNodes, mesh.bvhId.value(), l.meshInstance->transform, mesh.notTransformedAabb);
+        break;
+    }
+    case SphereSetType: {
+        l.sphereSet->aabb = transformTreeAabb(m_blasNodes, l.sphereSet->bvhId.value(), l.sphereSet->transform, l.sphereSet->notTransformedAabb);
+        break;
+    }
+    case GroupInstanceType: {
+        const Group& group = *l.groupInstance->group;
+        l.groupInstance->aabb = transformTreeAabb(m_tlasNodes, group.bvhId.value(), l.groupInstance->transform, group.aabb);
+        break;
+    }
+    default: {
+        throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+    }
+}
+
+bool Bvh::updateTransform(const Leaf& l, BvhUpdate& update)
+{
+    float3x4 kernalTransform = toKernalTransform(glm::inverse(getTransform(l)));
+    if (std::memcmp(&kernalTransform, &m_transforms[l.transformId], sizeof(float3x4)) == 0) {
+        return false;
+    }
+
+    m_transforms[l.transformId] = kernalTransform;
+    update.transforms.add(l.transformId);
+    return true;
+}
+
+float Bvh::refitInstanceTrees(const std::vector<bool>& changedLeafs, BvhUpdate& update)
+{
+    // instances of groups whose bounds changed are refitted even when their own transform is kept
+    std::unordered_set<const Group*> changedGroups;
+    auto refitLeaf = [&](uint32_t leafId) {
+        const Leaf& leaf = m_leafs[leafId];
+        if (changedLeafs[leafId] || (leaf.type == GroupInstanceType && changedGroups.contains(leaf.groupInstance->group.get()))) {
+            updateAabb(leaf);
+        }
+        return getAabb(leaf);
+    };
+
+    // internal nodes of a tree are stored in depth first order from its root, walking them
+    // backwards visits children before their parent, instances share ids with m_leafs
+    auto refitTree = [&](uint32_t rootNodeId, uint32_t firstNodeId, uint32_t nodesCount) {
+        if (kernals::getNodeType(rootNodeId) != kernals::InternalNodeType) {
+            return refitLeaf(kernals::getNodeId(rootNodeId));
+        }
+
+        std::vector<math::Aabb> aabbs(nodesCount);
+        auto getChildAabb = [&](uint32_t nodeRef) {
+            uint32_t nodeId = kernals::getNodeId(nodeRef);
+            return kernals::getNodeType(nodeRef) == kernals::InternalNodeType ? aabbs[nodeId - firstNodeId] : refitLeaf(nodeId);
+        };
+
+        for (uint32_t i = nodesCount; i-- > 0;) {
+            if (m_freedTlasNodes[firstNodeId + i]) {
+                continue;
+            }
+
+            kernals::BvhNode& node = m_tlasNodes[firstNodeId + i];
+            math::Aabb leftAabb = getChildAabb(node.leftNodeId);
+            math::Aabb rightAabb = getChildAabb(node.rightNodeId);
+            kernals::BvhNode refitted = node;
+            refitted.leftAabbMin = kernals::glmToHipFloat3(leftAabb.min());
+            refitted.leftAabbMax = kernals::glmToHipFloat3(leftAabb.max());
+            refitted.rightAabbMin = kernals::glmToHipFloat3(rightAabb.min());
+            refitted.rightAabbMax = kernals::glmToHipFloat3(rightAabb.max());
+            if (std::memcmp(&refitted, &node, sizeof(kernals::BvhNode)) != 0) {
+                node = refitted;
+                update.tlasNodes.add(firstNodeId + i);
+            }
+            aabbs[i] = leftAabb;
+            aabbs[i].grow(rightAabb);
+        }
+        // a detach can move the tlas root to a later node
+        return aabbs[kernals::getNodeId(rootNodeId) - firstNodeId];
+    };
+
+    // groups are refitted inner first, the order they were built in
+    for (GroupTree& tree : m_groupTrees) {
+        math::Aabb aabb = refitTree(tree.group->bvhId.value(), tree.firstNodeId, tree.nodesCount);
+        if (aabb.min() != tree.group->aabb.min() || aabb.max() != tree.group->aabb.max()) {
+            tree.group->aabb = aabb;
+            changedGroups.insert(tree.group);
+        }
+    }
+
+    refitTree(m_tlasRootId, m_tlasFirstNodeId, (uint32_t)m_tlasNodes.size() - m_tlasFirstNodeId);
+    return sahCost(m_tlasNodes, m_tlasRootId) / m_tlasBuildSahCost;
+}
+
+float Bvh::refit()
+{
+    BvhUpdate update;
+    std::vector<bool> changedLeafs(m_leafs.size());
+    for (size_t i = 0; i < m_leafs.size(); i++) {
+        changedLeafs[i] = !m_leafs[i].detached && updateTransform(m_leafs[i], update);
+    }
+    return refitInstanceTrees(changedLeafs, update);
+}
+
+// a texture keeps the id it was first added with, an id out of the textures of this bvh was set by another one
+void Bvh::checkUpdatedTexture(const Material& m) const
+{
+    if (m.albedo.type != TextureType || !m.albedo.texture->textureId.has_value()) {
+        return;
+    }
+    uint32_t textureId = m.albedo.texture->textureId.value();
+    if (textureId >= m_textures.size() || m_textures[textureId] != m.albedo.texture) {
+        throw std::runtime_error("[ornament] texture of an updated material was not added by this bvh.");
+    }
+}
 
-float randomi32(int min, int max)
+math::Aabb Bvh::refitBlasNodes(uint32_t rootNodeId, const BlasRange& range, BvhUpdate& update)
 {
-    return std::uniform_int<int>(min, max)(gen32x);
+    auto getLeafAabb = [&](uint32_t nodeRef) {
+        uint32_t leafId = kernals::getNodeId(nodeRef);
+        math::Aabb aabb;
+        if (kernals::getNodeType(nodeRef) == kernals::SpherePacketType) {
+            const kernals::SpherePacket& p = m_spherePackets[leafId];
+            for (uint32_t lane = 0; lane < kernals::spherePacketWidth; lane++) {
+                glm::vec3 center(p.centerX[lane], p.centerY[lane], p.centerZ[lane]);
+                aabb.grow(math::Aabb(center - glm::vec3(p.radius[lane]), center + glm::vec3(p.radius[lane])));
+            }
+            return aabb;
+        }
+
+        for (uint32_t i = leafId;; i++) {
+            const kernals::Triangle& t = m_triangles[i];
+            aabb.grow(glm::vec3(t.v0.x, t.v0.y, t.v0.z));
+            aabb.grow(glm::vec3(t.v1.x, t.v1.y, t.v1.z));
+            aabb.grow(glm::vec3(t.v2.x, t.v2.y, t.v2.z));
+            if (t.triangleId & kernals::lastTriangleFlag) {
+                return aabb;
+            }
+        }
+    };
+
+    if (kernals::getNodeType(rootNodeId) != kernals::InternalNodeType) {
+        return getLeafAabb(rootNodeId);
+    }
+
+    // the same backwards walk as for the tlas, triangles split by the sbvh builder are bounded whole now
+    std::vector<math::Aabb> aabbs(range.nodesCount);
+    auto getChildAabb = [&](uint32_t nodeRef) {
+        uint32_t nodeId = kernals::getNodeId(nodeRef);
+        return kernals::getNodeType(nodeRef) == kernals::InternalNodeType ? aabbs[nodeId - range.firstNodeId] : getLeafAabb(nodeRef);
+    };
+
+    for (uint32_t i = range.nodesCount; i-- > 0;) {
+        kernals::BvhNode& node = m_blasNodes[range.firstNodeId + i];
+        math::Aabb leftAabb = getChildAabb(node.leftNodeId);
+        math::Aabb rightAabb = getChildAabb(node.rightNodeId);
+        node.leftAabbMin = kernals::glmToHipFloat3(leftAabb.min());
+        node.leftAabbMax = kernals::glmToHipFloat3(leftAabb.max());
+        node.rightAabbMin = kernals::glmToHipFloat3(rightAabb.min());
+        node.rightAabbMax = kernals::glmToHipFloat3(rightAabb.max());
+        aabbs[i] = leftAabb;
+        aabbs[i].grow(rightAabb);
+    }
+    update.blasNodes.add(range.firstNodeId, range.nodesCount);
+    return aabbs[0];
 }
 
-math::Aabb getAabb(const Leaf& l)
+void Bvh::refitMeshBlas(Mesh& mesh, BvhUpdate& update)
 {
-    math::Aabb aabb;
-    switch (l.type) {
-    case SphereType: {
-        return l.sphere->aabb;
-    }
-    case MeshType: {
-        return l.mesh->aabb;
+    auto found = m_meshBlasRanges.find(&mesh);
+    if (found == m_meshBlasRanges.end()) {
+        throw std::runtime_error("[ornament] blas of the mesh was not built by this bvh.");
     }
-    case MeshInstanceType: {
-        return l.meshInstance->aabb;
+
+    const BlasRange& range = found->second;
+    if (mesh.vertexIndices.size() != range.primitivesCount * 3
+        || mesh.normalIndices.size() != range.primitivesCount * 3
+        || mesh.uvIndices.size() != range.primitivesCount * 3
+        || mesh.normals.size() != range.normalsCount
+        || mesh.uvs.size() != range.uvsCount) {
+        throw std::runtime_error("[ornament] geometry update cannot change the number of triangles, normals or uvs of a mesh.");
     }
-    default: {
-        throw std::runtime_error("[ornament] not implemented switch case.");
+
+    // triangles stay in their leafs, only the vertices move
+    for (uint32_t i = range.firstLeafId; i < range.firstLeafId + range.leafsCount; i++) {
+        kernals::Triangle& t = m_triangles[i];
+        uint32_t triangleIndex = (t.triangleId & ~kernals::lastTriangleFlag) - range.firstTriangleId;
+        t.v0 = kernals::glmToHipFloat3(mesh.vertices[mesh.vertexIndices[triangleIndex * 3]]);
+        t.v1 = kernals::glmToHipFloat3(mesh.vertices[mesh.vertexIndices[triangleIndex * 3 + 1]]);
+        t.v2 = kernals::glmToHipFloat3(mesh.vertices[mesh.vertexIndices[triangleIndex * 3 + 2]]);
     }
+    update.triangles.add(range.firstLeafId, range.leafsCount);
+
+    if (m_options.packShadingAttributes) {
+        for (uint32_t t = 0; t < range.primitivesCount; t++) {
+            kernals::ShadingRecord& record = m_shadingRecords[range.firstTriangleId + t];
+            for (size_t k = 0; k < 3; k++) {
+                glm::vec3 n = mesh.normals[mesh.normalIndices[t * 3 + k]];
+                glm::vec2 uv = mesh.uvs[mesh.uvIndices[t * 3 + k]];
+                record.normals[k] = kernals::encodeOctahedral(kernals::glmToHipFloat3(n));
+                record.uvs[k] = kernals::encodeHalf2(make_float2(uv.x, uv.y));
+            }
+        }
+        update.shadingRecords.add(range.firstTriangleId, range.primitivesCount);
+    } else {
+        for (uint32_t i = 0; i < range.primitivesCount * 3; i++) {
+            m_normalIndices[range.firstNormalIndex + i] = mesh.normalIndices[i] + range.firstNormalId;
+            m_uvIndices[range.firstUvIndex + i] = mesh.uvIndices[i] + range.firstUvId;
+        }
+        for (uint32_t i = 0; i < range.normalsCount; i++) {
+            m_normals[range.firstNormalId + i] = make_float4(kernals::glmToHipFloat3(mesh.normals[i]), 0.0f);
+        }
+        for (uint32_t i = 0; i < range.uvsCount; i++) {
+            m_uvs[range.firstUvId + i] = make_float2(mesh.uvs[i].x, mesh.uvs[i].y);
+        }
+        update.normalIndices.add(range.firstNormalIndex, range.primitivesCount * 3);
+        update.uvIndices.add(range.firstUvIndex, range.primitivesCount * 3);
+        update.normals.add(range.firstNormalId, range.normalsCount);
+        update.uvs.add(range.firstUvId, range.uvsCount);
     }
+
+    mesh.notTransformedAabb = refitBlasNodes(mesh.bvhId.value(), range, update);
 }
 
-math::Aabb calculateBoundingBox(const std::vector<Triangle>& leafs, size_t start, size_t end)
+void Bvh::refitSphereSetBlas(SphereSet& sphereSet, bool geometry, bool materials, BvhUpdate& update)
 {
-    glm::vec3 min(std::numeric_limits<float>::infinity());
-    glm::vec3 max(-std::numeric_limits<float>::infinity());
+    auto found = m_sphereSetBlasRanges.find(&sphereSet);
+    if (found == m_sphereSetBlasRanges.end()) {
+        throw std::runtime_error("[ornament] blas of the sphere set was not built by this bvh.");
+    }
+
+    const BlasRange& range = found->second;
+    if (sphereSet.centers.size() != range.primitivesCount
+        || sphereSet.radii.size() != range.primitivesCount
+        || sphereSet.materials.size() != range.primitivesCount) {
+        throw std::runtime_error("[ornament] geometry update cannot change the number of spheres of a sphere set.");
+    }
+
+    // spheres stay in their packet lanes
+    for (uint32_t i = 0; i < range.leafsCount; i++) {
+        kernals::SpherePacket& packet = m_spherePackets[range.firstLeafId + i];
+        for (uint32_t lane = 0; lane < kernals::spherePacketWidth; lane++) {
+            uint32_t sphereId = range.sphereIds[i * kernals::spherePacketWidth + lane];
+            if (geometry) {
+                packet.centerX[lane] = sphereSet.centers[sphereId].x;
+                packet.centerY[lane] = sphereSet.centers[sphereId].y;
+                packet.centerZ[lane] = sphereSet.centers[sphereId].z;
+                packet.radius[lane] = sphereSet.radii[sphereId];
+            }
+            if (materials) {
+                checkUpdatedTexture(*sphereSet.materials[sphereId]);
+                packet.materialIds[lane] = getMaterialIndex(*sphereSet.materials[sphereId]);
+            }
+        }
+    }
+    update.spherePackets.add(range.firstLeafId, range.leafsCount);
 
-    for (auto l = leafs.begin() + start; l != leafs.begin() + end; ++l) {
-        min = glm::min(min, l->aabb.min());
-        max = glm::max(max, l->aabb.max());
+    if (geometry) {
+        sphereSet.notTransformedAabb = refitBlasNodes(sphereSet.bvhId.value(), range, update);
     }
+}
 
-    return math::Aabb(min, max);
+const std::vector<uint32_t>& Bvh::getLeafIds(const std::unordered_map<const void*, std::vector<uint32_t>>& leafIds, const void* object) const
+{
+    static const std::vector<uint32_t> noLeafIds;
+    auto found = leafIds.find(object);
+    return found == leafIds.end() ? noLeafIds : found->second;
 }
 
-math::Aabb calculateBoundingBox(const std::vector<Leaf>& leafs, size_t start, size_t end)
+void Bvh::mapLeafs()
 {
-    glm::vec3 min(std::numeric_limits<float>::infinity());
-    glm::vec3 max(-std::numeric_limits<float>::infinity());
+    // the leafs of an object are looked up by the object, a mesh or a sphere set
+    // is also the blas of its instances
+    m_objectLeafIds.clear();
+    m_blasLeafIds.clear();
+    for (uint32_t i = 0; i < m_leafs.size(); i++) {
+        const Leaf& leaf = m_leafs[i];
+        if (leaf.detached) {
+            continue;
+        }
 
-    for (auto l = leafs.begin() + start; l != leafs.begin() + end; ++l) {
-        math::Aabb aabb = getAabb(*l);
-        min = glm::min(min, aabb.min());
-        max = glm::max(max, aabb.max());
+        switch (leaf.type) {
+        case SphereType: {
+            m_objectLeafIds[leaf.sphere].push_back(i);
+            break;
+        }
+        case MeshType: {
+            m_objectLeafIds[leaf.mesh].push_back(i);
+            m_blasLeafIds[leaf.mesh].push_back(i);
+            break;
+        }
+        case MeshInstanceType: {
+            m_objectLeafIds[leaf.meshInstance].push_back(i);
+            m_blasLeafIds[leaf.meshInstance->mesh.get()].push_back(i);
+            break;
+        }
+        case SphereSetType: {
+            m_objectLeafIds[leaf.sphereSet].push_back(i);
+            m_blasLeafIds[leaf.sphereSet].push_back(i);
+            break;
+        }
+        case GroupInstanceType: {
+            m_objectLeafIds[leaf.groupInstance].push_back(i);
+            break;
+        }
+        default: {
+            throw std::runtime_error("[ornament] not implemented switch case.");
+        }
+        }
     }
 
-    return math::Aabb(min, max);
+    // unlinked tlas nodes are not reachable from the root
+    m_tlasParentIds.assign(m_tlasNodes.size(), noId);
+    m_leafParentIds.assign(m_leafs.size(), noId);
+    if (kernals::getNodeType(m_tlasRootId) != kernals::InternalNodeType) {
+        return;
+    }
+    std::vector<uint32_t> stack = { kernals::getNodeId(m_tlasRootId) };
+    while (!stack.empty()) {
+        uint32_t nodeId = stack.back();
+        stack.pop_back();
+        const kernals::BvhNode& node = m_tlasNodes[nodeId];
+        for (uint32_t childRef : { node.leftNodeId, node.rightNodeId }) {
+            if (kernals::getNodeType(childRef) == kernals::InternalNodeType) {
+                m_tlasParentIds[kernals::getNodeId(childRef)] = nodeId;
+                stack.push_back(kernals::getNodeId(childRef));
+            } else {
+                m_leafParentIds[kernals::getNodeId(childRef)] = nodeId;
+            }
+        }
+    }
 }
 
-Bvh::Bvh(const Scene& scene)
+BvhUpdate Bvh::applyUpdates(const SceneUpdates& updates)
 {
-    size_t shapesCount = scene.getAttachedSpheres().size() + scene.getAttachedMeshes().size() + scene.getAttachedMeshInstances().size();
-    if (shapesCount == 0) {
-        throw std::runtime_error("[ornament] scene cannot be empty.");
+    if (m_objectLeafIds.empty()) {
+        mapLeafs();
     }
 
-    size_t tlasNodesCount = shapesCount * 2 - 1;
-    size_t blasNodesCount = 0;
-    size_t normalsCount = 0;
-    size_t normalIndicesCount = 0;
-    size_t uvsCount = 0;
-    size_t uvIndicesCount = 0;
-    for (auto& m : scene.getAttachedMeshes()) {
-        size_t triangles = m.get()->vertexIndices.size() / 3;
-        blasNodesCount += triangles * 2 - 1;
-        normalsCount += m.get()->normals.size();
-        normalIndicesCount += m.get()->normalIndices.size();
-        uvsCount += m.get()->uvs.size();
-        uvIndicesCount += m.get()->uvIndices.size();
+    checkDetaches(updates);
+
+    BvhUpdate update;
+    size_t materialsCount = m_materials.size();
+    size_t texturesCount = m_textures.size();
+    std::vector<bool> changedLeafs(m_leafs.size());
+
+    // a material without an id is not used by any built object yet
+    for (auto& m : updates.materials) {
+        if (m->materialId.has_value()) {
+            checkUpdatedTexture(*m);
+            if (m->albedo.type == TextureType) {
+                getTextureIndex(*m->albedo.texture);
+            }
+            m_materials[m->materialId.value()] = kernals::toKernalMaterial(*m);
+            update.materials.add(m->materialId.value());
+        }
     }
 
-    m_tlasNodes.reserve(tlasNodesCount);
-    m_blasNodes.reserve(blasNodesCount);
-    m_normals.reserve(normalsCount);
-    m_normalIndices.reserve(normalIndicesCount);
-    m_uvs.reserve(uvsCount);
-    m_uvIndices.reserve(uvIndicesCount);
-    m_transforms.reserve(shapesCount);
-    m_materials.reserve(scene.getMaterials().size());
-    m_textures.reserve(scene.getTextures().size());
+    auto setMaterial = [&](const void* object, Material& material) {
+        checkUpdatedTexture(material);
+        uint32_t materialId = getMaterialIndex(material);
+        for (uint32_t leafId : getLeafIds(m_objectLeafIds, object)) {
+            m_leafs[leafId].materialId = materialId;
+            m_instances[leafId].materialId = materialId;
+            update.instances.add(leafId);
+        }
+    };
 
-    build(scene);
+    auto setTransform = [&](const void* object) {
+        for (uint32_t leafId : getLeafIds(m_objectLeafIds, object)) {
+            if (updateTransform(m_leafs[leafId], update)) {
+                changedLeafs[leafId] = true;
+            }
+        }
+    };
 
-    if (tlasNodesCount != m_tlasNodes.size()) {
-        throw std::runtime_error("[ornament] expected tlas noodes count is not equal to actual tlas noodes count.");
+    auto setBlasChanged = [&](const void* blas) {
+        for (uint32_t leafId : getLeafIds(m_blasLeafIds, blas)) {
+            changedLeafs[leafId] = true;
+        }
+    };
+
+    for (auto& s : updates.spheres) {
+        if (s->dirtyFlags & MaterialDirty) {
+            setMaterial(s.get(), *s->material);
+        }
+        if (s->dirtyFlags & TransformDirty) {
+            setTransform(s.get());
+        }
+    }
+
+    for (auto& m : updates.meshes) {
+        if (m->dirtyFlags & MaterialDirty) {
+            setMaterial(m.get(), *m->material);
+        }
+        // a blas no leaf instances is not rendered, it was freed or never built
+        if ((m->dirtyFlags & GeometryDirty) && !getLeafIds(m_blasLeafIds, m.get()).empty()) {
+            refitMeshBlas(*m, update);
+            setBlasChanged(m.get());
+        }
+        if (m->dirtyFlags & TransformDirty) {
+            setTransform(m.get());
+        }
+    }
+
+    for (auto& mi : updates.meshInstances) {
+        if (mi->dirtyFlags & MaterialDirty) {
+            setMaterial(mi.get(), *mi->material);
+        }
+        if (mi->dirtyFlags & TransformDirty) {
+            setTransform(mi.get());
+        }
+    }
+
+    for (auto& s : updates.sphereSets) {
+        if (getLeafIds(m_blasLeafIds, s.get()).empty()) {
+            continue;
+        }
+        if (s->dirtyFlags & (GeometryDirty | MaterialDirty)) {
+            refitSphereSetBlas(*s, s->dirtyFlags & GeometryDirty, s->dirtyFlags & MaterialDirty, update);
+        }
+        if (s->dirtyFlags & GeometryDirty) {
+            setBlasChanged(s.get());
+        }
+        if (s->dirtyFlags & TransformDirty) {
+            setTransform(s.get());
+        }
+    }
+
+    for (auto& gi : updates.groupInstances) {
+        setTransform(gi.get());
+    }
+
+    // changes of detached objects were applied above, they are dropped with their leafs
+    for (auto& s : updates.detachedSpheres) {
+        detachLeaf(s.get(), nullptr, update);
+    }
+
+    for (auto& m : updates.detachedMeshes) {
+        detachLeaf(m.get(), m.get(), update);
+        freeUnusedBlas(m.get());
+    }
+
+    for (auto& mi : updates.detachedMeshInstances) {
+        detachLeaf(mi.get(), mi->mesh.get(), update);
+        freeUnusedBlas(mi->mesh.get());
+    }
+
+    for (auto& s : updates.detachedSphereSets) {
+        detachLeaf(s.get(), s.get(), update);
+        freeUnusedBlas(s.get());
+    }
+
+    for (auto& gi : updates.detachedGroupInstances) {
+        detachLeaf(gi.get(), nullptr, update);
+    }
+
+    update.materialsResized = m_materials.size() != materialsCount;
+    update.texturesResized = m_textures.size() != texturesCount;
+    refitInstanceTrees(changedLeafs, update);
+
+    // freed parts stay in the buffers until enough of them pile up, moving
+    // the rest costs a full upload
+    if (m_freedBytes > m_options.compactionThreshold * getBuffersBytes()) {
+        compact();
+        update.compacted = true;
     }
-    if (blasNodesCount != m_blasNodes.size()) {
-        throw std::runtime_error("[ornament] expected blas noodes count is not equal to actual blas noodes count.");
+
+    // refit ratios are relative to the tlas left by the detaches, not to the one first built
+    if (update.tlasChanged || update.compacted) {
+        m_tlasBuildSahCost = sahCost(m_tlasNodes, m_tlasRootId);
     }
+    return update;
 }
 
-void Bvh::build(const Scene& scene)
+// checked before any update is applied, a renderer catching the throw keeps a consistent bvh
+void Bvh::checkDetaches(const SceneUpdates& updates) const
 {
-    std::vector<Leaf> leafs;
-    leafs.reserve(scene.getAttachedSpheres().size() + scene.getAttachedMeshes().size() + scene.getAttachedMeshInstances().size());
-
-    for (auto& s : scene.getAttachedSpheres()) {
-        leafs.push_back({ .type = SphereType, .sphere = s.get() });
+    uint32_t attachedCount = 0;
+    for (uint32_t i = m_tlasFirstLeafId; i < m_leafs.size(); i++) {
+        if (!m_leafs[i].detached) {
+            attachedCount++;
+        }
     }
 
-    for (auto& mi : scene.getAttachedMeshInstances()) {
-        leafs.push_back({ .type = MeshInstanceType, .meshInstance = mi.get() });
-        if (!mi.get()->mesh.get()->bvhId.has_value()) {
-            buildMeshBvhRecursive(*mi.get()->mesh);
+    // every detach unlinks one tlas leaf of the object, objects attached after the build have none
+    std::unordered_map<const void*, uint32_t> tlasLeafsCounts;
+    uint32_t detachedCount = 0;
+    auto detach = [&](const void* object) {
+        auto leafIds = m_objectLeafIds.find(object);
+        if (leafIds == m_objectLeafIds.end()) {
+            return;
+        }
+        auto [count, inserted] = tlasLeafsCounts.try_emplace(object, (uint32_t)std::count_if(leafIds->second.begin(), leafIds->second.end(), [this](uint32_t leafId) {
+            return leafId >= m_tlasFirstLeafId;
+        }));
+        if (count->second > 0) {
+            count->second--;
+            detachedCount++;
         }
+    };
+    for (auto& s : updates.detachedSpheres) {
+        detach(s.get());
+    }
+    for (auto& m : updates.detachedMeshes) {
+        detach(m.get());
+    }
+    for (auto& mi : updates.detachedMeshInstances) {
+        detach(mi.get());
+    }
+    for (auto& s : updates.detachedSphereSets) {
+        detach(s.get());
+    }
+    for (auto& gi : updates.detachedGroupInstances) {
+        detach(gi.get());
     }
 
-    for (auto& m : scene.getAttachedMeshes()) {
-        leafs.push_back({ .type = MeshType, .mesh = m.get() });
-        if (!m.get()->bvhId.has_value()) {
-            buildMeshBvhRecursive(*m);
+    if (detachedCount != 0 && detachedCount >= attachedCount) {
+        throw std::runtime_error("[ornament] scene cannot be empty.");
+    }
+}
+
+void Bvh::detachLeaf(const void* object, const void* blas, BvhUpdate& update)
+{
+    // an object attached to a group has leafs in the group tree too, those are kept
+    auto objectLeafIds = m_objectLeafIds.find(object);
+    if (objectLeafIds == m_objectLeafIds.end()) {
+        return;
+    }
+    std::vector<uint32_t>& leafIds = objectLeafIds->second;
+    auto found = std::find_if(leafIds.rbegin(), leafIds.rend(), [this](uint32_t leafId) {
+        return leafId >= m_tlasFirstLeafId;
+    });
+    // objects attached after the build were not added
+    if (found == leafIds.rend()) {
+        return;
+    }
+
+    // checkDetaches keeps a leaf attached, the root is never a detached leaf
+    uint32_t leafId = *found;
+    uint32_t parentId = m_leafParentIds[leafId];
+    leafIds.erase(std::next(found).base());
+    if (leafIds.empty()) {
+        m_objectLeafIds.erase(objectLeafIds);
+    }
+    if (blas) {
+        std::vector<uint32_t>& blasLeafIds = m_blasLeafIds[blas];
+        blasLeafIds.erase(std::find(blasLeafIds.begin(), blasLeafIds.end(), leafId));
+    }
+
+    // the sibling of the leaf takes the place of their parent, the refit fixes the bounds above it
+    const kernals::BvhNode& parent = m_tlasNodes[parentId];
+    bool leafIsLeft = kernals::getNodeType(parent.leftNodeId) != kernals::InternalNodeType && kernals::getNodeId(parent.leftNodeId) == leafId;
+    uint32_t siblingRef = leafIsLeft ? parent.rightNodeId : parent.leftNodeId;
+    uint32_t grandparentId = m_tlasParentIds[parentId];
+    if (grandparentId == noId) {
+        m_tlasRootId = siblingRef;
+    } else {
+        kernals::BvhNode& grandparent = m_tlasNodes[grandparentId];
+        if (grandparent.leftNodeId == kernals::makeNodeRef(kernals::InternalNodeType, parentId)) {
+            grandparent.leftNodeId = siblingRef;
+        } else {
+            grandparent.rightNodeId = siblingRef;
         }
+        update.tlasNodes.add(grandparentId);
     }
 
-    kernals::BvhNode root = buildBvhTlasRecursive(leafs, 0, leafs.size());
-    m_tlasNodes.push_back(root);
+    if (kernals::getNodeType(siblingRef) == kernals::InternalNodeType) {
+        m_tlasParentIds[kernals::getNodeId(siblingRef)] = grandparentId;
+    } else {
+        m_leafParentIds[kernals::getNodeId(siblingRef)] = grandparentId;
+    }
+    m_freedTlasNodes[parentId] = true;
+    m_leafs[leafId].detached = true;
+    m_freedBytes += sizeof(kernals::BvhNode) + sizeof(kernals::Instance) + sizeof(float3x4);
+    update.tlasChanged = true;
 }
 
-void Bvh::buildMeshBvhRecursive(Mesh& mesh)
+void Bvh::freeUnusedBlas(Mesh* mesh)
 {
-    size_t trianglesCount = mesh.vertexIndices.size() / 3;
-    std::vector<Triangle> leafs;
-    leafs.reserve(trianglesCount);
+    auto range = m_meshBlasRanges.find(mesh);
+    if (range == m_meshBlasRanges.end() || !getLeafIds(m_blasLeafIds, mesh).empty()) {
+        return;
+    }
 
-    for (size_t meshTriangleIndex = 0; meshTriangleIndex < trianglesCount; meshTriangleIndex++) {
-        auto v0 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3]];
-        auto v1 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3 + 1]];
-        auto v2 = mesh.vertices[mesh.vertexIndices[meshTriangleIndex * 3 + 2]];
-        math::Aabb aabb(glm::min(glm::min(v0, v1), v2), glm::max(glm::max(v0, v1), v2));
+    m_freedBytes += getBlasBytes(range->second, true);
+    m_meshBlasRanges.erase(range);
+    m_blasLeafIds.erase(mesh);
+    // the mesh is built again when it is attached to a new scene
+    mesh->bvhId.reset();
+}
 
-        size_t globalTriangleIndex = m_normalIndices.size() / 3 + meshTriangleIndex;
-        leafs.push_back({
-            .v0 = v0,
-            .v1 = v1,
-            .v2 = v2,
-            .triangleIndex = (uint32_t)globalTriangleIndex,
-            .aabb = aabb,
-        });
+void Bvh::freeUnusedBlas(SphereSet* sphereSet)
+{
+    auto range = m_sphereSetBlasRanges.find(sphereSet);
+    if (range == m_sphereSetBlasRanges.end() || !getLeafIds(m_blasLeafIds, sphereSet).empty()) {
+        return;
+    }
+
+    m_freedBytes += getBlasBytes(range->second, false);
+    m_sphereSetBlasRanges.erase(range);
+    m_blasLeafIds.erase(sphereSet);
+    sphereSet->bvhId.reset();
+}
+
+void Bvh::compact()
+{
+    // materials used by attached objects keep their order, the others lose their ids
+    std::vector<bool> usedMaterials(m_materials.size());
+    for (const Leaf& leaf : m_leafs) {
+        if (!leaf.detached && (leaf.type == SphereType || leaf.type == MeshType || leaf.type == MeshInstanceType)) {
+            usedMaterials[leaf.materialId] = true;
+        }
+    }
+    for (auto& [sphereSet, range] : m_sphereSetBlasRanges) {
+        for (uint32_t i = range.firstLeafId; i < range.firstLeafId + range.leafsCount; i++) {
+            for (uint32_t materialId : m_spherePackets[i].materialIds) {
+                usedMaterials[materialId] = true;
+            }
+        }
+    }
+
+    std::vector<uint32_t> materialIds(m_materials.size(), noId);
+    std::vector<kernals::Material> materials;
+    std::vector<Material*> materialObjects;
+    for (uint32_t i = 0; i < m_materials.size(); i++) {
+        if (!usedMaterials[i]) {
+            m_materialObjects[i]->materialId.reset();
+            continue;
+        }
+        materialIds[i] = (uint32_t)materials.size();
+        m_materialObjects[i]->materialId = materialIds[i];
+        materials.push_back(m_materials[i]);
+        materialObjects.push_back(m_materialObjects[i]);
     }
 
-    for (uint32_t ni : mesh.normalIndices) {
-        m_normalIndices.push_back(ni + m_normals.size());
+    // blas keep their order, meshes come before sphere sets and global triangle ids,
+    // normals and uvs follow the order of the meshes
+    struct UsedBlas {
+        BlasRange* range;
+        Mesh* mesh;
+        SphereSet* sphereSet;
+    };
+    std::vector<UsedBlas> usedBlas;
+    for (auto& [mesh, range] : m_meshBlasRanges) {
+        usedBlas.push_back({ &range, mesh, nullptr });
+    }
+    for (auto& [sphereSet, range] : m_sphereSetBlasRanges) {
+        usedBlas.push_back({ &range, nullptr, sphereSet });
     }
+    std::sort(usedBlas.begin(), usedBlas.end(), [](const UsedBlas& a, const UsedBlas& b) {
+        return a.range->firstNodeId < b.range->firstNodeId;
+    });
+
+    std::vector<kernals::BvhNode> blasNodes;
+    std::vector<kernals::Triangle> triangles;
+    std::vector<kernals::SpherePacket> spherePackets;
+    std::vector<float4> normals;
+    std::vector<uint32_t> normalIndices;
+    std::vector<float2> uvs;
+    std::vector<uint32_t> uvIndices;
+    std::vector<kernals::ShadingRecord> shadingRecords;
+    uint32_t trianglesCount = 0;
+    for (const UsedBlas& used : usedBlas) {
+        BlasRange& range = *used.range;
+        const void* blas = used.mesh ? (const void*)used.mesh : used.sphereSet;
+        // offsets wrap around when a range moves to the front, sums with them are still exact
+        uint32_t nodesOffset = (uint32_t)blasNodes.size() - range.firstNodeId;
+        uint32_t leafsOffset = (uint32_t)(used.mesh ? triangles.size() : spherePackets.size()) - range.firstLeafId;
+        for (uint32_t i = range.firstNodeId; i < range.firstNodeId + range.nodesCount; i++) {
+            kernals::BvhNode node = m_blasNodes[i];
+            node.leftNodeId = offsetNodeRef(node.leftNodeId, nodesOffset, leafsOffset);
+            node.rightNodeId = offsetNodeRef(node.rightNodeId, nodesOffset, leafsOffset);
+            blasNodes.push_back(node);
+        }
 
-    for (glm::vec3& n : mesh.normals) {
-        m_normals.push_back(make_float4(kernals::glmToHipFloat3(n), 0.0f));
+        std::optional<uint32_t>& bvhId = used.mesh ? used.mesh->bvhId : used.sphereSet->bvhId;
+        bvhId = offsetNodeRef(bvhId.value(), nodesOffset, leafsOffset);
+        for (uint32_t leafId : getLeafIds(m_blasLeafIds, blas)) {
+            m_instances[leafId].blasNodeId = bvhId.value();
+        }
+
+        if (used.sphereSet) {
+            for (uint32_t i = range.firstLeafId; i < range.firstLeafId + range.leafsCount; i++) {
+                kernals::SpherePacket packet = m_spherePackets[i];
+                for (uint32_t& materialId : packet.materialIds) {
+                    materialId = materialIds[materialId];
+                }
+                spherePackets.push_back(packet);
+            }
+            range.firstNodeId += nodesOffset;
+            range.firstLeafId += leafsOffset;
+            continue;
+        }
+
+        // the last triangle flag is the top bit, adding to the id keeps it
+        uint32_t trianglesOffset = trianglesCount - range.firstTriangleId;
+        for (uint32_t i = range.firstLeafId; i < range.firstLeafId + range.leafsCount; i++) {
+            kernals::Triangle t = m_triangles[i];
+            t.triangleId += trianglesOffset;
+            triangles.push_back(t);
+        }
+
+        if (m_options.packShadingAttributes) {
+            auto first = m_shadingRecords.begin() + range.firstTriangleId;
+            shadingRecords.insert(shadingRecords.end(), first, first + range.primitivesCount);
+        } else {
+            uint32_t normalsOffset = (uint32_t)normals.size() - range.firstNormalId;
+            uint32_t uvsOffset = (uint32_t)uvs.size() - range.firstUvId;
+            uint32_t firstNormalIndex = (uint32_t)normalIndices.size();
+            uint32_t firstUvIndex = (uint32_t)uvIndices.size();
+            for (uint32_t i = 0; i < range.primitivesCount * 3; i++) {
+                normalIndices.push_back(m_normalIndices[range.firstNormalIndex + i] + normalsOffset);
+                uvIndices.push_back(m_uvIndices[range.firstUvIndex + i] + uvsOffset);
+            }
+            auto firstNormal = m_normals.begin() + range.firstNormalId;
+            normals.insert(normals.end(), firstNormal, firstNormal + range.normalsCount);
+            auto firstUv = m_uvs.begin() + range.firstUvId;
+            uvs.insert(uvs.end(), firstUv, firstUv + range.uvsCount);
+            range.firstNormalId += normalsOffset;
+            range.firstUvId += uvsOffset;
+            range.firstNormalIndex = firstNormalIndex;
+            range.firstUvIndex = firstUvIndex;
+        }
+        range.firstNodeId += nodesOffset;
+        range.firstLeafId += leafsOffset;
+        range.firstTriangleId += trianglesOffset;
+        trianglesCount += range.primitivesCount;
     }
 
-    for (uint32_t uvi : mesh.uvIndices) {
-        m_uvIndices.push_back(uvi + m_uvs.size());
+    // leafs of group trees come first and are never detached, their ids are kept
+    std::vector<uint32_t> leafIds(m_leafs.size(), noId);
+    std::vector<Leaf> leafs;
+    std::vector<kernals::Instance> instances;
+    std::vector<float3x4> transforms;
+    for (uint32_t i = 0; i < m_leafs.size(); i++) {
+        if (m_leafs[i].detached) {
+            continue;
+        }
+
+        Leaf leaf = m_leafs[i];
+        kernals::Instance instance = m_instances[i];
+        transforms.push_back(m_transforms[leaf.transformId]);
+        leaf.transformId = (uint32_t)(transforms.size() - 1);
+        instance.transformId = leaf.transformId;
+        if (leaf.type == SphereType || leaf.type == MeshType || leaf.type == MeshInstanceType) {
+            leaf.materialId = materialIds[leaf.materialId];
+            instance.materialId = leaf.materialId;
+        }
+        leafIds[i] = (uint32_t)leafs.size();
+        leafs.push_back(leaf);
+        instances.push_back(instance);
     }
 
-    for (glm::vec2& uv : mesh.uvs) {
-        m_uvs.push_back(make_float2(uv.x, uv.y));
+    // the tlas is written again in depth first order from its root, without the unlinked nodes
+    std::vector<kernals::BvhNode> tlasNodes(m_tlasNodes.begin(), m_tlasNodes.begin() + m_tlasFirstNodeId);
+    struct StackEntry {
+        uint32_t nodeRef;
+        uint32_t parentId;
+        bool left;
+    };
+    std::vector<StackEntry> stack = { { m_tlasRootId, noId, false } };
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        uint32_t nodeId = kernals::getNodeId(entry.nodeRef);
+        kernals::BvhNodeType type = kernals::getNodeType(entry.nodeRef);
+        uint32_t nodeRef = kernals::makeNodeRef(type, type == kernals::InternalNodeType ? (uint32_t)tlasNodes.size() : leafIds[nodeId]);
+        if (entry.parentId == noId) {
+            m_tlasRootId = nodeRef;
+        } else if (entry.left) {
+            tlasNodes[entry.parentId].leftNodeId = nodeRef;
+        } else {
+            tlasNodes[entry.parentId].rightNodeId = nodeRef;
+        }
+
+        if (type == kernals::InternalNodeType) {
+            const kernals::BvhNode& node = m_tlasNodes[nodeId];
+            tlasNodes.push_back(node);
+            // the left child is popped first and follows its parent
+            stack.push_back({ node.rightNodeId, kernals::getNodeId(nodeRef), false });
+            stack.push_back({ node.leftNodeId, kernals::getNodeId(nodeRef), true });
+        }
     }
 
-    kernals::BvhNode root = buildBvhBlasRecursive(leafs, 0, leafs.size());
-    m_blasNodes.push_back(root);
-    mesh.bvhId = (uint32_t)(m_blasNodes.size() - 1);
+    m_materials = std::move(materials);
+    m_materialObjects = std::move(materialObjects);
+    m_blasNodes = std::move(blasNodes);
+    m_triangles = std::move(triangles);
+    m_spherePackets = std::move(spherePackets);
+    m_normals = std::move(normals);
+    m_normalIndices = std::move(normalIndices);
+    m_uvs = std::move(uvs);
+    m_uvIndices = std::move(uvIndices);
+    m_shadingRecords = std::move(shadingRecords);
+    m_leafs = std::move(leafs);
+    m_instances = std::move(instances);
+    m_transforms = std::move(transforms);
+    m_tlasNodes = std::move(tlasNodes);
+    m_freedTlasNodes.assign(m_tlasNodes.size(), false);
+    m_freedBytes = 0;
+    checkNodeRefIds();
+    mapLeafs();
 }
 
-kernals::BvhNode Bvh::buildBvhBlasRecursive(std::vector<Triangle>& leafs, size_t start, size_t end)
+size_t Bvh::getBuffersBytes() const noexcept
 {
-    size_t leafsSize = end - start;
-    if (leafsSize == 0) {
-        throw std::runtime_error("[ornament] mesh cannot be empty.");
-    } else if (leafsSize == 1) {
-        Triangle t = leafs[start];
-        kernals::BvhNode node;
-        node.type = kernals::TriangleType;
-        node.triangleNode.v0 = kernals::glmToHipFloat3(t.v0);
-        node.triangleNode.v1 = kernals::glmToHipFloat3(t.v1);
-        node.triangleNode.v2 = kernals::glmToHipFloat3(t.v2);
-        node.triangleNode.triangleId = t.triangleIndex;
-        return node;
-    } else {
-        int axis = randomi32(0, 2);
-        std::sort(
-            leafs.begin() + start,
-            leafs.begin() + end,
-            [axis](const Triangle& a, const Triangle& b) {
-                return a.aabb.min()[axis] < b.aabb.min()[axis];
-            });
-
-        size_t mid = start + leafsSize / 2;
-        kernals::BvhNode left = buildBvhBlasRecursive(leafs, start, mid);
-        math::Aabb leftAabb = calculateBoundingBox(leafs, start, mid);
-        m_blasNodes.push_back(left);
-        uint32_t leftId = m_blasNodes.size() - 1;
-
-        kernals::BvhNode right = buildBvhBlasRecursive(leafs, mid, end);
-        math::Aabb rightAabb = calculateBoundingBox(leafs, mid, end);
-        m_blasNodes.push_back(right);
-        uint32_t rightId = m_blasNodes.size() - 1;
-
-        kernals::BvhNode node;
-        node.type = kernals::InternalNodeType;
-        node.internalNode.leftAabbMin = kernals::glmToHipFloat3(leftAabb.min());
-        node.internalNode.leftNodeId = leftId;
-        node.internalNode.leftAabbMax = kernals::glmToHipFloat3(leftAabb.max());
-        node.internalNode.rightNodeId = rightId;
-        node.internalNode.rightAabbMin = kernals::glmToHipFloat3(rightAabb.min());
-        node.internalNode.rightAabbMax = kernals::glmToHipFloat3(rightAabb.max());
-        return node;
-    }
-}
-
-kernals::BvhNode Bvh::buildBvhTlasRecursive(std::vector<Leaf>& leafs, size_t start, size_t end)
+    return m_tlasNodes.size() * sizeof(kernals::BvhNode)
+        + m_instances.size() * sizeof(kernals::Instance)
+        + m_blasNodes.size() * sizeof(kernals::BvhNode)
+        + m_triangles.size() * sizeof(kernals::Triangle)
+        + m_spherePackets.size() * sizeof(kernals::SpherePacket)
+        + m_normals.size() * sizeof(float4)
+        + m_normalIndices.size() * sizeof(uint32_t)
+        + m_uvs.size() * sizeof(float2)
+        + m_uvIndices.size() * sizeof(uint32_t)
+        + m_shadingRecords.size() * sizeof(kernals::ShadingRecord)
+        + m_transforms.size() * sizeof(float3x4);
+}
+
+size_t Bvh::getBlasBytes(const BlasRange& range, bool triangles) const noexcept
 {
-    size_t leafsSize = end - start;
-    if (leafsSize == 0) {
-        throw std::runtime_error("[ornament] the scene cannot be empty.");
-    } else if (leafsSize == 1) {
-        Leaf leaf = leafs[start];
-        switch (leaf.type) {
-        case SphereType: {
-            auto obj = leaf.sphere;
-            appendTransform(glm::inverse(obj->transform));
-            appendTransform(obj->transform);
-            uint32_t transformId = m_transforms.size() / 2 - 1;
-            kernals::BvhNode node;
-            node.type = kernals::SphereType;
-            node.sphereNode.materialId = getMaterialIndex(*obj->material);
-            node.sphereNode.transformId = transformId;
-            return node;
-        }
-        case MeshType: {
-            auto obj = leaf.mesh;
-            appendTransform(glm::inverse(obj->transform));
-            appendTransform(obj->transform);
-            uint32_t transformId = m_transforms.size() / 2 - 1;
-            kernals::BvhNode node;
-            node.type = kernals::MeshType;
-            node.meshNode.materialId = getMaterialIndex(*obj->material);
-            node.meshNode.transformId = transformId;
-            node.meshNode.blasNodeId = obj->bvhId.value();
-            return node;
-        }
-        case MeshInstanceType: {
-            auto obj = leaf.meshInstance;
-            appendTransform(glm::inverse(obj->transform));
-            appendTransform(obj->transform);
-            uint32_t transformId = m_transforms.size() / 2 - 1;
-            kernals::BvhNode node;
-            node.type = kernals::MeshType;
-            node.meshNode.materialId = getMaterialIndex(*obj->material);
-            node.meshNode.transformId = transformId;
-            node.meshNode.blasNodeId = obj->mesh->bvhId.value();
-            return node;
+    size_t bytes = range.nodesCount * sizeof(kernals::BvhNode);
+    if (!triangles) {
+        return bytes + range.leafsCount * sizeof(kernals::SpherePacket);
+    }
+
+    bytes += range.leafsCount * sizeof(kernals::Triangle);
+    if (m_options.packShadingAttributes) {
+        return bytes + range.primitivesCount * sizeof(kernals::ShadingRecord);
+    }
+    return bytes + range.normalsCount * sizeof(float4)
+        + range.uvsCount * sizeof(float2)
+        + range.primitivesCount * 3 * 2 * sizeof(uint32_t);
+}
+
+BvhStats Bvh::computeStats() const
+{
+    // unused lanes of a packet repeat its last sphere, which the ids of the set tell apart
+    // from spheres of equal centers and radii
+    std::vector<uint32_t> packetSpheresCounts(m_spherePackets.size());
+    for (const auto& [sphereSet, range] : m_sphereSetBlasRanges) {
+        for (uint32_t i = 0; i < range.leafsCount; i++) {
+            const uint32_t* sphereIds = &range.sphereIds[i * kernals::spherePacketWidth];
+            uint32_t lane = 0;
+            while (sphereIds[lane] != sphereIds[kernals::spherePacketWidth - 1]) {
+                lane++;
+            }
+            packetSpheresCounts[range.firstLeafId + i] = lane + 1;
         }
-        default: {
-            throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+
+    BvhStats stats;
+    stats.tlas = computeTreeStats(m_tlasNodes, m_tlasRootId, m_triangles, packetSpheresCounts);
+
+    std::vector<uint32_t> blasRoots;
+    for (size_t i = 0; i < m_instances.size(); i++) {
+        if (m_leafs[i].detached) {
+            continue;
         }
+        if (m_leafs[i].type == MeshType || m_leafs[i].type == MeshInstanceType || m_leafs[i].type == SphereSetType) {
+            blasRoots.push_back(m_instances[i].blasNodeId);
         }
-    } else {
-        int axis = randomi32(0, 2);
-        std::sort(
-            leafs.begin() + start,
-            leafs.begin() + end,
-            [axis](const Leaf& a, const Leaf& b) {
-                return getAabb(a).min()[axis] < getAabb(b).min()[axis];
-            });
-
-        size_t mid = start + leafsSize / 2;
-        kernals::BvhNode left = buildBvhTlasRecursive(leafs, start, mid);
-        math::Aabb leftAabb = calculateBoundingBox(leafs, start, mid);
-        m_tlasNodes.push_back(left);
-        uint32_t leftId = m_tlasNodes.size() - 1;
-
-        kernals::BvhNode right = buildBvhTlasRecursive(leafs, mid, end);
-        math::Aabb rightAabb = calculateBoundingBox(leafs, mid, end);
-        m_tlasNodes.push_back(right);
-        uint32_t rightId = m_tlasNodes.size() - 1;
-
-        kernals::BvhNode node;
-        node.type = kernals::InternalNodeType;
-        node.internalNode.leftAabbMin = kernals::glmToHipFloat3(leftAabb.min());
-        node.internalNode.leftNodeId = leftId;
-        node.internalNode.leftAabbMax = kernals::glmToHipFloat3(leftAabb.max());
-        node.internalNode.rightNodeId = rightId;
-        node.internalNode.rightAabbMin = kernals::glmToHipFloat3(rightAabb.min());
-        node.internalNode.rightAabbMax = kernals::glmToHipFloat3(rightAabb.max());
-        return node;
     }
+    std::sort(blasRoots.begin(), blasRoots.end());
+    blasRoots.erase(std::unique(blasRoots.begin(), blasRoots.end()), blasRoots.end());
+
+    for (uint32_t rootId : blasRoots) {
+        stats.blas.push_back(computeTreeStats(m_blasNodes, rootId, m_triangles, packetSpheresCounts));
+    }
+
+    for (const GroupTree& tree : m_groupTrees) {
+        stats.groups.push_back(computeTreeStats(m_tlasNodes, tree.group->bvhId.value(), m_triangles, packetSpheresCounts));
+    }
+    return stats;
+}
+
+kernals::Bvh Bvh::getKernalBvh() const noexcept
+{
+    return {
+        .tlasNodes = toKernalArray(m_tlasNodes),
+        .instances = toKernalArray(m_instances),
+        .blasNodes = toKernalArray(m_blasNodes),
+        .triangles = toKernalArray(m_triangles),
+        .spherePackets = toKernalArray(m_spherePackets),
+        .normals = toKernalArray(m_normals),
+        .normalIndices = toKernalArray(m_normalIndices),
+        .uvs = toKernalArray(m_uvs),
+        .uvIndices = toKernalArray(m_uvIndices),
+        .shadingRecords = toKernalArray(m_shadingRecords),
+        .transforms = toKernalArray(m_transforms),
+        .tlasRootId = m_tlasRootId,
+    };
+}
+
+bool Bvh::occluded(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax) const
+{
+    kernals::Ray ray(kernals::glmToHipFloat3(origin), kernals::glmToHipFloat3(direction));
+    return kernals::bvhOccluded(getKernalBvh(), ray, tmin, tmax);
 }
 
 void Bvh::appendTransform(const glm::mat4& transform)
 {
-    glm::mat4 transposedTransform = glm::transpose(transform);
-    float4x4 kernalTransform;
-    std::memcpy(&kernalTransform, &transposedTransform, sizeof(kernalTransform));
-    m_transforms.push_back(kernalTransform);
+    m_transforms.push_back(toKernalTransform(transform));
 }
 
 uint32_t Bvh::getMaterialIndex(Material& m)
@@ -311,26 +2602,97 @@ uint32_t Bvh::getMaterialIndex(Material& m)
     }
 
     if (m.albedo.type == TextureType) {
-        m_textures.push_back(m.albedo.texture);
-        m.albedo.texture->textureId = (uint32_t)(m_textures.size() - 1);
+        getTextureIndex(*m.albedo.texture);
     }
 
     m_materials.push_back(kernals::toKernalMaterial(m));
+    m_materialObjects.push_back(&m);
     uint32_t materialId = m_materials.size() - 1;
     m.materialId = materialId;
     return materialId;
 }
 
+// textures shared by materials are added once
+uint32_t Bvh::getTextureIndex(Texture& texture)
+{
+    if (texture.textureId.has_value()) {
+        return texture.textureId.value();
+    }
+
+    m_textures.push_back(&texture);
+    uint32_t textureId = m_textures.size() - 1;
+    texture.textureId = textureId;
+    return textureId;
+}
+
+void DirtyRanges::add(uint32_t first, uint32_t count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // neighbouring nodes of a refit are mostly added in a row
+    if (!m_ranges.empty() && m_ranges.back().first + m_ranges.back().count == first) {
+        m_ranges.back().count += count;
+        return;
+    }
+    m_ranges.push_back({ first, count });
+}
+
+bool DirtyRanges::empty() const noexcept
+{
+    return m_ranges.empty();
+}
+
+std::vector<DirtyRanges::Range> DirtyRanges::get() const
+{
+    std::vector<Range> ranges = m_ranges;
+    std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) {
+        return a.first < b.first;
+    });
+
+    std::vector<Range> merged;
+    for (const Range& r : ranges) {
+        if (!merged.empty() && r.first <= merged.back().first + merged.back().count) {
+            uint32_t end = std::max(merged.back().first + merged.back().count, r.first + r.count);
+            merged.back().count = end - merged.back().first;
+        } else {
+            merged.push_back(r);
+        }
+    }
+    return merged;
+}
+
 const std::vector<kernals::BvhNode>& Bvh::getTlasNodes() const noexcept
 {
     return m_tlasNodes;
 }
 
+const std::vector<kernals::Instance>& Bvh::getInstances() const noexcept
+{
+    return m_instances;
+}
+
+uint32_t Bvh::getTlasRootId() const noexcept
+{
+    return m_tlasRootId;
+}
+
 const std::vector<kernals::BvhNode>& Bvh::getBlasNodes() const noexcept
 {
     return m_blasNodes;
 }
 
+const std::vector<kernals::Triangle>& Bvh::getTriangles() const noexcept
+{
+    return m_triangles;
+}
+
+const std::vector<kernals::SpherePacket>& Bvh::getSpherePackets() const noexcept
+{
+    return m_spherePackets;
+}
+
 const std::vector<float4>& Bvh::getNormals() const noexcept
 {
     return m_normals;
@@ -351,7 +2713,12 @@ const std::vector<uint32_t>& Bvh::getUvIndices() const noexcept
     return m_uvIndices;
 }
 
-const std::vector<float4x4>& Bvh::getTransforms() const noexcept
+const std::vector<kernals::ShadingRecord>& Bvh::getShadingRecords() const noexcept
+{
+    return m_shadingRecords;
+}
+
+const std::vector<float3x4>& Bvh::getTransforms() const noexcept
 {
     return m_transforms;
 }
@@ -366,4 +2733,9 @@ const std::vector<ornament::Texture*>& Bvh::getTextures() const noexcept
     return m_textures;
 }
 
+const SbvhStats& Bvh::getSbvhStats() const noexcept
+{
+    return m_sbvhStats;
+}
+
 }
\ No newline at end of file
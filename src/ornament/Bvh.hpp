@@ -1,7 +1,11 @@
 #pragma once
 
+#include <unordered_map>
+
+#include "BvhStats.hpp"
 #include "hip/kernals/global_structs.hip.hpp"
 #include "Scene.hpp"
+#include "ThreadPool.hpp"
 
 namespace ornament {
 
@@ -9,6 +13,8 @@ enum LeafType {
     SphereType,
     MeshType,
     MeshInstanceType,
+    SphereSetType,
+    GroupInstanceType,
 };
 
 struct Leaf {
@@ -17,7 +23,13 @@ struct Leaf {
         Sphere* sphere;
         Mesh* mesh;
         MeshInstance* meshInstance;
+        SphereSet* sphereSet;
+        GroupInstance* groupInstance;
     };
+    uint32_t materialId;
+    uint32_t transformId;
+    // the object was detached from the scene, the leaf is unlinked from the tlas until a compaction drops it
+    bool detached = false;
 };
 
 struct Triangle {
@@ -28,43 +40,291 @@ struct Triangle {
     math::Aabb aabb;
 };
 
+struct SphereLeaf {
+    glm::vec3 center;
+    float radius;
+    uint32_t materialId;
+    // index in the sphere set
+    uint32_t sphereId;
+    math::Aabb aabb;
+};
+
+struct SbvhStats {
+    uint32_t spatialSplitsCount = 0;
+    uint32_t duplicatedReferencesCount = 0;
+    // overlap of children surface areas relative to the mesh root area summed over internal nodes,
+    // for the best object splits and for the splits that were taken
+    float objectSplitOverlap = 0.0f;
+    float overlap = 0.0f;
+    // 1 - overlap / objectSplitOverlap
+    float overlapReduction = 0.0f;
+};
+
+// Node of a tree under construction. Leafs are nodes of their own, so the treelet pass
+// can move them, until compactTree keeps only the internal nodes in the kernal layout.
+struct BuildNode {
+    // type of the leafs of a leaf node
+    kernals::BvhNodeType type;
+    union {
+        // child ids are build node ids
+        kernals::BvhNode internalNode;
+        struct {
+            uint32_t firstLeafId;
+            uint32_t leafsCount;
+        } leafNode;
+    };
+};
+
+struct MeshBvh {
+    // internal nodes, references are relative to the nodes and triangles of the mesh
+    std::vector<kernals::BvhNode> nodes;
+    // leaf ranges of triangles, a triangle split by the sbvh builder is in more than one
+    std::vector<kernals::Triangle> triangles;
+    uint32_t rootNodeId = 0;
+    SbvhStats sbvhStats;
+};
+
+struct SphereSetBvh {
+    // internal nodes, references are relative to the nodes and packets of the set
+    std::vector<kernals::BvhNode> nodes;
+    // one per leaf
+    std::vector<kernals::SpherePacket> packets;
+    // per packet lane, the sphere of the set it was filled from
+    std::vector<uint32_t> sphereIds;
+    uint32_t rootNodeId = 0;
+};
+
+// Nodes and leafs of one blas in the blas buffers, kept to refit it in place when its geometry changes.
+struct BlasRange {
+    uint32_t firstNodeId = 0;
+    uint32_t nodesCount = 0;
+    // triangles or sphere packets
+    uint32_t firstLeafId = 0;
+    uint32_t leafsCount = 0;
+    // triangles of the mesh or spheres of the set
+    uint32_t primitivesCount = 0;
+    // meshes only, global id of the first triangle and offsets of the shading attributes
+    uint32_t firstTriangleId = 0;
+    uint32_t firstNormalId = 0;
+    uint32_t normalsCount = 0;
+    uint32_t firstNormalIndex = 0;
+    uint32_t firstUvId = 0;
+    uint32_t uvsCount = 0;
+    uint32_t firstUvIndex = 0;
+    // sphere sets only, see SphereSetBvh::sphereIds
+    std::vector<uint32_t> sphereIds;
+};
+
+// Element ranges of one bvh buffer written by an update.
+class DirtyRanges {
+public:
+    struct Range {
+        uint32_t first;
+        uint32_t count;
+    };
+
+    void add(uint32_t first, uint32_t count = 1);
+    bool empty() const noexcept;
+    // sorted, touching ranges are merged
+    std::vector<Range> get() const;
+
+private:
+    std::vector<Range> m_ranges;
+};
+
+// What Bvh::applyUpdates wrote, a renderer uploads only these parts of its buffers.
+struct BvhUpdate {
+    DirtyRanges tlasNodes;
+    DirtyRanges instances;
+    DirtyRanges blasNodes;
+    DirtyRanges triangles;
+    DirtyRanges spherePackets;
+    DirtyRanges normals;
+    DirtyRanges normalIndices;
+    DirtyRanges uvs;
+    DirtyRanges uvIndices;
+    DirtyRanges shadingRecords;
+    DirtyRanges transforms;
+    DirtyRanges materials;
+    // materials were appended, the materials buffer is uploaded whole
+    bool materialsResized = false;
+    // textures were appended, renderers upload the ones past their count
+    bool texturesResized = false;
+    // detached leafs were unlinked from the tlas, its topology and root can differ
+    bool tlasChanged = false;
+    // buffers were compacted, every one of them is uploaded whole
+    bool compacted = false;
+};
+
+// nodes of a group tree are a range of the tlas nodes, its root is the first of them
+struct GroupTree {
+    Group* group;
+    uint32_t firstNodeId = 0;
+    uint32_t nodesCount = 0;
+};
+
 class Bvh {
 public:
     Bvh(const Scene& scene);
     Bvh(const Bvh&) = delete;
     Bvh& operator=(const Bvh&) = delete;
     const std::vector<kernals::BvhNode>& getTlasNodes() const noexcept;
+    const std::vector<kernals::Instance>& getInstances() const noexcept;
+    uint32_t getTlasRootId() const noexcept;
     const std::vector<kernals::BvhNode>& getBlasNodes() const noexcept;
+    const std::vector<kernals::Triangle>& getTriangles() const noexcept;
+    const std::vector<kernals::SpherePacket>& getSpherePackets() const noexcept;
     const std::vector<float4>& getNormals() const noexcept;
     const std::vector<uint32_t>& getNormalIndices() const noexcept;
     const std::vector<float2>& getUvs() const noexcept;
     const std::vector<uint32_t>& getUvIndices() const noexcept;
-    const std::vector<float4x4>& getTransforms() const noexcept;
+    // indexed by the global triangle id, empty unless BvhOptions::packShadingAttributes is set,
+    // normals and uvs are empty when it is
+    const std::vector<kernals::ShadingRecord>& getShadingRecords() const noexcept;
+    // inverse transforms, indexed by transformId of instances
+    const std::vector<float3x4>& getTransforms() const noexcept;
     const std::vector<kernals::Material>& getMaterials() const noexcept;
     const std::vector<ornament::Texture*>& getTextures() const noexcept;
+    // spatial splits of all meshes built by SbvhBuilderType
+    const SbvhStats& getSbvhStats() const noexcept;
+    // Quality report of the tlas and of every blas, walks all nodes.
+    BvhStats computeStats() const;
+    // Buffers as kernal arrays, they point into the bvh and stay valid until the next applyUpdates.
+    kernals::Bvh getKernalBvh() const noexcept;
+    // Visibility query on the host: true if anything is hit along the ray between tmin and tmax,
+    // stops at the first hit found.
+    bool occluded(const glm::vec3& origin, const glm::vec3& direction, float tmin, float tmax) const;
+    // Updates transforms of spheres, meshes, mesh instances, sphere sets and group instances which were changed
+    // since the build and refits tlas bounds bottom-up, the tree topology is kept.
+    // Returns sah cost of the refitted tlas relative to the cost right after the build or the last detach,
+    // a full rebuild is worth it when it grows well above 1.
+    float refit();
+    // Applies changes of objects marked dirty in the scene: transforms and materials are rewritten,
+    // a blas whose geometry changed is refitted in place and the tlas bounds above the changed
+    // instances are refitted. Detached objects are unlinked from the tlas and blas no instance
+    // uses anymore are freed, the buffers are compacted once BvhOptions::compactionThreshold
+    // of them is unused. Shapes attached after the build are not added.
+    BvhUpdate applyUpdates(const SceneUpdates& updates);
 
 private:
+    // Only internal nodes are stored, leafs are referenced by their children.
     // TLAS nodes count:
-    // shapes = meshes + mesh_instances + spheres
-    // nodes = shapes * 2 - 1
+    // shapes = meshes + mesh_instances + spheres + sphere_sets + group_instances
+    // nodes = shapes - 1, every shape is an instance
+    // Nodes count of one group tree:
+    // nodes = shapes - 1, counted over the shapes of the group
     // BLAS nodes count of one mesh:
-    // nodes = triangles * 2 - 1
+    // nodes = leafs - 1, every leaf holds up to maxLeafSize triangles
+    // BLAS nodes count of one sphere set:
+    // nodes = leafs - 1, every leaf is one packet of up to spherePacketWidth spheres
+    // All are in depth first order, the root of a tree is its first node
+    // and an internal left child of a node follows it.
+    // Group trees come first in the tlas nodes, the tlas follows them.
     std::vector<kernals::BvhNode> m_tlasNodes;
+    std::vector<kernals::Instance> m_instances;
+    // a node reference, the root is a leaf when the scene has a single shape
+    uint32_t m_tlasRootId;
+    uint32_t m_tlasFirstNodeId = 0;
+    // a group follows the groups instanced in it
+    std::vector<GroupTree> m_groupTrees;
     std::vector<kernals::BvhNode> m_blasNodes;
+    std::vector<kernals::Triangle> m_triangles;
+    std::vector<kernals::SpherePacket> m_spherePackets;
     std::vector<float4> m_normals;
     std::vector<uint32_t> m_normalIndices;
     std::vector<float2> m_uvs;
     std::vector<uint32_t> m_uvIndices;
-    std::vector<float4x4> m_transforms;
+    std::vector<kernals::ShadingRecord> m_shadingRecords;
+    std::vector<float3x4> m_transforms;
     std::vector<kernals::Material> m_materials;
+    // scene materials of m_materials, their ids are reassigned by a compaction
+    std::vector<Material*> m_materialObjects;
     std::vector<ornament::Texture*> m_textures;
+    BvhOptions m_options;
+    // leafs of the group trees and of the tlas, the k-th one is the k-th instance
+    std::vector<Leaf> m_leafs;
+    // leafs of the group trees come first, only tlas leafs are detached
+    uint32_t m_tlasFirstLeafId = 0;
+    float m_tlasBuildSahCost;
+    SbvhStats m_sbvhStats;
+    std::unordered_map<Mesh*, BlasRange> m_meshBlasRanges;
+    std::unordered_map<SphereSet*, BlasRange> m_sphereSetBlasRanges;
+    // ids of m_leafs per scene object, filled by the first update
+    std::unordered_map<const void*, std::vector<uint32_t>> m_objectLeafIds;
+    // ids of m_leafs per mesh or sphere set, of the leafs instancing its blas
+    std::unordered_map<const void*, std::vector<uint32_t>> m_blasLeafIds;
+    // parent node ids of tlas nodes and of tlas leafs, noParentId for the root
+    std::vector<uint32_t> m_tlasParentIds;
+    std::vector<uint32_t> m_leafParentIds;
+    // tlas nodes unlinked by detaches, refits skip them
+    std::vector<bool> m_freedTlasNodes;
+    // bytes of the buffers no attached object uses
+    size_t m_freedBytes = 0;
 
     void build(const Scene& scene);
-    void buildMeshBvhRecursive(Mesh& mesh);
-    kernals::BvhNode buildBvhTlasRecursive(std::vector<Leaf>& leafs, size_t start, size_t end);
-    kernals::BvhNode buildBvhBlasRecursive(std::vector<Triangle>& leafs, size_t start, size_t end);
+    // Builds the tree of a group or the tlas at the end of the tlas nodes, leafs are appended
+    // to m_leafs. Returns the reference to the root.
+    uint32_t buildInstancesTree(std::vector<Leaf>& leafs, math::Aabb& aabb, ThreadPool& threadPool);
+    void buildMeshesBvh(const std::vector<Mesh*>& meshes, ThreadPool& threadPool);
+    // Throws when ids of nodes, instances, triangles or sphere packets do not fit node references.
+    void checkNodeRefIds() const;
+    MeshBvh buildMeshBvh(const Mesh& mesh, ThreadPool& threadPool) const;
+    void buildSphereSetsBvh(const std::vector<SphereSet*>& sphereSets, ThreadPool& threadPool);
+    SphereSetBvh buildSphereSetBvh(const SphereSet& sphereSet, const std::vector<uint32_t>& materialIds, ThreadPool& threadPool) const;
+    template <typename T>
+    uint32_t buildBvhRecursive(std::vector<T>& leafs,
+        const std::vector<uint64_t>& mortonCodes,
+        uint32_t maxLeafSize,
+        size_t start,
+        size_t end,
+        uint32_t depth,
+        std::vector<BuildNode>& nodes,
+        math::Aabb& aabb,
+        ThreadPool& threadPool) const;
+    uint32_t buildSbvhRecursive(std::vector<Triangle>& references,
+        size_t splitBudget,
+        float rootArea,
+        uint32_t depth,
+        std::vector<BuildNode>& nodes,
+        std::vector<Triangle>& leafs,
+        math::Aabb& aabb,
+        SbvhStats& stats,
+        ThreadPool& threadPool) const;
+    // bounds of a blas or of a group tree under the transform of one of their instances
+    math::Aabb transformTreeAabb(const std::vector<kernals::BvhNode>& nodes,
+        uint32_t rootNodeId,
+        const glm::mat4& transform,
+        const math::Aabb& notTransformedAabb) const;
+    void updateAabb(const Leaf& l) const;
+    // Writes the inverse transform of the leaf object, returns false when it is unchanged.
+    bool updateTransform(const Leaf& l, BvhUpdate& update);
+    // Refits group trees and the tlas bottom-up, bounds of the changed leafs are recomputed.
+    // Returns sah cost of the tlas relative to the cost right after the build.
+    float refitInstanceTrees(const std::vector<bool>& changedLeafs, BvhUpdate& update);
+    void refitMeshBlas(Mesh& mesh, BvhUpdate& update);
+    void refitSphereSetBlas(SphereSet& sphereSet, bool geometry, bool materials, BvhUpdate& update);
+    // Refits the blas nodes of range bottom-up from bounds of the leafs, returns bounds of the root.
+    math::Aabb refitBlasNodes(uint32_t rootNodeId, const BlasRange& range, BvhUpdate& update);
+    const std::vector<uint32_t>& getLeafIds(const std::unordered_map<const void*, std::vector<uint32_t>>& leafIds, const void* object) const;
+    // Fills the leaf ids of objects and blas and the parents of the tlas, detached leafs are left out.
+    void mapLeafs();
+    // Throws when the detached objects of updates would leave no tlas leaf.
+    void checkDetaches(const SceneUpdates& updates) const;
+    // Unlinks a tlas leaf of the object from the tlas, its sibling takes the place of their parent.
+    // blas is the mesh or sphere set the leaf instances, null for spheres and group instances.
+    void detachLeaf(const void* object, const void* blas, BvhUpdate& update);
+    // Frees the blas of a mesh or a sphere set when no leaf instances it anymore.
+    void freeUnusedBlas(Mesh* mesh);
+    void freeUnusedBlas(SphereSet* sphereSet);
+    // Moves the used parts of the buffers to their fronts, drops detached leafs,
+    // freed tlas nodes, blas and materials no leaf uses and renumbers references to them.
+    void compact();
+    size_t getBuffersBytes() const noexcept;
+    size_t getBlasBytes(const BlasRange& range, bool triangles) const noexcept;
     void appendTransform(const glm::mat4& transform);
     uint32_t getMaterialIndex(Material& m);
+    uint32_t getTextureIndex(Texture& texture);
+    void checkUpdatedTexture(const Material& m) const;
 };
 
 }
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace ornament {
+
+enum BvhBuilderType {
+    // binned surface area heuristic, slower build, faster traversal
+    SahBuilderType,
+    // morton code linear bvh, builds in a few milliseconds, for geometry rebuilt often
+    LbvhBuilderType,
+    // sah with spatial splits, triangles crossing a split plane are referenced from both children,
+    // slowest build, for long thin triangles whose bounds overlap a lot
+    SbvhBuilderType,
+};
+
+struct BvhOptions {
+    // number of centroid bins per axis evaluated by the binned sah builder
+    uint32_t sahBinsCount = 16;
+    // blas ranges of at most this many triangles become one leaf
+    uint32_t maxLeafSize = 4;
+    // sbvh: triangle references added by spatial splits, relative to triangles count of a mesh
+    float sbvhSplitBudget = 0.3f;
+    // sbvh: spatial splits are tried only where children of the best object split
+    // overlap by more than this fraction of the mesh root surface area
+    float sbvhMinOverlap = 1e-5f;
+    // passes of treelet restructuring run over every blas after its build,
+    // each one lowers the sah cost a bit more, 0 turns it off
+    uint32_t treeletOptimizationPasses = 0;
+    // directory where built blas are stored and loaded back from on the next build
+    // of the same mesh with the same options, empty turns the cache off
+    std::string blasCacheDirPath;
+    // threads used to build the bvh, 0 means one per hardware thread
+    uint32_t buildThreadsCount = 0;
+    // builder of the tlas, blas builder is selected per mesh by Mesh::bvhBuilder
+    BvhBuilderType tlasBuilder = SahBuilderType;
+    // levels of a blas whose transformed child bounds make up the tlas bounds of a mesh,
+    // deeper levels fit rotated meshes tighter, 0 transforms the mesh bounds as a whole
+    uint32_t instanceBoundsDepth = 4;
+    // cpu backend: 0 keeps float child bounds in wide bvh nodes,
+    // 8 or 16 quantizes them to shrink the nodes 2x or 1.3 to 1.4x
+    uint32_t quantizationBits = 0;
+    // shading normals and uvs of every triangle are packed into one 24 byte record,
+    // octahedral normals and half float uvs lose some precision but a hit reads
+    // one record instead of six scattered values
+    bool packShadingAttributes = false;
+    // bytes of the bvh buffers left unused by detached objects, relative to all of them,
+    // above which an update compacts the buffers, 1 or more never compacts
+    float compactionThreshold = 0.25f;
+};
+
+}
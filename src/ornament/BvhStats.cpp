@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <sstream>
+
+#include "BvhStats.hpp"
+#include "math/Aabb.hpp"
+
+namespace ornament {
+
+BvhTreeStats computeTreeStats(const std::vector<kernals::BvhNode>& nodes,
+    uint32_t rootNodeId,
+    const std::vector<kernals::Triangle>& triangles,
+    const std::vector<uint32_t>& packetSpheresCounts)
+{
+    auto toAabb = [](const float3& min, const float3& max) {
+        return math::Aabb(glm::vec3(min.x, min.y, min.z), glm::vec3(max.x, max.y, max.z));
+    };
+
+    BvhTreeStats stats;
+    stats.rootNodeId = rootNodeId;
+
+    struct StackEntry {
+        uint32_t nodeRef;
+        uint32_t depth;
+        float area;
+    };
+
+    // tens of thousands of areas are summed, float would lose the small ones
+    double rootArea = 0.0;
+    double internalArea = 0.0;
+    double overlapArea = 0.0;
+    double leafArea = 0.0;
+    uint64_t leafDepthsSum = 0;
+    std::vector<StackEntry> stack;
+    stack.push_back({ rootNodeId, 0, 0.0f });
+    while (!stack.empty()) {
+        StackEntry entry = stack.back();
+        stack.pop_back();
+        stats.maxDepth = std::max(stats.maxDepth, entry.depth);
+
+        uint32_t nodeId = kernals::getNodeId(entry.nodeRef);
+        kernals::BvhNodeType type = kernals::getNodeType(entry.nodeRef);
+        if (type == kernals::InternalNodeType) {
+            const kernals::BvhNode& n = nodes[nodeId];
+            math::Aabb leftAabb = toAabb(n.leftAabbMin, n.leftAabbMax);
+            math::Aabb rightAabb = toAabb(n.rightAabbMin, n.rightAabbMax);
+            math::Aabb aabb = leftAabb;
+            aabb.grow(rightAabb);
+            if (entry.nodeRef == rootNodeId) {
+                rootArea = aabb.area();
+            }
+
+            stats.internalNodesCount++;
+            internalArea += aabb.area();
+            overlapArea += math::intersection(leftAabb, rightAabb).area();
+            stack.push_back({ n.rightNodeId, entry.depth + 1, rightAabb.area() });
+            stack.push_back({ n.leftNodeId, entry.depth + 1, leftAabb.area() });
+            continue;
+        }
+
+        // a blas leaf is a range of triangles or a packet of spheres, a tlas leaf is one instance
+        uint32_t primitivesCount = 1;
+        if (type == kernals::TriangleType) {
+            while (!(triangles[nodeId + primitivesCount - 1].triangleId & kernals::lastTriangleFlag)) {
+                primitivesCount++;
+            }
+            stats.primitivesBytes += primitivesCount * sizeof(kernals::Triangle);
+        } else if (type == kernals::SpherePacketType) {
+            primitivesCount = packetSpheresCounts[nodeId];
+            stats.primitivesBytes += sizeof(kernals::SpherePacket);
+        } else {
+            stats.leafsBytes += sizeof(kernals::Instance);
+        }
+
+        stats.leafNodesCount++;
+        stats.primitivesCount += primitivesCount;
+        leafArea += entry.area * primitivesCount;
+        leafDepthsSum += entry.depth;
+
+        if (stats.leafDepthHistogram.size() <= entry.depth) {
+            stats.leafDepthHistogram.resize(entry.depth + 1);
+        }
+        stats.leafDepthHistogram[entry.depth]++;
+
+        if (stats.leafSizeHistogram.size() <= primitivesCount) {
+            stats.leafSizeHistogram.resize(primitivesCount + 1);
+        }
+        stats.leafSizeHistogram[primitivesCount]++;
+    }
+
+    // a single leaf tree has no bounds stored, any ray hitting it tests all of its primitives
+    if (rootArea > 0.0) {
+        stats.sahCost = (float)(internalArea / rootArea);
+        stats.expectedPrimitiveTests = (float)(leafArea / rootArea);
+    } else if (stats.internalNodesCount == 0) {
+        stats.expectedPrimitiveTests = (float)stats.primitivesCount;
+    }
+
+    if (internalArea > 0.0) {
+        stats.overlapRatio = (float)(overlapArea / internalArea);
+    }
+
+    stats.averageLeafDepth = (float)((double)leafDepthsSum / stats.leafNodesCount);
+    stats.internalNodesBytes = stats.internalNodesCount * sizeof(kernals::BvhNode);
+    return stats;
+}
+
+void writeJson(std::ostringstream& json, const std::vector<uint32_t>& histogram)
+{
+    json << "[";
+    for (size_t i = 0; i < histogram.size(); i++) {
+        json << (i > 0 ? ", " : "") << histogram[i];
+    }
+    json << "]";
+}
+
+void writeJson(std::ostringstream& json, const BvhTreeStats& stats, const char* indent)
+{
+    json << "{\n";
+    json << indent << "  \"rootNodeId\": " << stats.rootNodeId << ",\n";
+    json << indent << "  \"internalNodesCount\": " << stats.internalNodesCount << ",\n";
+    json << indent << "  \"leafNodesCount\": " << stats.leafNodesCount << ",\n";
+    json << indent << "  \"primitivesCount\": " << stats.primitivesCount << ",\n";
+    json << indent << "  \"sahCost\": " << stats.sahCost << ",\n";
+    json << indent << "  \"expectedPrimitiveTests\": " << stats.expectedPrimitiveTests << ",\n";
+    json << indent << "  \"overlapRatio\": " << stats.overlapRatio << ",\n";
+    json << indent << "  \"maxDepth\": " << stats.maxDepth << ",\n";
+    json << indent << "  \"averageLeafDepth\": " << stats.averageLeafDepth << ",\n";
+    json << indent << "  \"leafDepthHistogram\": ";
+    writeJson(json, stats.leafDepthHistogram);
+    json << ",\n";
+    json << indent << "  \"leafSizeHistogram\": ";
+    writeJson(json, stats.leafSizeHistogram);
+    json << ",\n";
+    json << indent << "  \"internalNodesBytes\": " << stats.internalNodesBytes << ",\n";
+    json << indent << "  \"leafsBytes\": " << stats.leafsBytes << ",\n";
+    json << indent << "  \"primitivesBytes\": " << stats.primitivesBytes << "\n";
+    json << indent << "}";
+}
+
+std::string BvhStats::toJson() const
+{
+    std::ostringstream json;
+    json << "{\n  \"tlas\": ";
+    writeJson(json, tlas, "  ");
+    json << ",\n  \"blas\": [";
+    for (size_t i = 0; i < blas.size(); i++) {
+        json << (i > 0 ? ", " : "");
+        writeJson(json, blas[i], "  ");
+    }
+    json << "],\n  \"groups\": [";
+    for (size_t i = 0; i < groups.size(); i++) {
+        json << (i > 0 ? ", " : "");
+        writeJson(json, groups[i], "  ");
+    }
+    json << "]\n}\n";
+    return json.str();
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "hip/kernals/global_structs.hip.hpp"
+
+namespace ornament {
+
+struct BvhTreeStats {
+    // node reference
+    uint32_t rootNodeId = 0;
+    uint32_t internalNodesCount = 0;
+    uint32_t leafNodesCount = 0;
+    // triangles or spheres of a blas referenced from its leafs, objects of the tlas or of a group
+    uint32_t primitivesCount = 0;
+    // internal nodes a random ray hitting the root is expected to visit
+    float sahCost = 0.0f;
+    // primitives a random ray hitting the root is expected to test
+    float expectedPrimitiveTests = 0.0f;
+    // overlap of children bounds over bounds of internal nodes, both summed by area
+    float overlapRatio = 0.0f;
+    // depth of the root is 0
+    uint32_t maxDepth = 0;
+    float averageLeafDepth = 0.0f;
+    // leafDepthHistogram[d] is the number of leafs at depth d
+    std::vector<uint32_t> leafDepthHistogram;
+    // leafSizeHistogram[n] is the number of leafs with n primitives
+    std::vector<uint32_t> leafSizeHistogram;
+    size_t internalNodesBytes = 0;
+    // instances of the tlas or of a group, leafs of a blas take no memory of their own
+    size_t leafsBytes = 0;
+    size_t primitivesBytes = 0;
+};
+
+struct BvhStats {
+    BvhTreeStats tlas;
+    // one per mesh or sphere set, in the order of their blas in the blas nodes
+    std::vector<BvhTreeStats> blas;
+    // one per group, instanced groups first
+    std::vector<BvhTreeStats> groups;
+
+    std::string toJson() const;
+};
+
+// Walks the tree under the node reference rootNodeId, blas leafs are counted in triangles or spheres.
+// packetSpheresCounts are the spheres in each sphere packet, the unused lanes are not counted.
+BvhTreeStats computeTreeStats(const std::vector<kernals::BvhNode>& nodes,
+    uint32_t rootNodeId,
+    const std::vector<kernals::Triangle>& triangles,
+    const std::vector<uint32_t>& packetSpheresCounts);
+
+}
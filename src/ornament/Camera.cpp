@@ -5,7 +5,7 @@ namespace ornament {
 Camera::Camera(const glm::vec3& lookFrom, const glm::vec3& lookAt, const glm::vec3& vup, float aspectRatio, float vfov, float aperture, float focusDist) noexcept
 {
     float theta = glm::radians(vfov);
-    float h = std::tanf(theta / 2.0f);
+    float h = std::tan(theta / 2.0f);
     float viewportHeight = 2.0f * h;
     float viewportWidth = aspectRatio * viewportHeight;
 
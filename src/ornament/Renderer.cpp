@@ -0,0 +1,59 @@
+#include <stdexcept>
+
+#include "Renderer.hpp"
+#include "cpu/PathTracer.hpp"
+#ifdef ORNAMENT_HIP
+#include "hip/PathTracer.hpp"
+#endif
+
+namespace ornament {
+
+bool isBackendAvailable(Backend backend) noexcept
+{
+    switch (backend) {
+    case CpuBackend: {
+        return true;
+    }
+    case HipBackend: {
+#ifdef ORNAMENT_HIP
+        return true;
+#else
+        return false;
+#endif
+    }
+    default: {
+        return false;
+    }
+    }
+}
+
+std::unique_ptr<IRenderer> createCpuRenderer(Scene scene, uint32_t threadsCount)
+{
+    return std::make_unique<cpu::PathTracer>(std::move(scene), threadsCount);
+}
+
+std::unique_ptr<IRenderer> createHipRenderer([[maybe_unused]] Scene scene, [[maybe_unused]] const char* kernalsDirPath)
+{
+#ifdef ORNAMENT_HIP
+    return std::make_unique<hip::PathTracer>(std::move(scene), kernalsDirPath);
+#else
+    throw std::runtime_error("[ornament] hip backend is disabled in this build.");
+#endif
+}
+
+std::unique_ptr<IRenderer> createRenderer(Scene scene, const RendererOptions& options)
+{
+    switch (options.backend) {
+    case CpuBackend: {
+        return createCpuRenderer(std::move(scene), options.threadsCount);
+    }
+    case HipBackend: {
+        return createHipRenderer(std::move(scene), options.kernalsDirPath);
+    }
+    default: {
+        throw std::runtime_error("[ornament] not implemented switch case.");
+    }
+    }
+}
+
+}
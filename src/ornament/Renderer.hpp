@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "Scene.hpp"
+
+namespace ornament {
+
+class IRenderer {
+public:
+    virtual ~IRenderer() = default;
+    virtual Scene& getScene() noexcept = 0;
+    virtual void getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize) = 0;
+    virtual void render() = 0;
+    // Uploads changes of the scene objects marked dirty since the last call, render calls it too.
+    virtual void applyUpdates() = 0;
+};
+
+enum Backend {
+    CpuBackend,
+    HipBackend,
+};
+
+struct RendererOptions {
+    Backend backend = CpuBackend;
+    // hip backend only, directory with ornament_kernals.co
+    const char* kernalsDirPath = ".";
+    // cpu backend only, 0 means all hardware threads
+    uint32_t threadsCount = 0;
+};
+
+bool isBackendAvailable(Backend backend) noexcept;
+std::unique_ptr<IRenderer> createCpuRenderer(Scene scene, uint32_t threadsCount = 0);
+std::unique_ptr<IRenderer> createHipRenderer(Scene scene, const char* kernalsDirPath);
+std::unique_ptr<IRenderer> createRenderer(Scene scene, const RendererOptions& options);
+
+}
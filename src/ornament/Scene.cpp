@@ -1,5 +1,6 @@
 #include "Scene.hpp"
 #include "math/math.hpp"
+#include <algorithm>
 #include <glm/gtc/matrix_transform.hpp>
 
 namespace ornament {
@@ -245,6 +246,58 @@ std::shared_ptr<MeshInstance> Scene::meshInstance(const std::shared_ptr<Mesh>& m
     return mi;
 }
 
+std::shared_ptr<SphereSet> Scene::sphereSet()
+{
+    auto sphereSet = std::make_shared<SphereSet>();
+    m_sphereSets.push_back(sphereSet);
+    return sphereSet;
+}
+
+void SphereSet::add(const glm::vec3& center, float radius, const std::shared_ptr<Material>& material)
+{
+    centers.push_back(center);
+    radii.push_back(radius);
+    materials.push_back(material);
+    notTransformedAabb.grow(math::Aabb(center - glm::vec3(radius), center + glm::vec3(radius)));
+}
+
+std::shared_ptr<Group> Scene::group()
+{
+    auto g = std::make_shared<Group>();
+    m_groups.push_back(g);
+    return g;
+}
+
+std::shared_ptr<GroupInstance> Scene::groupInstance(const std::shared_ptr<Group>& group, const glm::mat4& transform)
+{
+    auto gi = std::make_shared<GroupInstance>(GroupInstance {
+        .group = group,
+        .transform = transform,
+        .aabb = math::Aabb() });
+    m_groupInstances.push_back(gi);
+    return gi;
+}
+
+void Group::attach(const std::shared_ptr<Sphere>& sphere)
+{
+    spheres.push_back(sphere);
+}
+
+void Group::attach(const std::shared_ptr<MeshInstance>& meshInstance)
+{
+    meshInstances.push_back(meshInstance);
+}
+
+void Group::attach(const std::shared_ptr<SphereSet>& sphereSet)
+{
+    sphereSets.push_back(sphereSet);
+}
+
+void Group::attach(const std::shared_ptr<GroupInstance>& groupInstance)
+{
+    groupInstances.push_back(groupInstance);
+}
+
 void Scene::attach(const std::shared_ptr<Sphere>& sphere)
 {
     m_attachedSpheres.push_back(sphere);
@@ -260,6 +313,179 @@ void Scene::attach(const std::shared_ptr<MeshInstance>& meshInstance)
     m_attachedMeshInstances.push_back(meshInstance);
 }
 
+void Scene::attach(const std::shared_ptr<SphereSet>& sphereSet)
+{
+    m_attachedSphereSets.push_back(sphereSet);
+}
+
+void Scene::attach(const std::shared_ptr<GroupInstance>& groupInstance)
+{
+    m_attachedGroupInstances.push_back(groupInstance);
+}
+
+template <typename T>
+void detachObject(std::vector<std::shared_ptr<T>>& attached, std::vector<std::shared_ptr<T>>& detached, const std::shared_ptr<T>& object)
+{
+    auto found = std::find(attached.begin(), attached.end(), object);
+    if (found == attached.end()) {
+        throw std::runtime_error("[ornament] detached object is not attached to the scene.");
+    }
+    attached.erase(found);
+    detached.push_back(object);
+}
+
+void Scene::detach(const std::shared_ptr<Sphere>& sphere)
+{
+    checkNotLastDetached();
+    detachObject(m_attachedSpheres, m_updates.detachedSpheres, sphere);
+}
+
+void Scene::detach(const std::shared_ptr<Mesh>& mesh)
+{
+    checkNotLastDetached();
+    detachObject(m_attachedMeshes, m_updates.detachedMeshes, mesh);
+}
+
+void Scene::detach(const std::shared_ptr<MeshInstance>& meshInstance)
+{
+    checkNotLastDetached();
+    detachObject(m_attachedMeshInstances, m_updates.detachedMeshInstances, meshInstance);
+}
+
+void Scene::detach(const std::shared_ptr<SphereSet>& sphereSet)
+{
+    checkNotLastDetached();
+    detachObject(m_attachedSphereSets, m_updates.detachedSphereSets, sphereSet);
+}
+
+void Scene::detach(const std::shared_ptr<GroupInstance>& groupInstance)
+{
+    checkNotLastDetached();
+    detachObject(m_attachedGroupInstances, m_updates.detachedGroupInstances, groupInstance);
+}
+
+// a bvh cannot be built or kept without shapes
+void Scene::checkNotLastDetached() const
+{
+    size_t shapesCount = m_attachedSpheres.size()
+        + m_attachedMeshes.size()
+        + m_attachedMeshInstances.size()
+        + m_attachedSphereSets.size()
+        + m_attachedGroupInstances.size();
+    if (shapesCount <= 1) {
+        throw std::runtime_error("[ornament] scene cannot be empty.");
+    }
+}
+
+// an object is listed on its first change, later changes only add flags
+template <typename T>
+void markObjectDirty(std::vector<std::shared_ptr<T>>& objects, const std::shared_ptr<T>& object, uint32_t flags)
+{
+    if (object->dirtyFlags == 0) {
+        objects.push_back(object);
+    }
+    object->dirtyFlags |= flags;
+}
+
+void Scene::markDirty(const std::shared_ptr<Sphere>& sphere, uint32_t flags)
+{
+    if (flags & GeometryDirty) {
+        throw std::runtime_error("[ornament] sphere geometry is its transform.");
+    }
+    markObjectDirty(m_updates.spheres, sphere, flags);
+}
+
+void Scene::markDirty(const std::shared_ptr<Mesh>& mesh, uint32_t flags)
+{
+    markObjectDirty(m_updates.meshes, mesh, flags);
+}
+
+void Scene::markDirty(const std::shared_ptr<MeshInstance>& meshInstance, uint32_t flags)
+{
+    if (flags & GeometryDirty) {
+        throw std::runtime_error("[ornament] mesh instance geometry is the geometry of its mesh.");
+    }
+    markObjectDirty(m_updates.meshInstances, meshInstance, flags);
+}
+
+void Scene::markDirty(const std::shared_ptr<SphereSet>& sphereSet, uint32_t flags)
+{
+    markObjectDirty(m_updates.sphereSets, sphereSet, flags);
+}
+
+void Scene::markDirty(const std::shared_ptr<GroupInstance>& groupInstance, uint32_t flags)
+{
+    if (flags & ~TransformDirty) {
+        throw std::runtime_error("[ornament] only transform of a group instance can be marked dirty.");
+    }
+    markObjectDirty(m_updates.groupInstances, groupInstance, flags);
+}
+
+void Scene::markDirty(const std::shared_ptr<Material>& material)
+{
+    markObjectDirty(m_updates.materials, material, MaterialDirty);
+}
+
+bool Scene::getDirty() const noexcept
+{
+    return !m_updates.spheres.empty()
+        || !m_updates.meshes.empty()
+        || !m_updates.meshInstances.empty()
+        || !m_updates.sphereSets.empty()
+        || !m_updates.groupInstances.empty()
+        || !m_updates.materials.empty()
+        || !m_updates.detachedSpheres.empty()
+        || !m_updates.detachedMeshes.empty()
+        || !m_updates.detachedMeshInstances.empty()
+        || !m_updates.detachedSphereSets.empty()
+        || !m_updates.detachedGroupInstances.empty();
+}
+
+const SceneUpdates& Scene::getUpdates() const noexcept
+{
+    return m_updates;
+}
+
+template <typename T>
+void clearDirty(std::vector<std::shared_ptr<T>>& objects) noexcept
+{
+    for (auto& o : objects) {
+        o->dirtyFlags = 0;
+    }
+    objects.clear();
+}
+
+void Scene::clearUpdates() noexcept
+{
+    clearDirty(m_updates.spheres);
+    clearDirty(m_updates.meshes);
+    clearDirty(m_updates.meshInstances);
+    clearDirty(m_updates.sphereSets);
+    clearDirty(m_updates.groupInstances);
+    clearDirty(m_updates.materials);
+    m_updates.detachedSpheres.clear();
+    m_updates.detachedMeshes.clear();
+    m_updates.detachedMeshInstances.clear();
+    m_updates.detachedSphereSets.clear();
+    m_updates.detachedGroupInstances.clear();
+}
+
+template <typename T>
+void reattachObjects(std::vector<std::shared_ptr<T>>& attached, std::vector<std::shared_ptr<T>>& detached)
+{
+    attached.insert(attached.end(), detached.begin(), detached.end());
+    detached.clear();
+}
+
+void Scene::cancelDetaches()
+{
+    reattachObjects(m_attachedSpheres, m_updates.detachedSpheres);
+    reattachObjects(m_attachedMeshes, m_updates.detachedMeshes);
+    reattachObjects(m_attachedMeshInstances, m_updates.detachedMeshInstances);
+    reattachObjects(m_attachedSphereSets, m_updates.detachedSphereSets);
+    reattachObjects(m_attachedGroupInstances, m_updates.detachedGroupInstances);
+}
+
 State& Scene::getState() noexcept
 {
     return m_state;
@@ -270,6 +496,16 @@ Camera& Scene::getCamera() noexcept
     return m_camera;
 }
 
+BvhOptions& Scene::getBvhOptions() noexcept
+{
+    return m_bvhOptions;
+}
+
+const BvhOptions& Scene::getBvhOptions() const noexcept
+{
+    return m_bvhOptions;
+}
+
 const std::vector<std::shared_ptr<Sphere>>& Scene::getAttachedSpheres() const noexcept
 {
     return m_attachedSpheres;
@@ -285,6 +521,16 @@ const std::vector<std::shared_ptr<MeshInstance>>& Scene::getAttachedMeshInstance
     return m_attachedMeshInstances;
 }
 
+const std::vector<std::shared_ptr<SphereSet>>& Scene::getAttachedSphereSets() const noexcept
+{
+    return m_attachedSphereSets;
+}
+
+const std::vector<std::shared_ptr<GroupInstance>>& Scene::getAttachedGroupInstances() const noexcept
+{
+    return m_attachedGroupInstances;
+}
+
 const std::vector<std::shared_ptr<Material>>& Scene::getMaterials() const noexcept
 {
     return m_materials;
@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <vector>
 
+#include "BvhOptions.hpp"
 #include "Camera.hpp"
 #include "State.hpp"
 
@@ -77,6 +78,15 @@ struct Color {
     }
 };
 
+// parts of a scene object changed after a renderer was created from the scene
+enum DirtyFlags : uint32_t {
+    TransformDirty = 1 << 0,
+    // the material of an object was replaced, or values of a material were changed
+    MaterialDirty = 1 << 1,
+    // vertices of a mesh or spheres of a sphere set were moved, their count is kept
+    GeometryDirty = 1 << 2,
+};
+
 enum MaterialType : uint32_t {
     Lambertian = 0,
     Metal = 1,
@@ -90,6 +100,7 @@ struct Material {
     float fuzz;
     float ior;
     std::optional<uint32_t> materialId;
+    uint32_t dirtyFlags = 0;
 };
 
 struct Mesh {
@@ -106,8 +117,10 @@ struct Mesh {
     glm::mat4 transform;
     std::shared_ptr<Material> material;
     std::optional<uint32_t> bvhId;
+    BvhBuilderType bvhBuilder = SahBuilderType;
     math::Aabb aabb;
     math::Aabb notTransformedAabb;
+    uint32_t dirtyFlags = 0;
 };
 
 struct MeshInstance {
@@ -115,12 +128,83 @@ struct MeshInstance {
     std::shared_ptr<Material> material;
     glm::mat4 transform;
     math::Aabb aabb;
+    uint32_t dirtyFlags = 0;
 };
 
 struct Sphere {
     std::shared_ptr<Material> material;
     glm::mat4 transform;
     math::Aabb aabb;
+    uint32_t dirtyFlags = 0;
+};
+
+// Spheres sharing one blas, centers and radii are in the space of the set and every sphere
+// has a material of its own. The set is a single tlas leaf and a ray is transformed once for
+// all of its spheres, instead of once per sphere as for Scene::sphere.
+struct SphereSet {
+    SphereSet() = default;
+    SphereSet(const SphereSet&) = delete;
+    SphereSet& operator=(const SphereSet&) = delete;
+    std::vector<glm::vec3> centers;
+    std::vector<float> radii;
+    std::vector<std::shared_ptr<Material>> materials;
+    glm::mat4 transform = glm::mat4(1.0f);
+    std::optional<uint32_t> bvhId;
+    // SbvhBuilderType is for triangles only
+    BvhBuilderType bvhBuilder = SahBuilderType;
+    math::Aabb aabb;
+    math::Aabb notTransformedAabb;
+    uint32_t dirtyFlags = 0;
+
+    void add(const glm::vec3& center, float radius, const std::shared_ptr<Material>& material);
+};
+
+struct GroupInstance;
+
+// Assembly of spheres, mesh instances and instances of other groups placed relative to the group origin.
+// The bvh builds one tree of instances per group, however many times the group is instanced.
+struct Group {
+    Group() = default;
+    Group(const Group&) = delete;
+    Group& operator=(const Group&) = delete;
+    std::vector<std::shared_ptr<Sphere>> spheres;
+    std::vector<std::shared_ptr<MeshInstance>> meshInstances;
+    std::vector<std::shared_ptr<SphereSet>> sphereSets;
+    std::vector<std::shared_ptr<GroupInstance>> groupInstances;
+    // node reference of the group tree root, set by the bvh build
+    std::optional<uint32_t> bvhId;
+    // bounds in the group space, set by the bvh build
+    math::Aabb aabb;
+
+    void attach(const std::shared_ptr<Sphere>& sphere);
+    void attach(const std::shared_ptr<MeshInstance>& meshInstance);
+    void attach(const std::shared_ptr<SphereSet>& sphereSet);
+    void attach(const std::shared_ptr<GroupInstance>& groupInstance);
+};
+
+struct GroupInstance {
+    std::shared_ptr<Group> group;
+    glm::mat4 transform;
+    // set by the bvh build, bounds of the group are not known before
+    math::Aabb aabb;
+    uint32_t dirtyFlags = 0;
+};
+
+// Objects marked dirty since a renderer last applied the updates, every object is listed once
+// and its dirtyFlags tell what was changed.
+struct SceneUpdates {
+    std::vector<std::shared_ptr<Sphere>> spheres;
+    std::vector<std::shared_ptr<Mesh>> meshes;
+    std::vector<std::shared_ptr<MeshInstance>> meshInstances;
+    std::vector<std::shared_ptr<SphereSet>> sphereSets;
+    std::vector<std::shared_ptr<GroupInstance>> groupInstances;
+    std::vector<std::shared_ptr<Material>> materials;
+    // one entry per detach, an object attached twice is listed twice when both are detached
+    std::vector<std::shared_ptr<Sphere>> detachedSpheres;
+    std::vector<std::shared_ptr<Mesh>> detachedMeshes;
+    std::vector<std::shared_ptr<MeshInstance>> detachedMeshInstances;
+    std::vector<std::shared_ptr<SphereSet>> detachedSphereSets;
+    std::vector<std::shared_ptr<GroupInstance>> detachedGroupInstances;
 };
 
 class Scene {
@@ -154,30 +238,70 @@ public:
     std::shared_ptr<MeshInstance> meshInstance(const std::shared_ptr<Mesh>& mesh,
         const glm::mat4& transform,
         const std::shared_ptr<Material>& material);
+    std::shared_ptr<SphereSet> sphereSet();
+    std::shared_ptr<Group> group();
+    std::shared_ptr<GroupInstance> groupInstance(const std::shared_ptr<Group>& group, const glm::mat4& transform);
 
     void attach(const std::shared_ptr<Sphere>& sphere);
     void attach(const std::shared_ptr<Mesh>& mesh);
     void attach(const std::shared_ptr<MeshInstance>& meshInstance);
+    void attach(const std::shared_ptr<SphereSet>& sphereSet);
+    void attach(const std::shared_ptr<GroupInstance>& groupInstance);
+    // Removes one attachment of an object, the renderer drops it on the next render. Blas and materials
+    // no object uses anymore are freed with it, the bvh buffers are compacted once enough of them are.
+    void detach(const std::shared_ptr<Sphere>& sphere);
+    void detach(const std::shared_ptr<Mesh>& mesh);
+    void detach(const std::shared_ptr<MeshInstance>& meshInstance);
+    void detach(const std::shared_ptr<SphereSet>& sphereSet);
+    void detach(const std::shared_ptr<GroupInstance>& groupInstance);
+
+    // Marks fields of an object changed in place after a renderer was created, flags are DirtyFlags.
+    // The renderer applies them on the next render without rebuilding the whole bvh.
+    void markDirty(const std::shared_ptr<Sphere>& sphere, uint32_t flags);
+    void markDirty(const std::shared_ptr<Mesh>& mesh, uint32_t flags);
+    void markDirty(const std::shared_ptr<MeshInstance>& meshInstance, uint32_t flags);
+    void markDirty(const std::shared_ptr<SphereSet>& sphereSet, uint32_t flags);
+    void markDirty(const std::shared_ptr<GroupInstance>& groupInstance, uint32_t flags);
+    // albedo, fuzz or ior of the material were changed
+    void markDirty(const std::shared_ptr<Material>& material);
+    bool getDirty() const noexcept;
+    const SceneUpdates& getUpdates() const noexcept;
+    void clearUpdates() noexcept;
+    // Attaches again the objects detached since the updates were last cleared, a renderer cancels
+    // the detaches the bvh rejected so the other updates are still applied on the next render.
+    void cancelDetaches();
 
     State& getState() noexcept;
     Camera& getCamera() noexcept;
+    BvhOptions& getBvhOptions() noexcept;
+    const BvhOptions& getBvhOptions() const noexcept;
     const std::vector<std::shared_ptr<Sphere>>& getAttachedSpheres() const noexcept;
     const std::vector<std::shared_ptr<Mesh>>& getAttachedMeshes() const noexcept;
     const std::vector<std::shared_ptr<MeshInstance>>& getAttachedMeshInstances() const noexcept;
+    const std::vector<std::shared_ptr<SphereSet>>& getAttachedSphereSets() const noexcept;
+    const std::vector<std::shared_ptr<GroupInstance>>& getAttachedGroupInstances() const noexcept;
     const std::vector<std::shared_ptr<Material>>& getMaterials() const noexcept;
     const std::vector<std::shared_ptr<Texture>>& getTextures() const noexcept;
 
 private:
     Camera m_camera;
     State m_state;
+    BvhOptions m_bvhOptions;
     std::vector<std::shared_ptr<Sphere>> m_spheres;
     std::vector<std::shared_ptr<Mesh>> m_meshes;
     std::vector<std::shared_ptr<MeshInstance>> m_meshInstances;
+    std::vector<std::shared_ptr<SphereSet>> m_sphereSets;
+    std::vector<std::shared_ptr<Group>> m_groups;
+    std::vector<std::shared_ptr<GroupInstance>> m_groupInstances;
     std::vector<std::shared_ptr<Material>> m_materials;
     std::vector<std::shared_ptr<Texture>> m_textures;
     std::vector<std::shared_ptr<Sphere>> m_attachedSpheres;
     std::vector<std::shared_ptr<Mesh>> m_attachedMeshes;
     std::vector<std::shared_ptr<MeshInstance>> m_attachedMeshInstances;
+    std::vector<std::shared_ptr<SphereSet>> m_attachedSphereSets;
+    std::vector<std::shared_ptr<GroupInstance>> m_attachedGroupInstances;
+    SceneUpdates m_updates;
+    void checkNotLastDetached() const;
 };
 
 }
\ No newline at end of file
@@ -0,0 +1,172 @@
+#include <algorithm>
+
+#include "ThreadPool.hpp"
+
+namespace ornament {
+
+ThreadPool::ThreadPool(uint32_t threadsCount)
+{
+    if (threadsCount == 0) {
+        threadsCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    m_threads.reserve(threadsCount - 1);
+    for (uint32_t i = 0; i < threadsCount - 1; i++) {
+        m_threads.emplace_back([this] { workerLoop(); });
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+
+    m_taskAvailable.notify_all();
+    for (auto& t : m_threads) {
+        t.join();
+    }
+}
+
+uint32_t ThreadPool::getThreadsCount() const noexcept
+{
+    return (uint32_t)m_threads.size() + 1;
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto body = [&]() {
+        try {
+            for (size_t i = next++; i < count; i = next++) {
+                func(i);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next = count;
+        }
+    };
+
+    uint32_t helpers = (uint32_t)std::min(m_threads.size(), count > 0 ? count - 1 : 0);
+    std::atomic<uint32_t> pending = helpers;
+    for (uint32_t i = 0; i < helpers; i++) {
+        submit([&]() {
+            body();
+            pending--;
+        });
+    }
+
+    body();
+    wait(pending);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::parallelInvoke(const std::function<void()>& first, const std::function<void()>& second)
+{
+    if (m_threads.empty()) {
+        first();
+        second();
+        return;
+    }
+
+    std::exception_ptr secondError;
+    std::atomic<uint32_t> pending = 1;
+    submit([&]() {
+        try {
+            second();
+        } catch (...) {
+            secondError = std::current_exception();
+        }
+        pending--;
+    });
+
+    // second task references this stack frame, it has to finish before anything leaves it
+    try {
+        first();
+    } catch (...) {
+        wait(pending);
+        throw;
+    }
+
+    wait(pending);
+    if (secondError) {
+        std::rethrow_exception(secondError);
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_taskAvailable.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+            if (m_stop && m_tasks.empty()) {
+                return;
+            }
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+
+        task();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_taskFinished.notify_all();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+
+    m_taskAvailable.notify_one();
+}
+
+bool ThreadPool::runPendingTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_tasks.empty()) {
+            return false;
+        }
+
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+    }
+
+    task();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_taskFinished.notify_all();
+    return true;
+}
+
+void ThreadPool::wait(const std::atomic<uint32_t>& pending)
+{
+    // help with queued tasks instead of blocking, so nested parallelFor calls cannot deadlock
+    while (pending > 0) {
+        if (runPendingTask()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_taskFinished.wait(lock, [&] { return pending == 0 || !m_tasks.empty(); });
+    }
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ornament {
+
+class ThreadPool {
+public:
+    // threadsCount == 0 means one worker per hardware thread,
+    // the calling thread always takes part in the work as well
+    ThreadPool(uint32_t threadsCount = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    uint32_t getThreadsCount() const noexcept;
+    void parallelFor(size_t count, const std::function<void(size_t)>& func);
+    // fork-join: runs both functions concurrently and returns when both are finished,
+    // may be nested from inside of other pool tasks
+    void parallelInvoke(const std::function<void()>& first, const std::function<void()>& second);
+
+private:
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_taskAvailable;
+    std::condition_variable m_taskFinished;
+    bool m_stop = false;
+
+    void workerLoop();
+    void submit(std::function<void()> task);
+    bool runPendingTask();
+    void wait(const std::atomic<uint32_t>& pending);
+};
+
+}
@@ -0,0 +1,275 @@
+#include <cstring>
+#include <stdexcept>
+
+#include "../Bvh.hpp"
+#include "../global_structs_helper.hpp"
+#include "../hip/kernals/pathtracing.hip.hpp"
+#include "PathTracer.hpp"
+
+namespace ornament::cpu {
+PathTracer::PathTracer(Scene scene, uint32_t threadsCount)
+    : m_scene(std::move(scene))
+    , m_threadPool(threadsCount)
+    , m_quantizationBits(m_scene.getBvhOptions().quantizationBits)
+{
+    if (m_quantizationBits != 0 && m_quantizationBits != 8 && m_quantizationBits != 16) {
+        throw std::runtime_error("[ornament] bvh quantization bits must be 0, 8 or 16.");
+    }
+
+    m_bvh = std::make_unique<Bvh>(m_scene);
+
+    printf("Cpu path tracer\n");
+    printf("      threads = %u\n", m_threadPool.getThreadsCount());
+    printf("      bvh width = %u\n", wideBvhWidth);
+    printf("      bvh quantization bits = %u\n", m_quantizationBits);
+
+    m_targetBuffer = buffers::Target(m_scene.getState().getResolution());
+    m_textures = buffers::Textures(m_bvh->getTextures());
+    collapseWideNodes();
+}
+
+// only blas reachable from the tlas are collapsed, wide nodes of freed ones are dropped
+void PathTracer::collapseWideNodes()
+{
+    std::vector<WideBvhNode<wideBvhWidth>> tlasWideNodes;
+    std::vector<kernals::Instance> wideInstances;
+    std::vector<WideBvhNode<wideBvhWidth>> blasWideNodes;
+    uint32_t tlasWideRoot = collapseBvh(m_bvh->getKernalBvh(), tlasWideNodes, wideInstances, blasWideNodes, &m_tlasWideSources, &m_blasWideSources);
+    switch (m_quantizationBits) {
+    case 16: {
+        m_wideNodes16 = buffers::WideNodes(quantizeWideNodes<uint16_t>(tlasWideNodes), wideInstances, quantizeWideNodes<uint16_t>(blasWideNodes), tlasWideRoot);
+        break;
+    }
+    case 8: {
+        m_wideNodes8 = buffers::WideNodes(quantizeWideNodes<uint8_t>(tlasWideNodes), wideInstances, quantizeWideNodes<uint8_t>(blasWideNodes), tlasWideRoot);
+        break;
+    }
+    default: {
+        m_wideNodes = buffers::WideNodes(tlasWideNodes, wideInstances, blasWideNodes, tlasWideRoot);
+        break;
+    }
+    }
+}
+
+void PathTracer::collapseTlasWideNodes()
+{
+    std::vector<WideBvhNode<wideBvhWidth>> tlasWideNodes;
+    std::vector<kernals::Instance> wideInstances;
+    uint32_t tlasWideRoot = collapseTlas(m_bvh->getKernalBvh(), tlasWideNodes, wideInstances, m_blasWideSources, &m_tlasWideSources);
+    switch (m_quantizationBits) {
+    case 16: {
+        m_wideNodes16.setTlas(quantizeWideNodes<uint16_t>(tlasWideNodes), wideInstances, tlasWideRoot);
+        break;
+    }
+    case 8: {
+        m_wideNodes8.setTlas(quantizeWideNodes<uint8_t>(tlasWideNodes), wideInstances, tlasWideRoot);
+        break;
+    }
+    default: {
+        m_wideNodes.setTlas(tlasWideNodes, wideInstances, tlasWideRoot);
+        break;
+    }
+    }
+}
+
+void PathTracer::update()
+{
+    bool dirty = false;
+    Camera& camera = m_scene.getCamera();
+    State& state = m_scene.getState();
+
+    if (camera.getDirty()) {
+        dirty = true;
+    }
+
+    if (state.getDirty()) {
+        dirty = true;
+    }
+
+    if (dirty) {
+        state.resetIterations();
+    }
+
+    state.nextIteration();
+    m_constantParams = kernals::toKernalConstantParams(camera, state, m_textures.getCount());
+
+    camera.setDirty(false);
+    state.setDirty(false);
+}
+
+template <uint32_t Width>
+static void storeWideNode(const WideBvhNode<Width>& node, WideBvhNode<Width>& dst)
+{
+    dst = node;
+}
+
+template <uint32_t Width, typename T>
+static void storeWideNode(const WideBvhNode<Width>& node, QuantizedWideBvhNode<Width, T>& dst)
+{
+    dst = quantizeWideNode<T>(node);
+}
+
+template <typename Node>
+void PathTracer::refitWideNodes(buffers::WideNodes<Node>& wideNodes, const BvhUpdate& update)
+{
+    // a wide node is rebuilt from the binary nodes once, however many of them were refitted
+    auto refit = [](buffers::Array<Node>& nodes, const kernals::Array<kernals::BvhNode>& binaryNodes, const WideBvhSources& sources, const DirtyRanges& ranges) {
+        std::vector<uint32_t> wideIds;
+        for (const DirtyRanges::Range& r : ranges.get()) {
+            for (uint32_t i = r.first; i < r.first + r.count; i++) {
+                if (sources.wideNodeIds[i] != wideEmptyChild) {
+                    wideIds.push_back(sources.wideNodeIds[i]);
+                }
+            }
+        }
+        std::sort(wideIds.begin(), wideIds.end());
+        wideIds.erase(std::unique(wideIds.begin(), wideIds.end()), wideIds.end());
+
+        for (uint32_t wideId : wideIds) {
+            const uint32_t* childSources = &sources.childSources[wideId * Node::width];
+            storeWideNode(refitWideNode<Node::width>(binaryNodes, childSources, nodes[wideId].children), nodes[wideId]);
+        }
+    };
+    kernals::Bvh bvh = m_bvh->getKernalBvh();
+    refit(wideNodes.getTlasNodes(), bvh.tlasNodes, m_tlasWideSources, update.tlasNodes);
+    refit(wideNodes.getBlasNodes(), bvh.blasNodes, m_blasWideSources, update.blasNodes);
+
+    // wide instances differ from the binary ones only by their blas and group references
+    for (const DirtyRanges::Range& r : update.instances.get()) {
+        for (uint32_t i = r.first; i < r.first + r.count; i++) {
+            wideNodes.getInstances()[i].materialId = m_bvh->getInstances()[i].materialId;
+        }
+    }
+}
+
+void PathTracer::applyUpdates()
+{
+    if (!m_scene.getDirty()) {
+        return;
+    }
+
+    BvhUpdate update;
+    try {
+        update = m_bvh->applyUpdates(m_scene.getUpdates());
+    } catch (const std::runtime_error&) {
+        // detaches are checked before the bvh is changed, without them the next render succeeds
+        m_scene.cancelDetaches();
+        throw;
+    }
+    m_scene.clearUpdates();
+    // samples accumulated so far show the scene before the update
+    m_scene.getState().setDirty(true);
+
+    if (update.texturesResized) {
+        m_textures = buffers::Textures(m_bvh->getTextures());
+    }
+
+    // the binary buffers are read in place, only the wide nodes collapsed from them are rebuilt or refitted
+    if (update.compacted) {
+        collapseWideNodes();
+        return;
+    }
+
+    // unlinked tlas nodes change which binary nodes a wide node collapses
+    if (update.tlasChanged) {
+        collapseTlasWideNodes();
+    }
+
+    switch (m_quantizationBits) {
+    case 16: {
+        refitWideNodes(m_wideNodes16, update);
+        break;
+    }
+    case 8: {
+        refitWideNodes(m_wideNodes8, update);
+        break;
+    }
+    default: {
+        refitWideNodes(m_wideNodes, update);
+        break;
+    }
+    }
+}
+
+template <typename Node>
+kernals::KernalBuffers<kernals::HostTexture, WideBvh<Node>> PathTracer::getKernalBuffers(const buffers::WideNodes<Node>& wideNodes) const noexcept
+{
+    return {
+        .bvh = wideNodes.getKernalBvh(m_bvh->getKernalBvh()),
+        .materials = buffers::toKernalArray(m_bvh->getMaterials()),
+        .textures = m_textures.getKernalArray(),
+        .frameBuffer = m_targetBuffer.getBuffer().getKernalArray(),
+        .accumulationBuffer = m_targetBuffer.getAccumelationBuffer().getKernalArray(),
+        .rngSeedBuffer = m_targetBuffer.getRngStateBuffer().getKernalArray(),
+    };
+}
+
+template <typename KernalBuffers, typename Kernal>
+void PathTracer::launchKernal(Kernal kernal, KernalBuffers& kbuffs)
+{
+    // every task is a square tile of pixels, so neighbouring rays of one thread
+    // walk through the same bvh nodes and stay in cache
+    glm::uvec2 resolution = m_targetBuffer.resolution();
+    uint32_t tilesX = m_targetBuffer.tilesX();
+    m_threadPool.parallelFor(m_targetBuffer.tiles(), [&](size_t tile) {
+        uint32_t x0 = (uint32_t)(tile % tilesX) * buffers::tileSize;
+        uint32_t y0 = (uint32_t)(tile / tilesX) * buffers::tileSize;
+        uint32_t x1 = std::min(x0 + buffers::tileSize, resolution.x);
+        uint32_t y1 = std::min(y0 + buffers::tileSize, resolution.y);
+        for (uint32_t y = y0; y < y1; y++) {
+            for (uint32_t x = x0; x < x1; x++) {
+                kernal(m_constantParams, kbuffs, y * resolution.x + x);
+            }
+        }
+    });
+}
+
+template <typename Node>
+void PathTracer::render(const buffers::WideNodes<Node>& wideNodes)
+{
+    kernals::KernalBuffers<kernals::HostTexture, WideBvh<Node>> kbuffs = getKernalBuffers(wideNodes);
+    uint32_t iterations = m_scene.getState().getIterations();
+    for (size_t i = 0; i < iterations; i++) {
+        update();
+        launchKernal(kernals::pathTracing<kernals::HostTexture, WideBvh<Node>>, kbuffs);
+    }
+    launchKernal(kernals::postProcessing<kernals::HostTexture, WideBvh<Node>>, kbuffs);
+}
+
+Scene& PathTracer::getScene() noexcept
+{
+    return m_scene;
+}
+
+void PathTracer::getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize)
+{
+    auto src = m_targetBuffer.getBuffer().getKernalArray();
+    if (dst == nullptr || size == 0) {
+        if (retSize != nullptr) {
+            *retSize = src.sizeInBytes();
+        }
+        return;
+    }
+
+    std::memcpy(dst, src.ptr, std::min(size, src.sizeInBytes()));
+}
+
+void PathTracer::render()
+{
+    applyUpdates();
+    switch (m_quantizationBits) {
+    case 16: {
+        render(m_wideNodes16);
+        break;
+    }
+    case 8: {
+        render(m_wideNodes8);
+        break;
+    }
+    default: {
+        render(m_wideNodes);
+        break;
+    }
+    }
+}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "../Bvh.hpp"
+#include "../Renderer.hpp"
+#include "../Scene.hpp"
+#include "../ThreadPool.hpp"
+#include "WideBvh.hpp"
+#include "buffers.hpp"
+
+namespace ornament::cpu {
+class PathTracer : public IRenderer {
+public:
+    PathTracer(Scene scene, uint32_t threadsCount = 0);
+    PathTracer(const PathTracer&) = delete;
+    PathTracer& operator=(const PathTracer&) = delete;
+    Scene& getScene() noexcept override;
+    void getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize) override;
+    void render() override;
+    void applyUpdates() override;
+
+private:
+    ornament::Scene m_scene;
+    ThreadPool m_threadPool;
+    // kept to apply scene updates to, kernals read its buffers in place
+    std::unique_ptr<Bvh> m_bvh;
+    buffers::Target m_targetBuffer;
+    buffers::Textures m_textures;
+    kernals::ConstantParams m_constantParams;
+    // only the layout selected by BvhOptions::quantizationBits is filled
+    buffers::WideNodes<WideBvhNode<wideBvhWidth>> m_wideNodes;
+    buffers::WideNodes<QuantizedWideBvhNode<wideBvhWidth, uint16_t>> m_wideNodes16;
+    buffers::WideNodes<QuantizedWideBvhNode<wideBvhWidth, uint8_t>> m_wideNodes8;
+    WideBvhSources m_tlasWideSources;
+    WideBvhSources m_blasWideSources;
+    uint32_t m_quantizationBits;
+    void update();
+    void collapseWideNodes();
+    // recollapses the tlas and group trees after leafs were unlinked, blas wide nodes are kept
+    void collapseTlasWideNodes();
+    template <typename Node>
+    kernals::KernalBuffers<kernals::HostTexture, WideBvh<Node>> getKernalBuffers(const buffers::WideNodes<Node>& wideNodes) const noexcept;
+    template <typename KernalBuffers, typename Kernal>
+    void launchKernal(Kernal kernal, KernalBuffers& kbuffs);
+    template <typename Node>
+    void render(const buffers::WideNodes<Node>& wideNodes);
+    template <typename Node>
+    void refitWideNodes(buffers::WideNodes<Node>& wideNodes, const BvhUpdate& update);
+};
+}
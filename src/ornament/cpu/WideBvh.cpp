@@ -0,0 +1,308 @@
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "../math/Aabb.hpp"
+#include "WideBvh.hpp"
+
+namespace ornament::cpu {
+
+struct WideChild {
+    uint32_t nodeRef;
+    math::Aabb aabb;
+    // binary node id * 2, + 1 for a right child
+    uint32_t source;
+};
+
+static math::Aabb toAabb(const float3& min, const float3& max)
+{
+    return math::Aabb(glm::vec3(min.x, min.y, min.z), glm::vec3(max.x, max.y, max.z));
+}
+
+static bool isInternal(uint32_t nodeRef)
+{
+    return kernals::getNodeType(nodeRef) == kernals::InternalNodeType;
+}
+
+// Collapses the binary subtree of nodeRef into wide nodes in pre order and returns its reference.
+// Leafs of the binary tree are referenced through leafReference.
+template <uint32_t Width, typename LeafReference>
+static uint32_t collapseRecursive(const kernals::Array<kernals::BvhNode>& nodes,
+    uint32_t nodeRef,
+    std::vector<WideBvhNode<Width>>& wideNodes,
+    WideBvhSources* sources,
+    const LeafReference& leafReference)
+{
+    if (!isInternal(nodeRef)) {
+        return leafReference(nodeRef);
+    }
+
+    // open the internal child with the largest surface area until the node is full,
+    // children keep the left to right order of the binary tree
+    uint32_t wideId = (uint32_t)wideNodes.size();
+    uint32_t nodeId = kernals::getNodeId(nodeRef);
+    const kernals::BvhNode& node = nodes[nodeId];
+    std::vector<WideChild> children;
+    children.reserve(Width);
+    children.push_back({ node.leftNodeId, toAabb(node.leftAabbMin, node.leftAabbMax), nodeId * 2 });
+    children.push_back({ node.rightNodeId, toAabb(node.rightAabbMin, node.rightAabbMax), nodeId * 2 + 1 });
+    if (sources) {
+        sources->wideNodeIds[nodeId] = wideId;
+    }
+    while (children.size() < Width) {
+        int largest = -1;
+        float largestArea = -1.0f;
+        for (size_t i = 0; i < children.size(); i++) {
+            if (isInternal(children[i].nodeRef) && children[i].aabb.area() > largestArea) {
+                largest = (int)i;
+                largestArea = children[i].aabb.area();
+            }
+        }
+
+        if (largest == -1) {
+            break;
+        }
+
+        uint32_t openedId = kernals::getNodeId(children[largest].nodeRef);
+        const kernals::BvhNode& opened = nodes[openedId];
+        WideChild left = { opened.leftNodeId, toAabb(opened.leftAabbMin, opened.leftAabbMax), openedId * 2 };
+        WideChild right = { opened.rightNodeId, toAabb(opened.rightAabbMin, opened.rightAabbMax), openedId * 2 + 1 };
+        if (sources) {
+            sources->wideNodeIds[openedId] = wideId;
+        }
+        children[largest] = left;
+        children.insert(children.begin() + largest + 1, right);
+    }
+
+    wideNodes.emplace_back();
+    if (sources) {
+        sources->childSources.resize(wideNodes.size() * Width, wideEmptyChild);
+        for (size_t i = 0; i < children.size(); i++) {
+            sources->childSources[wideId * Width + i] = children[i].source;
+        }
+    }
+    uint32_t references[Width];
+    for (size_t i = 0; i < children.size(); i++) {
+        references[i] = collapseRecursive<Width>(nodes, children[i].nodeRef, wideNodes, sources, leafReference);
+    }
+
+    const float inf = std::numeric_limits<float>::infinity();
+    WideBvhNode<Width>& wideNode = wideNodes[wideId];
+    for (uint32_t i = 0; i < Width; i++) {
+        bool used = i < children.size();
+        glm::vec3 min = used ? children[i].aabb.min() : glm::vec3(inf);
+        glm::vec3 max = used ? children[i].aabb.max() : glm::vec3(-inf);
+        wideNode.minX[i] = min.x;
+        wideNode.minY[i] = min.y;
+        wideNode.minZ[i] = min.z;
+        wideNode.maxX[i] = max.x;
+        wideNode.maxY[i] = max.y;
+        wideNode.maxZ[i] = max.z;
+        wideNode.children[i] = used ? references[i] : wideEmptyChild;
+    }
+    return kernals::makeNodeRef(kernals::InternalNodeType, wideId);
+}
+
+// Collapses the binary tlas and group trees into the tlas wide nodes, blasReference gives the wide root of a blas.
+template <uint32_t Width, typename BlasReference>
+static uint32_t collapseInstanceTrees(const kernals::Bvh& bvh,
+    std::vector<WideBvhNode<Width>>& tlasWideNodes,
+    std::vector<kernals::Instance>& wideInstances,
+    WideBvhSources* tlasSources,
+    const BlasReference& blasReference)
+{
+    if (tlasSources) {
+        tlasSources->wideNodeIds.assign(bvh.tlasNodes.len, wideEmptyChild);
+        tlasSources->childSources.clear();
+    }
+
+    // group trees are collapsed into the tlas wide nodes when the first instance of a group is met,
+    // the leafs of a group tree can be instances of other groups
+    std::unordered_map<uint32_t, uint32_t> groupRoots;
+    wideInstances.assign(bvh.instances.ptr, bvh.instances.ptr + bvh.instances.len);
+    std::function<uint32_t(uint32_t)> tlasLeafReference = [&](uint32_t nodeRef) {
+        kernals::Instance& instance = wideInstances[kernals::getNodeId(nodeRef)];
+        switch (kernals::getNodeType(nodeRef)) {
+        case kernals::MeshType: {
+            instance.blasNodeId = blasReference(instance.blasNodeId);
+            break;
+        }
+        case kernals::GroupType: {
+            auto root = groupRoots.find(instance.blasNodeId);
+            if (root == groupRoots.end()) {
+                uint32_t wideRoot = collapseRecursive<Width>(bvh.tlasNodes, instance.blasNodeId, tlasWideNodes, tlasSources, tlasLeafReference);
+                root = groupRoots.emplace(instance.blasNodeId, wideRoot).first;
+            }
+            instance.blasNodeId = root->second;
+            break;
+        }
+        default: {
+            break;
+        }
+        }
+        return nodeRef;
+    };
+
+    return collapseRecursive<Width>(bvh.tlasNodes, bvh.tlasRootId, tlasWideNodes, tlasSources, tlasLeafReference);
+}
+
+template <uint32_t Width>
+uint32_t collapseBvh(const kernals::Bvh& bvh,
+    std::vector<WideBvhNode<Width>>& tlasWideNodes,
+    std::vector<kernals::Instance>& wideInstances,
+    std::vector<WideBvhNode<Width>>& blasWideNodes,
+    WideBvhSources* tlasSources,
+    WideBvhSources* blasSources)
+{
+    std::unordered_map<uint32_t, uint32_t> blasRoots;
+    if (blasSources) {
+        blasSources->wideNodeIds.assign(bvh.blasNodes.len, wideEmptyChild);
+        blasSources->childSources.clear();
+    }
+
+    auto blasLeafReference = [](uint32_t nodeRef) {
+        return nodeRef;
+    };
+    auto blasReference = [&](uint32_t blasNodeId) {
+        auto root = blasRoots.find(blasNodeId);
+        if (root == blasRoots.end()) {
+            root = blasRoots.emplace(blasNodeId, collapseRecursive<Width>(bvh.blasNodes, blasNodeId, blasWideNodes, blasSources, blasLeafReference)).first;
+        }
+        return root->second;
+    };
+
+    uint32_t tlasWideRoot = collapseInstanceTrees<Width>(bvh, tlasWideNodes, wideInstances, tlasSources, blasReference);
+    if (blasSources) {
+        blasSources->roots = std::move(blasRoots);
+    }
+    return tlasWideRoot;
+}
+
+template <uint32_t Width>
+uint32_t collapseTlas(const kernals::Bvh& bvh,
+    std::vector<WideBvhNode<Width>>& tlasWideNodes,
+    std::vector<kernals::Instance>& wideInstances,
+    const WideBvhSources& blasSources,
+    WideBvhSources* tlasSources)
+{
+    auto blasReference = [&](uint32_t blasNodeId) {
+        auto root = blasSources.roots.find(blasNodeId);
+        if (root == blasSources.roots.end()) {
+            throw std::runtime_error("[ornament] blas of an instance was not collapsed.");
+        }
+        return root->second;
+    };
+    return collapseInstanceTrees<Width>(bvh, tlasWideNodes, wideInstances, tlasSources, blasReference);
+}
+
+template <uint32_t Width>
+WideBvhNode<Width> refitWideNode(const kernals::Array<kernals::BvhNode>& nodes, const uint32_t* childSources, const uint32_t* children)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    WideBvhNode<Width> wideNode;
+    for (uint32_t i = 0; i < Width; i++) {
+        glm::vec3 min = glm::vec3(inf);
+        glm::vec3 max = glm::vec3(-inf);
+        if (childSources[i] != wideEmptyChild) {
+            const kernals::BvhNode& node = nodes[childSources[i] / 2];
+            bool right = childSources[i] % 2 == 1;
+            math::Aabb aabb = right ? toAabb(node.rightAabbMin, node.rightAabbMax) : toAabb(node.leftAabbMin, node.leftAabbMax);
+            min = aabb.min();
+            max = aabb.max();
+        }
+        wideNode.minX[i] = min.x;
+        wideNode.minY[i] = min.y;
+        wideNode.minZ[i] = min.z;
+        wideNode.maxX[i] = max.x;
+        wideNode.maxY[i] = max.y;
+        wideNode.maxZ[i] = max.z;
+        wideNode.children[i] = children[i];
+    }
+    return wideNode;
+}
+
+template <typename T, uint32_t Width>
+QuantizedWideBvhNode<Width, T> quantizeWideNode(const WideBvhNode<Width>& node)
+{
+    const float maxQ = (float)std::numeric_limits<T>::max();
+    QuantizedWideBvhNode<Width, T> qnode;
+    const float* mins[3] = { node.minX, node.minY, node.minZ };
+    const float* maxs[3] = { node.maxX, node.maxY, node.maxZ };
+    T* qmins[3] = { qnode.minX, qnode.minY, qnode.minZ };
+    T* qmaxs[3] = { qnode.maxX, qnode.maxY, qnode.maxZ };
+
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = std::numeric_limits<float>::infinity();
+        float hi = -std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < Width; i++) {
+            if (node.children[i] != wideEmptyChild) {
+                lo = std::min(lo, mins[axis][i]);
+                hi = std::max(hi, maxs[axis][i]);
+            }
+        }
+
+        // the last grid plane has to reach hi after rounding
+        float scale = (hi - lo) / maxQ;
+        while (scale > 0.0f && lo + maxQ * scale < hi) {
+            scale = std::nextafter(scale, std::numeric_limits<float>::infinity());
+        }
+        qnode.origin[axis] = lo;
+        qnode.scale[axis] = scale;
+
+        for (uint32_t i = 0; i < Width; i++) {
+            if (node.children[i] == wideEmptyChild) {
+                qmins[axis][i] = (T)maxQ;
+                qmaxs[axis][i] = 0;
+                continue;
+            }
+
+            float qmin = 0.0f;
+            float qmax = 0.0f;
+            if (scale > 0.0f) {
+                qmin = std::clamp(std::floor((mins[axis][i] - lo) / scale), 0.0f, maxQ);
+                qmax = std::clamp(std::ceil((maxs[axis][i] - lo) / scale), 0.0f, maxQ);
+                while (qmin > 0.0f && lo + qmin * scale > mins[axis][i]) {
+                    qmin--;
+                }
+                while (qmax < maxQ && lo + qmax * scale < maxs[axis][i]) {
+                    qmax++;
+                }
+            }
+            qmins[axis][i] = (T)qmin;
+            qmaxs[axis][i] = (T)qmax;
+        }
+    }
+
+    for (uint32_t i = 0; i < Width; i++) {
+        qnode.children[i] = node.children[i];
+    }
+    return qnode;
+}
+
+template <typename T, uint32_t Width>
+std::vector<QuantizedWideBvhNode<Width, T>> quantizeWideNodes(const std::vector<WideBvhNode<Width>>& nodes)
+{
+    std::vector<QuantizedWideBvhNode<Width, T>> quantizedNodes(nodes.size());
+    for (size_t n = 0; n < nodes.size(); n++) {
+        quantizedNodes[n] = quantizeWideNode<T>(nodes[n]);
+    }
+    return quantizedNodes;
+}
+
+template uint32_t collapseBvh<4>(const kernals::Bvh&, std::vector<WideBvhNode<4>>&, std::vector<kernals::Instance>&, std::vector<WideBvhNode<4>>&, WideBvhSources*, WideBvhSources*);
+template uint32_t collapseBvh<8>(const kernals::Bvh&, std::vector<WideBvhNode<8>>&, std::vector<kernals::Instance>&, std::vector<WideBvhNode<8>>&, WideBvhSources*, WideBvhSources*);
+template uint32_t collapseTlas<4>(const kernals::Bvh&, std::vector<WideBvhNode<4>>&, std::vector<kernals::Instance>&, const WideBvhSources&, WideBvhSources*);
+template uint32_t collapseTlas<8>(const kernals::Bvh&, std::vector<WideBvhNode<8>>&, std::vector<kernals::Instance>&, const WideBvhSources&, WideBvhSources*);
+template WideBvhNode<4> refitWideNode<4>(const kernals::Array<kernals::BvhNode>&, const uint32_t*, const uint32_t*);
+template WideBvhNode<8> refitWideNode<8>(const kernals::Array<kernals::BvhNode>&, const uint32_t*, const uint32_t*);
+template QuantizedWideBvhNode<4, uint8_t> quantizeWideNode<uint8_t, 4>(const WideBvhNode<4>&);
+template QuantizedWideBvhNode<4, uint16_t> quantizeWideNode<uint16_t, 4>(const WideBvhNode<4>&);
+template QuantizedWideBvhNode<8, uint8_t> quantizeWideNode<uint8_t, 8>(const WideBvhNode<8>&);
+template QuantizedWideBvhNode<8, uint16_t> quantizeWideNode<uint16_t, 8>(const WideBvhNode<8>&);
+template std::vector<QuantizedWideBvhNode<4, uint8_t>> quantizeWideNodes<uint8_t, 4>(const std::vector<WideBvhNode<4>>&);
+template std::vector<QuantizedWideBvhNode<4, uint16_t>> quantizeWideNodes<uint16_t, 4>(const std::vector<WideBvhNode<4>>&);
+template std::vector<QuantizedWideBvhNode<8, uint8_t>> quantizeWideNodes<uint8_t, 8>(const std::vector<WideBvhNode<8>>&);
+template std::vector<QuantizedWideBvhNode<8, uint16_t>> quantizeWideNodes<uint16_t, 8>(const std::vector<WideBvhNode<8>>&);
+
+}
@@ -0,0 +1,585 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <immintrin.h>
+#define ORNAMENT_SSE
+#endif
+
+#include "../hip/kernals/bvh.hip.hpp"
+
+namespace ornament::cpu {
+
+// avx tests 8 children in one instruction, otherwise sse tests 4
+#ifdef __AVX__
+const uint32_t wideBvhWidth = 8;
+#else
+const uint32_t wideBvhWidth = 4;
+#endif
+
+// child references of wide nodes are node references of the binary bvh,
+// except that the id of an internal one is a wide node id
+const uint32_t wideEmptyChild = 0xffffffff;
+
+// wide trees are no deeper than the binary ones they are collapsed from,
+// but every wide node on the path can leave all its children but one stacked,
+// about 9 KB of the thread stack for 8 wide nodes with the default limits
+const uint32_t wideBvhStackSize = kernals::maxInstanceLevels * ((wideBvhWidth - 1) * kernals::maxBvhDepth + 1)
+    + (wideBvhWidth - 1) * kernals::maxBvhDepth + 2;
+
+// Bounds of all children are stored as separate arrays per component,
+// so one simd slab test checks every child of the node. Unused slots
+// have inverted infinite bounds and never hit.
+template <uint32_t Width>
+struct alignas(32) WideBvhNode {
+    static const uint32_t width = Width;
+    float minX[Width];
+    float minY[Width];
+    float minZ[Width];
+    float maxX[Width];
+    float maxY[Width];
+    float maxZ[Width];
+    uint32_t children[Width];
+};
+
+// Child bounds stored as 8 or 16 bit integers on the grid of the node bounds,
+// a plane is decoded as origin + q * scale. Quantization rounds outwards,
+// so decoded child bounds always contain the exact ones.
+template <uint32_t Width, typename T>
+struct alignas(16) QuantizedWideBvhNode {
+    static const uint32_t width = Width;
+    float origin[3];
+    float scale[3];
+    T minX[Width];
+    T minY[Width];
+    T minZ[Width];
+    T maxX[Width];
+    T maxY[Width];
+    T maxZ[Width];
+    uint32_t children[Width];
+};
+
+// Binary bvh collapsed into wide nodes, leafs are still the instances and triangles of the binary bvh.
+// Instances are copied because their blas and group references point to the wide roots.
+template <typename Node>
+struct WideBvh : kernals::Bvh {
+    kernals::Array<Node> tlasWideNodes;
+    kernals::Array<kernals::Instance> wideInstances;
+    kernals::Array<Node> blasWideNodes;
+    uint32_t tlasWideRoot;
+};
+
+// Where child bounds of wide nodes were taken from, to refit the wide nodes after the binary ones.
+struct WideBvhSources {
+    // per binary node, the wide node its children went to, wideEmptyChild for nodes never collapsed
+    std::vector<uint32_t> wideNodeIds;
+    // per child slot of a wide node, the binary node id * 2, + 1 for a right child
+    std::vector<uint32_t> childSources;
+    // blas only, wide root reference per binary root id
+    std::unordered_map<uint32_t, uint32_t> roots;
+};
+
+// Collapses the binary tlas, group trees and blas of bvh, roots referenced by instances are collapsed once.
+// Returns the tlas root reference.
+template <uint32_t Width>
+uint32_t collapseBvh(const kernals::Bvh& bvh,
+    std::vector<WideBvhNode<Width>>& tlasWideNodes,
+    std::vector<kernals::Instance>& wideInstances,
+    std::vector<WideBvhNode<Width>>& blasWideNodes,
+    WideBvhSources* tlasSources = nullptr,
+    WideBvhSources* blasSources = nullptr);
+
+// Collapses only the binary tlas and group trees of bvh, instances reference the blas wide roots
+// of blasSources, filled by collapseBvh. Returns the tlas root reference.
+template <uint32_t Width>
+uint32_t collapseTlas(const kernals::Bvh& bvh,
+    std::vector<WideBvhNode<Width>>& tlasWideNodes,
+    std::vector<kernals::Instance>& wideInstances,
+    const WideBvhSources& blasSources,
+    WideBvhSources* tlasSources = nullptr);
+
+// Wide node with the given children and bounds copied from the refitted binary nodes.
+template <uint32_t Width>
+WideBvhNode<Width> refitWideNode(const kernals::Array<kernals::BvhNode>& nodes, const uint32_t* childSources, const uint32_t* children);
+
+template <typename T, uint32_t Width>
+QuantizedWideBvhNode<Width, T> quantizeWideNode(const WideBvhNode<Width>& node);
+
+template <typename T, uint32_t Width>
+std::vector<QuantizedWideBvhNode<Width, T>> quantizeWideNodes(const std::vector<WideBvhNode<Width>>& nodes);
+
+struct WideRay {
+    float3 invdir;
+    float3 oxinvdir;
+    // near planes of a slab are the min bounds if the direction is positive
+    bool positive[3];
+};
+
+INLINE WideRay makeWideRay(const kernals::Ray& ray)
+{
+    WideRay r;
+    r.invdir = kernals::safeInvdir(ray.direction);
+    r.oxinvdir = -ray.origin * r.invdir;
+    r.positive[0] = r.invdir.x >= 0.0f;
+    r.positive[1] = r.invdir.y >= 0.0f;
+    r.positive[2] = r.invdir.z >= 0.0f;
+    return r;
+}
+
+// slab test of all children, returns the mask of hit children
+// and writes the ray t where each of them is entered
+template <uint32_t Width>
+INLINE uint32_t wideNodeHit(const WideBvhNode<Width>& node, const WideRay& ray, float tmin, float tmax, float* entries)
+{
+    const float* nearX = ray.positive[0] ? node.minX : node.maxX;
+    const float* nearY = ray.positive[1] ? node.minY : node.maxY;
+    const float* nearZ = ray.positive[2] ? node.minZ : node.maxZ;
+    const float* farX = ray.positive[0] ? node.maxX : node.minX;
+    const float* farY = ray.positive[1] ? node.maxY : node.minY;
+    const float* farZ = ray.positive[2] ? node.maxZ : node.minZ;
+    uint32_t mask = 0;
+
+#if defined(__AVX__)
+    if constexpr (Width == 8) {
+        __m256 invX = _mm256_set1_ps(ray.invdir.x);
+        __m256 invY = _mm256_set1_ps(ray.invdir.y);
+        __m256 invZ = _mm256_set1_ps(ray.invdir.z);
+        __m256 oX = _mm256_set1_ps(ray.oxinvdir.x);
+        __m256 oY = _mm256_set1_ps(ray.oxinvdir.y);
+        __m256 oZ = _mm256_set1_ps(ray.oxinvdir.z);
+        __m256 t0 = _mm256_max_ps(
+            _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(nearX), invX), oX), _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(nearY), invY), oY)),
+            _mm256_max_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(nearZ), invZ), oZ), _mm256_set1_ps(tmin)));
+        __m256 t1 = _mm256_min_ps(
+            _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(farX), invX), oX), _mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(farY), invY), oY)),
+            _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_load_ps(farZ), invZ), oZ), _mm256_set1_ps(tmax)));
+        _mm256_storeu_ps(entries, t0);
+        return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    }
+#endif
+
+#ifdef ORNAMENT_SSE
+    __m128 invX = _mm_set1_ps(ray.invdir.x);
+    __m128 invY = _mm_set1_ps(ray.invdir.y);
+    __m128 invZ = _mm_set1_ps(ray.invdir.z);
+    __m128 oX = _mm_set1_ps(ray.oxinvdir.x);
+    __m128 oY = _mm_set1_ps(ray.oxinvdir.y);
+    __m128 oZ = _mm_set1_ps(ray.oxinvdir.z);
+    for (uint32_t i = 0; i < Width; i += 4) {
+        __m128 t0 = _mm_max_ps(
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(nearX + i), invX), oX), _mm_add_ps(_mm_mul_ps(_mm_load_ps(nearY + i), invY), oY)),
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(nearZ + i), invZ), oZ), _mm_set1_ps(tmin)));
+        __m128 t1 = _mm_min_ps(
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(farX + i), invX), oX), _mm_add_ps(_mm_mul_ps(_mm_load_ps(farY + i), invY), oY)),
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(farZ + i), invZ), oZ), _mm_set1_ps(tmax)));
+        _mm_storeu_ps(entries + i, t0);
+        mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+    }
+#else
+    for (uint32_t i = 0; i < Width; i++) {
+        float t0 = std::max(std::max(nearX[i] * ray.invdir.x + ray.oxinvdir.x, nearY[i] * ray.invdir.y + ray.oxinvdir.y), std::max(nearZ[i] * ray.invdir.z + ray.oxinvdir.z, tmin));
+        float t1 = std::min(std::min(farX[i] * ray.invdir.x + ray.oxinvdir.x, farY[i] * ray.invdir.y + ray.oxinvdir.y), std::min(farZ[i] * ray.invdir.z + ray.oxinvdir.z, tmax));
+        entries[i] = t0;
+        mask |= (uint32_t)(t0 <= t1) << i;
+    }
+#endif
+    return mask;
+}
+
+#ifdef ORNAMENT_SSE
+INLINE __m128 loadQuantized(const uint8_t* q)
+{
+    int32_t packed;
+    std::memcpy(&packed, q, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_cvtepi32_ps(v);
+}
+
+INLINE __m128 loadQuantized(const uint16_t* q)
+{
+    __m128i v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)q), _mm_setzero_si128());
+    return _mm_cvtepi32_ps(v);
+}
+#endif
+
+template <uint32_t Width, typename T>
+INLINE uint32_t wideNodeHit(const QuantizedWideBvhNode<Width, T>& node, const WideRay& ray, float tmin, float tmax, float* entries)
+{
+    // (origin + q * scale) * invdir + oxinvdir == q * a + b
+    float aX = node.scale[0] * ray.invdir.x;
+    float aY = node.scale[1] * ray.invdir.y;
+    float aZ = node.scale[2] * ray.invdir.z;
+    float bX = node.origin[0] * ray.invdir.x + ray.oxinvdir.x;
+    float bY = node.origin[1] * ray.invdir.y + ray.oxinvdir.y;
+    float bZ = node.origin[2] * ray.invdir.z + ray.oxinvdir.z;
+    const T* nearX = ray.positive[0] ? node.minX : node.maxX;
+    const T* nearY = ray.positive[1] ? node.minY : node.maxY;
+    const T* nearZ = ray.positive[2] ? node.minZ : node.maxZ;
+    const T* farX = ray.positive[0] ? node.maxX : node.minX;
+    const T* farY = ray.positive[1] ? node.maxY : node.minY;
+    const T* farZ = ray.positive[2] ? node.maxZ : node.minZ;
+    uint32_t mask = 0;
+
+#ifdef ORNAMENT_SSE
+    __m128 vaX = _mm_set1_ps(aX);
+    __m128 vaY = _mm_set1_ps(aY);
+    __m128 vaZ = _mm_set1_ps(aZ);
+    __m128 vbX = _mm_set1_ps(bX);
+    __m128 vbY = _mm_set1_ps(bY);
+    __m128 vbZ = _mm_set1_ps(bZ);
+    for (uint32_t i = 0; i < Width; i += 4) {
+        __m128 t0 = _mm_max_ps(
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(loadQuantized(nearX + i), vaX), vbX), _mm_add_ps(_mm_mul_ps(loadQuantized(nearY + i), vaY), vbY)),
+            _mm_max_ps(_mm_add_ps(_mm_mul_ps(loadQuantized(nearZ + i), vaZ), vbZ), _mm_set1_ps(tmin)));
+        __m128 t1 = _mm_min_ps(
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(loadQuantized(farX + i), vaX), vbX), _mm_add_ps(_mm_mul_ps(loadQuantized(farY + i), vaY), vbY)),
+            _mm_min_ps(_mm_add_ps(_mm_mul_ps(loadQuantized(farZ + i), vaZ), vbZ), _mm_set1_ps(tmax)));
+        _mm_storeu_ps(entries + i, t0);
+        mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+    }
+#else
+    for (uint32_t i = 0; i < Width; i++) {
+        float t0 = std::max(std::max(nearX[i] * aX + bX, nearY[i] * aY + bY), std::max(nearZ[i] * aZ + bZ, tmin));
+        float t1 = std::min(std::min(farX[i] * aX + bX, farY[i] * aY + bY), std::min(farZ[i] * aZ + bZ, tmax));
+        entries[i] = t0;
+        mask |= (uint32_t)(t0 <= t1) << i;
+    }
+#endif
+    return mask;
+}
+
+// same result as kernals::spherePacketHit, sse solves the quadratic of all spheres at once
+// and the closest root in range is picked lane by lane in the same order
+INLINE float spherePacketHit(const kernals::SpherePacket& packet, const kernals::Ray& ray, float tmin, float tmax, uint32_t* lane)
+{
+#ifdef ORNAMENT_SSE
+    static_assert(kernals::spherePacketWidth == 4, "sse tests 4 spheres");
+    __m128 ocX = _mm_sub_ps(_mm_set1_ps(ray.origin.x), _mm_loadu_ps(packet.centerX));
+    __m128 ocY = _mm_sub_ps(_mm_set1_ps(ray.origin.y), _mm_loadu_ps(packet.centerY));
+    __m128 ocZ = _mm_sub_ps(_mm_set1_ps(ray.origin.z), _mm_loadu_ps(packet.centerZ));
+    __m128 radius = _mm_loadu_ps(packet.radius);
+    __m128 a = _mm_set1_ps(length_squared(ray.direction));
+    __m128 halfB = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocX, _mm_set1_ps(ray.direction.x)), _mm_mul_ps(ocY, _mm_set1_ps(ray.direction.y))), _mm_mul_ps(ocZ, _mm_set1_ps(ray.direction.z)));
+    __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocX, ocX), _mm_mul_ps(ocY, ocY)), _mm_mul_ps(ocZ, ocZ)), _mm_mul_ps(radius, radius));
+    __m128 s = _mm_div_ps(halfB, a);
+    __m128 lX = _mm_sub_ps(ocX, _mm_mul_ps(s, _mm_set1_ps(ray.direction.x)));
+    __m128 lY = _mm_sub_ps(ocY, _mm_mul_ps(s, _mm_set1_ps(ray.direction.y)));
+    __m128 lZ = _mm_sub_ps(ocZ, _mm_mul_ps(s, _mm_set1_ps(ray.direction.z)));
+    __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lX, lX), _mm_mul_ps(lY, lY)), _mm_mul_ps(lZ, lZ));
+    __m128 discriminant = _mm_mul_ps(a, _mm_sub_ps(_mm_mul_ps(radius, radius), l2));
+    __m128 sqrtd = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+    // copysignf(sqrtd, halfB)
+    __m128 signedSqrtd = _mm_or_ps(sqrtd, _mm_and_ps(halfB, _mm_set1_ps(-0.0f)));
+    __m128 q = _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), halfB), signedSqrtd);
+    float t0[4];
+    float t1[4];
+    _mm_storeu_ps(t0, _mm_div_ps(c, q));
+    _mm_storeu_ps(t1, _mm_div_ps(q, a));
+    uint32_t hitMask = (uint32_t)_mm_movemask_ps(_mm_cmpge_ps(discriminant, _mm_setzero_ps()));
+
+    for (uint32_t i = 0; i < 4; i++) {
+        if (!(hitMask & (1u << i))) {
+            continue;
+        }
+
+        float nearT = std::min(t0[i], t1[i]);
+        float farT = std::max(t0[i], t1[i]);
+        float t = nearT;
+        if (t < tmin || tmax < t) {
+            t = farT;
+            if (t < tmin || tmax < t) {
+                continue;
+            }
+        }
+
+        if (t < tmax) {
+            tmax = t;
+            *lane = i;
+        }
+    }
+    return tmax;
+#else
+    return kernals::spherePacketHit(packet, ray, tmin, tmax, lane);
+#endif
+}
+
+// same result as kernals::bvhHit, picked for WideBvh buffers by the path tracing kernal
+template <typename Node>
+INLINE bool bvhHit(const WideBvh<Node>& bvh,
+    const kernals::Ray& notTransformedRay,
+    float rayCastEpsilon,
+    kernals::BvhHitResult* result)
+{
+    const uint32_t finishTraverseInstance = wideEmptyChild;
+    float tmin = rayCastEpsilon;
+    float tmax = std::numeric_limits<float>::max();
+
+    int stackTop = 0;
+    uint32_t nodeStack[wideBvhStackSize];
+    // ray t where the box of a stacked node is entered
+    float entryStack[wideBvhStackSize];
+    nodeStack[stackTop] = bvh.tlasWideRoot;
+    entryStack[stackTop] = tmin;
+    // the tlas and trees of groups are in tlas wide nodes
+    bool traverseTlas = true;
+    kernals::InstanceLevels levels;
+    levels.level = 0;
+    bool hitAnything = false;
+
+    kernals::Ray ray = notTransformedRay;
+    WideRay wideRay = makeWideRay(ray);
+    WideRay notTransformedWideRay = wideRay;
+    kernals::TriangleRay triangleRay;
+    uint32_t materialId = 0;
+    uint32_t transformId = 0;
+    while (stackTop >= 0) {
+        uint32_t addr = nodeStack[stackTop];
+        float entryT = entryStack[stackTop];
+        stackTop--;
+
+        if (addr == finishTraverseInstance) {
+            // a finished blas returns to the tree of its level, a finished group tree to the level above
+            if (traverseTlas) {
+                levels.level--;
+            }
+            traverseTlas = true;
+            ray = levels.getRay(notTransformedRay);
+            wideRay = levels.level == 0 ? notTransformedWideRay : makeWideRay(ray);
+            continue;
+        }
+
+        // entered beyond the closest hit found since it was pushed
+        if (entryT > tmax) {
+            continue;
+        }
+
+        uint32_t nodeId = kernals::getNodeId(addr);
+        switch (kernals::getNodeType(addr)) {
+        case kernals::InternalNodeType: {
+            const Node& node = traverseTlas ? bvh.tlasWideNodes[nodeId] : bvh.blasWideNodes[nodeId];
+            float entries[Node::width];
+            uint32_t mask = wideNodeHit(node, wideRay, tmin, tmax, entries);
+
+            // hit children are sorted from the farthest to the nearest one and pushed in that order,
+            // so the nearest is visited first, empty slots of quantized nodes may pass the slab test of a flat node
+            uint32_t hitChildren[Node::width];
+            float hitEntries[Node::width];
+            uint32_t hitCount = 0;
+            for (uint32_t i = 0; i < Node::width; i++) {
+                if ((mask & (1u << i)) && node.children[i] != wideEmptyChild) {
+                    uint32_t j = hitCount++;
+                    for (; j > 0 && hitEntries[j - 1] < entries[i]; j--) {
+                        hitChildren[j] = hitChildren[j - 1];
+                        hitEntries[j] = hitEntries[j - 1];
+                    }
+                    hitChildren[j] = node.children[i];
+                    hitEntries[j] = entries[i];
+                }
+            }
+
+            for (uint32_t i = 0; i < hitCount; i++) {
+                stackTop++;
+                nodeStack[stackTop] = hitChildren[i];
+                entryStack[stackTop] = hitEntries[i];
+            }
+            break;
+        }
+        case kernals::SphereType: {
+            const kernals::Instance& instance = bvh.wideInstances[nodeId];
+            float t = kernals::sphereHit(kernals::transformRay(bvh.transforms[instance.transformId], ray), tmin, tmax);
+            if (t < tmax) {
+                hitAnything = true;
+                tmax = t;
+                result->t = t;
+                result->materialId = instance.materialId;
+                result->nodeType = kernals::SphereType;
+                result->transform = levels.getInstanceTransform(bvh.transforms[instance.transformId]);
+            }
+            break;
+        }
+        case kernals::MeshType: {
+            const kernals::Instance& instance = bvh.wideInstances[nodeId];
+            traverseTlas = false;
+            stackTop++;
+            nodeStack[stackTop] = finishTraverseInstance;
+            entryStack[stackTop] = tmin;
+            stackTop++;
+            nodeStack[stackTop] = instance.blasNodeId;
+            entryStack[stackTop] = entryT;
+
+            transformId = instance.transformId;
+            materialId = instance.materialId;
+            ray = kernals::transformRay(bvh.transforms[transformId], ray);
+            wideRay = makeWideRay(ray);
+            triangleRay = kernals::makeTriangleRay(ray);
+            break;
+        }
+        case kernals::GroupType: {
+            const kernals::Instance& instance = bvh.wideInstances[nodeId];
+            stackTop++;
+            nodeStack[stackTop] = finishTraverseInstance;
+            entryStack[stackTop] = tmin;
+            stackTop++;
+            nodeStack[stackTop] = instance.blasNodeId;
+            entryStack[stackTop] = entryT;
+
+            levels.enter(bvh.transforms[instance.transformId]);
+            ray = levels.getRay(notTransformedRay);
+            wideRay = makeWideRay(ray);
+            break;
+        }
+        case kernals::TriangleType: {
+            for (uint32_t i = nodeId;; i++) {
+                const kernals::Triangle& triangle = bvh.triangles[i];
+                float2 uv;
+                float t = kernals::triangleHit(triangleRay, triangle, tmin, tmax, &uv);
+                if (t < tmax) {
+                    hitAnything = true;
+                    tmax = t;
+                    result->t = t;
+                    result->materialId = materialId;
+                    result->nodeType = kernals::MeshType;
+                    result->transform = levels.getInstanceTransform(bvh.transforms[transformId]);
+                    result->triangleId = triangle.triangleId & ~kernals::lastTriangleFlag;
+                    result->triangleBarycentricUV = uv;
+                }
+
+                if (triangle.triangleId & kernals::lastTriangleFlag) {
+                    break;
+                }
+            }
+            break;
+        }
+        case kernals::SpherePacketType: {
+            uint32_t lane;
+            float t = cpu::spherePacketHit(bvh.spherePackets[nodeId], ray, tmin, tmax, &lane);
+            if (t < tmax) {
+                hitAnything = true;
+                tmax = t;
+                result->t = t;
+                result->materialId = bvh.spherePackets[nodeId].materialIds[lane];
+                result->nodeType = kernals::SpherePacketType;
+                result->transform = levels.getInstanceTransform(bvh.transforms[transformId]);
+                result->triangleId = nodeId * kernals::spherePacketWidth + lane;
+            }
+            break;
+        }
+        }
+    }
+
+    return hitAnything;
+}
+
+// same result as kernals::bvhOccluded
+template <typename Node>
+INLINE bool bvhOccluded(const WideBvh<Node>& bvh,
+    const kernals::Ray& notTransformedRay,
+    float tmin,
+    float tmax)
+{
+    const uint32_t finishTraverseInstance = wideEmptyChild;
+    int stackTop = 0;
+    uint32_t nodeStack[wideBvhStackSize];
+    nodeStack[stackTop] = bvh.tlasWideRoot;
+    bool traverseTlas = true;
+    kernals::InstanceLevels levels;
+    levels.level = 0;
+
+    kernals::Ray ray = notTransformedRay;
+    WideRay wideRay = makeWideRay(ray);
+    WideRay notTransformedWideRay = wideRay;
+    kernals::TriangleRay triangleRay;
+    while (stackTop >= 0) {
+        uint32_t addr = nodeStack[stackTop];
+        stackTop--;
+
+        if (addr == finishTraverseInstance) {
+            if (traverseTlas) {
+                levels.level--;
+            }
+            traverseTlas = true;
+            ray = levels.getRay(notTransformedRay);
+            wideRay = levels.level == 0 ? notTransformedWideRay : makeWideRay(ray);
+            continue;
+        }
+
+        uint32_t nodeId = kernals::getNodeId(addr);
+        switch (kernals::getNodeType(addr)) {
+        case kernals::InternalNodeType: {
+            const Node& node = traverseTlas ? bvh.tlasWideNodes[nodeId] : bvh.blasWideNodes[nodeId];
+            float entries[Node::width];
+            uint32_t mask = wideNodeHit(node, wideRay, tmin, tmax, entries);
+            for (uint32_t i = 0; i < Node::width; i++) {
+                if ((mask & (1u << i)) && node.children[i] != wideEmptyChild) {
+                    stackTop++;
+                    nodeStack[stackTop] = node.children[i];
+                }
+            }
+            break;
+        }
+        case kernals::SphereType: {
+            kernals::Ray sphereRay = kernals::transformRay(bvh.transforms[bvh.wideInstances[nodeId].transformId], ray);
+            if (kernals::sphereHit(sphereRay, tmin, tmax) < tmax) {
+                return true;
+            }
+            break;
+        }
+        case kernals::MeshType: {
+            const kernals::Instance& instance = bvh.wideInstances[nodeId];
+            traverseTlas = false;
+            stackTop++;
+            nodeStack[stackTop] = finishTraverseInstance;
+            stackTop++;
+            nodeStack[stackTop] = instance.blasNodeId;
+
+            ray = kernals::transformRay(bvh.transforms[instance.transformId], ray);
+            wideRay = makeWideRay(ray);
+            triangleRay = kernals::makeTriangleRay(ray);
+            break;
+        }
+        case kernals::GroupType: {
+            const kernals::Instance& instance = bvh.wideInstances[nodeId];
+            stackTop++;
+            nodeStack[stackTop] = finishTraverseInstance;
+            stackTop++;
+            nodeStack[stackTop] = instance.blasNodeId;
+
+            levels.enter(bvh.transforms[instance.transformId]);
+            ray = levels.getRay(notTransformedRay);
+            wideRay = makeWideRay(ray);
+            break;
+        }
+        case kernals::TriangleType: {
+            for (uint32_t i = nodeId;; i++) {
+                float2 uv;
+                if (kernals::triangleHit(triangleRay, bvh.triangles[i], tmin, tmax, &uv) < tmax) {
+                    return true;
+                }
+
+                if (bvh.triangles[i].triangleId & kernals::lastTriangleFlag) {
+                    break;
+                }
+            }
+            break;
+        }
+        case kernals::SpherePacketType: {
+            uint32_t lane;
+            if (cpu::spherePacketHit(bvh.spherePackets[nodeId], ray, tmin, tmax, &lane) < tmax) {
+                return true;
+            }
+            break;
+        }
+        }
+    }
+
+    return false;
+}
+
+}
@@ -0,0 +1,236 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "../Scene.hpp"
+#include "../hip/kernals/global_structs.hip.hpp"
+#include "WideBvh.hpp"
+
+namespace ornament::cpu::buffers {
+
+template <typename T>
+class Array {
+public:
+    Array() = default;
+    Array(size_t length)
+        : m_data(length)
+    {
+    }
+
+    Array(const std::vector<T>& hostArray)
+        : m_data(hostArray)
+    {
+    }
+
+    Array(Array&& other) = default;
+    Array& operator=(Array&& other) = default;
+
+    kernals::Array<T> getKernalArray() const noexcept
+    {
+        return { .ptr = (T*)m_data.data(), .len = (uint32_t)m_data.size() };
+    }
+
+    T& operator[](size_t i) noexcept
+    {
+        return m_data[i];
+    }
+
+    Array(const Array&) = delete;
+    Array& operator=(const Array&) = delete;
+
+private:
+    std::vector<T> m_data;
+};
+
+// host buffers are read by the kernals in place, the array is valid until hostArray is resized
+template <typename T>
+kernals::Array<T> toKernalArray(const std::vector<T>& hostArray) noexcept
+{
+    return { .ptr = (T*)hostArray.data(), .len = (uint32_t)hostArray.size() };
+}
+
+const uint32_t tileSize = 16;
+
+static std::vector<uint32_t> rngSeed(int size)
+{
+    uint32_t n = 0;
+    std::vector<uint32_t> v(size);
+    std::generate(v.begin(), v.end(), [&n] { return n++; });
+    return v;
+}
+
+class Target {
+public:
+    Target() = default;
+    Target(const glm::uvec2& resolution)
+        : m_resolution(resolution)
+        , m_pixelCount(resolution.x * resolution.y)
+    {
+        m_buffer = Array<float4>(m_pixelCount);
+        m_accumulationBuffer = Array<float4>(m_pixelCount);
+        m_rngStateBuffer = Array(rngSeed(m_pixelCount));
+
+        m_tilesX = (m_resolution.x + tileSize - 1) / tileSize;
+        m_tilesY = (m_resolution.y + tileSize - 1) / tileSize;
+    }
+
+    Target(Target&& other) = default;
+    Target& operator=(Target&& other) = default;
+
+    uint32_t pixelCount() const noexcept
+    {
+        return m_pixelCount;
+    }
+
+    glm::uvec2 resolution() const noexcept
+    {
+        return m_resolution;
+    }
+
+    uint32_t tiles() const noexcept
+    {
+        return m_tilesX * m_tilesY;
+    }
+
+    uint32_t tilesX() const noexcept
+    {
+        return m_tilesX;
+    }
+
+    const Array<uint32_t>& getRngStateBuffer() const noexcept
+    {
+        return m_rngStateBuffer;
+    }
+
+    const Array<float4>& getAccumelationBuffer() const noexcept
+    {
+        return m_accumulationBuffer;
+    }
+
+    const Array<float4>& getBuffer() const noexcept
+    {
+        return m_buffer;
+    }
+
+    Target(const Target&) = delete;
+    Target& operator=(const Target&) = delete;
+
+private:
+    Array<float4> m_buffer;
+    Array<float4> m_accumulationBuffer;
+    Array<uint32_t> m_rngStateBuffer;
+    glm::uvec2 m_resolution;
+    uint32_t m_pixelCount = 0;
+    uint32_t m_tilesX = 0;
+    uint32_t m_tilesY = 0;
+};
+
+class Textures {
+public:
+    Textures() = default;
+    Textures(const std::vector<Texture*>& textures)
+    {
+        std::vector<kernals::HostTexture> hostTextures;
+        hostTextures.reserve(textures.size());
+        for (auto txt : textures) {
+            hostTextures.push_back({
+                .data = txt->data.data(),
+                .width = txt->width,
+                .height = txt->height,
+                .numComponents = txt->numComponents,
+                .bytesPerComponent = txt->bytesPerComponent,
+                .bytesPerRow = txt->bytesPerRow,
+                .isHdr = txt->isHdr ? 1u : 0u,
+            });
+        }
+
+        m_textures = Array(hostTextures);
+        m_count = (uint32_t)hostTextures.size();
+    }
+
+    Textures(Textures&& other) = default;
+    Textures& operator=(Textures&& other) = default;
+
+    kernals::Array<kernals::HostTexture> getKernalArray() const noexcept
+    {
+        return m_textures.getKernalArray();
+    }
+
+    uint32_t getCount() const noexcept
+    {
+        return m_count;
+    }
+
+    Textures(const Textures&) = delete;
+    Textures& operator=(const Textures&) = delete;
+
+private:
+    // texels are not copied, they stay owned by the scene textures
+    Array<kernals::HostTexture> m_textures;
+    uint32_t m_count = 0;
+};
+
+template <typename Node>
+class WideNodes {
+public:
+    WideNodes() = default;
+    WideNodes(const std::vector<Node>& tlasNodes,
+        const std::vector<kernals::Instance>& instances,
+        const std::vector<Node>& blasNodes,
+        uint32_t tlasRoot)
+        : m_tlasNodes(tlasNodes)
+        , m_instances(instances)
+        , m_blasNodes(blasNodes)
+        , m_tlasRoot(tlasRoot)
+    {
+    }
+
+    WideNodes(WideNodes&& other) = default;
+    WideNodes& operator=(WideNodes&& other) = default;
+
+    WideBvh<Node> getKernalBvh(const kernals::Bvh& bvh) const noexcept
+    {
+        WideBvh<Node> wideBvh;
+        static_cast<kernals::Bvh&>(wideBvh) = bvh;
+        wideBvh.tlasWideNodes = m_tlasNodes.getKernalArray();
+        wideBvh.wideInstances = m_instances.getKernalArray();
+        wideBvh.blasWideNodes = m_blasNodes.getKernalArray();
+        wideBvh.tlasWideRoot = m_tlasRoot;
+        return wideBvh;
+    }
+
+    // replaces the tlas and group levels, the blas nodes are kept
+    void setTlas(const std::vector<Node>& tlasNodes, const std::vector<kernals::Instance>& instances, uint32_t tlasRoot)
+    {
+        m_tlasNodes = Array(tlasNodes);
+        m_instances = Array(instances);
+        m_tlasRoot = tlasRoot;
+    }
+
+    Array<Node>& getTlasNodes() noexcept
+    {
+        return m_tlasNodes;
+    }
+
+    Array<kernals::Instance>& getInstances() noexcept
+    {
+        return m_instances;
+    }
+
+    Array<Node>& getBlasNodes() noexcept
+    {
+        return m_blasNodes;
+    }
+
+    WideNodes(const WideNodes&) = delete;
+    WideNodes& operator=(const WideNodes&) = delete;
+
+private:
+    Array<Node> m_tlasNodes;
+    Array<kernals::Instance> m_instances;
+    Array<Node> m_blasNodes;
+    uint32_t m_tlasRoot = 0;
+};
+
+}
@@ -1,5 +1,6 @@
 #include <filesystem>
 #include <hip/hip_runtime.h>
+#include <stdexcept>
 
 #include "Bvh.hpp"
 #include "PathTracer.hpp"
@@ -10,9 +11,8 @@
 namespace ornament::hip {
 PathTracer::PathTracer(Scene scene, const char* kernalsDirPath)
     : m_scene(std::move(scene))
+    , m_bvh(m_scene)
 {
-    Bvh bvh(m_scene);
-
     int deviceCount = 0;
     checkHipErrors(hipGetDeviceCount(&deviceCount));
     hipDeviceProp_t prop;
@@ -41,16 +41,26 @@ PathTracer::PathTracer(Scene scene, const char* kernalsDirPath)
 
     uint2 resolution = {m_scene.getState().getResolution().x, m_scene.getState().getResolution().y};
     m_targetBuffer = buffers::Target(resolution);
-    m_textures = buffers::Textures(bvh.getTextures(), prop.texturePitchAlignment);
+    m_textures = buffers::Textures(m_bvh.getTextures(), prop.texturePitchAlignment);
     m_constantParams = buffers::Global<kernals::ConstantParams>("constantParams", m_module);
-    m_materials = buffers::Array(bvh.getMaterials());
-    m_normals = buffers::Array(bvh.getNormals());
-    m_normalIndices = buffers::Array(bvh.getNormalIndices());
-    m_uvs = buffers::Array(bvh.getUvs());
-    m_uvIndices = buffers::Array(bvh.getUvIndices());
-    m_transforms = buffers::Array(bvh.getTransforms());
-    m_tlasNodes = buffers::Array(bvh.getTlasNodes());
-    m_blasNodes = buffers::Array(bvh.getBlasNodes());
+    uploadBvh();
+}
+
+void PathTracer::uploadBvh()
+{
+    m_materials = buffers::Array(m_bvh.getMaterials());
+    m_normals = buffers::Array(m_bvh.getNormals());
+    m_normalIndices = buffers::Array(m_bvh.getNormalIndices());
+    m_uvs = buffers::Array(m_bvh.getUvs());
+    m_uvIndices = buffers::Array(m_bvh.getUvIndices());
+    m_shadingRecords = buffers::Array(m_bvh.getShadingRecords());
+    m_transforms = buffers::Array(m_bvh.getTransforms());
+    m_tlasNodes = buffers::Array(m_bvh.getTlasNodes());
+    m_instances = buffers::Array(m_bvh.getInstances());
+    m_tlasRootId = m_bvh.getTlasRootId();
+    m_blasNodes = buffers::Array(m_bvh.getBlasNodes());
+    m_triangles = buffers::Array(m_bvh.getTriangles());
+    m_spherePackets = buffers::Array(m_bvh.getSpherePackets());
 }
 
 PathTracer::~PathTracer()
@@ -85,22 +95,81 @@ void PathTracer::update()
     state.setDirty(false);
 }
 
+void PathTracer::applyUpdates()
+{
+    if (!m_scene.getDirty()) {
+        return;
+    }
+
+    BvhUpdate update;
+    try {
+        update = m_bvh.applyUpdates(m_scene.getUpdates());
+    } catch (const std::runtime_error&) {
+        // detaches are checked before the bvh is changed, without them the next render succeeds
+        m_scene.cancelDetaches();
+        throw;
+    }
+    m_scene.clearUpdates();
+    // samples accumulated so far show the scene before the update
+    m_scene.getState().setDirty(true);
+
+    // uploaded textures are kept, a compaction does not move them
+    if (update.texturesResized) {
+        m_textures.append(m_bvh.getTextures());
+    }
+
+    // the compacted buffers are smaller, the old device buffers are released
+    if (update.compacted) {
+        uploadBvh();
+        return;
+    }
+
+    // one copy per range, a refit writes few nodes far apart
+    auto upload = [](auto& buffer, const auto& hostArray, const DirtyRanges& ranges) {
+        for (const DirtyRanges::Range& r : ranges.get()) {
+            buffer.update(hostArray, r.first, r.count);
+        }
+    };
+    if (update.materialsResized) {
+        m_materials = buffers::Array(m_bvh.getMaterials());
+    } else {
+        upload(m_materials, m_bvh.getMaterials(), update.materials);
+    }
+    upload(m_normals, m_bvh.getNormals(), update.normals);
+    upload(m_normalIndices, m_bvh.getNormalIndices(), update.normalIndices);
+    upload(m_uvs, m_bvh.getUvs(), update.uvs);
+    upload(m_uvIndices, m_bvh.getUvIndices(), update.uvIndices);
+    upload(m_shadingRecords, m_bvh.getShadingRecords(), update.shadingRecords);
+    upload(m_transforms, m_bvh.getTransforms(), update.transforms);
+    upload(m_tlasNodes, m_bvh.getTlasNodes(), update.tlasNodes);
+    upload(m_instances, m_bvh.getInstances(), update.instances);
+    upload(m_blasNodes, m_bvh.getBlasNodes(), update.blasNodes);
+    upload(m_triangles, m_bvh.getTriangles(), update.triangles);
+    upload(m_spherePackets, m_bvh.getSpherePackets(), update.spherePackets);
+    m_tlasRootId = m_bvh.getTlasRootId();
+}
+
 void PathTracer::launchKernal(hipFunction_t kernal)
 {
     struct KernalArgs {
-        kernals::KernalBuffers kbuffs;
+        kernals::KernalBuffers<hipTextureObject_t> kbuffs;
     };
 
     KernalArgs args = {
         .kbuffs = {
             .bvh = {
                 .tlasNodes = m_tlasNodes.getHipArray(),
+                .instances = m_instances.getHipArray(),
                 .blasNodes = m_blasNodes.getHipArray(),
+                .triangles = m_triangles.getHipArray(),
+                .spherePackets = m_spherePackets.getHipArray(),
                 .normals = m_normals.getHipArray(),
                 .normalIndices = m_normalIndices.getHipArray(),
                 .uvs = m_uvs.getHipArray(),
                 .uvIndices = m_uvIndices.getHipArray(),
+                .shadingRecords = m_shadingRecords.getHipArray(),
                 .transforms = m_transforms.getHipArray(),
+                .tlasRootId = m_tlasRootId,
             },
             .materials = m_materials.getHipArray(),
             .textures = m_textures.getHipArray(),
@@ -157,6 +226,7 @@ void PathTracer::getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize)
 
 void PathTracer::render()
 {
+    applyUpdates();
     uint32_t iterations = m_scene.getState().getIterations();
     for (size_t i = 0; i < iterations; i++) {
         update();
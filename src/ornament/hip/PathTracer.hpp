@@ -2,22 +2,27 @@
 
 #include <hip/hip_runtime.h>
 
+#include "../Bvh.hpp"
+#include "../Renderer.hpp"
 #include "../Scene.hpp"
 #include "buffers.hpp"
 
 namespace ornament::hip {
-class PathTracer {
+class PathTracer : public IRenderer {
 public:
     PathTracer(Scene scene, const char* kernalsDirPath);
     PathTracer(const PathTracer&) = delete;
     PathTracer& operator=(const PathTracer&) = delete;
-    ~PathTracer();
-    Scene& getScene() noexcept;
-    void getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize);
-    void render();
+    ~PathTracer() override;
+    Scene& getScene() noexcept override;
+    void getFrameBuffer(uint8_t* dst, size_t size, size_t* retSize) override;
+    void render() override;
+    void applyUpdates() override;
 
 private:
     ornament::Scene m_scene;
+    // kept to apply scene updates to
+    Bvh m_bvh;
     hipModule_t m_module;
     hipFunction_t m_pathTracingKernal;
     hipFunction_t m_postProcessingKernal;
@@ -29,10 +34,17 @@ private:
     buffers::Array<uint32_t> m_normalIndices;
     buffers::Array<float2> m_uvs;
     buffers::Array<uint32_t> m_uvIndices;
-    buffers::Array<float4x4> m_transforms;
+    buffers::Array<kernals::ShadingRecord> m_shadingRecords;
+    buffers::Array<float3x4> m_transforms;
     buffers::Array<kernals::BvhNode> m_tlasNodes;
+    buffers::Array<kernals::Instance> m_instances;
+    uint32_t m_tlasRootId;
     buffers::Array<kernals::BvhNode> m_blasNodes;
+    buffers::Array<kernals::Triangle> m_triangles;
+    buffers::Array<kernals::SpherePacket> m_spherePackets;
     void update();
+    // copies all bvh buffers, at creation and after a compaction
+    void uploadBvh();
     void launchKernal(hipFunction_t kernal);
 };
 }
\ No newline at end of file
@@ -61,6 +61,16 @@ public:
         return { .ptr = (T*)m_dptr, .len = m_length };
     }
 
+    // copies count elements from first on of hostArray over the same elements
+    void update(const std::vector<T>& hostArray, size_t first, size_t count)
+    {
+        checkHipErrors(hipMemcpy(
+            (uint8_t*)m_dptr + first * sizeof(T),
+            hostArray.data() + first,
+            count * sizeof(T),
+            hipMemcpyHostToDevice));
+    }
+
     Array(const Array&) = delete;
     Array& operator=(const Array&) = delete;
 
@@ -185,15 +195,27 @@ class Textures {
 public:
     Textures() = default;
     Textures(const std::vector<Texture*>& textures, size_t pitchAlignment)
+        : m_pitchAlignment(pitchAlignment)
+    {
+        append(textures);
+    }
+
+    Textures(Textures&& other) = default;
+    Textures& operator=(Textures&& other) = default;
+
+    // uploads the textures past the ones already uploaded, textures is the full list
+    void append(const std::vector<Texture*>& textures)
     {
+        size_t first = m_textureObjects.size();
         m_textureObjects.reserve(textures.size());
         m_textureData.reserve(textures.size());
 
-        for (auto txt : textures) {
+        for (size_t i = first; i < textures.size(); i++) {
+            const Texture* txt = textures[i];
             hipArray_Format format = txt->isHdr ? HIP_AD_FORMAT_FLOAT : HIP_AD_FORMAT_UNSIGNED_INT8;
             HIPfilter_mode filterMode = HIP_TR_FILTER_MODE_POINT;
             size_t srcPitch = txt->bytesPerRow;
-            size_t dstPitch = alignUp(srcPitch, pitchAlignment);
+            size_t dstPitch = alignUp(srcPitch, m_pitchAlignment);
 
             hipDeviceptr_t dptr;
             checkHipErrors(hipMalloc(&dptr, dstPitch * txt->height));
@@ -236,9 +258,6 @@ public:
         m_deviceTextureObjects = Array(m_textureObjects);
     }
 
-    Textures(Textures&& other) = default;
-    Textures& operator=(Textures&& other) = default;
-
     kernals::Array<hipTextureObject_t> getHipArray() const noexcept
     {
         return m_deviceTextureObjects.getHipArray();
@@ -267,6 +286,7 @@ private:
     std::vector<hipTextureObject_t> m_textureObjects;
     std::vector<hipDeviceptr_t> m_textureData;
     Array<hipTextureObject_t> m_deviceTextureObjects;
+    size_t m_pitchAlignment = 0;
 
     static size_t alignUp(size_t offset, size_t alignment)
     {
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
+#include "common.hip.hpp"
 #include "global_structs.hip.hpp"
 #include "ray.hip.hpp"
 #include "vec_math.hip.hpp"
@@ -9,18 +9,18 @@
 namespace ornament {
 namespace kernals {
 
-HOST_DEVICE float3 safeInvdir(float3 d) 
+HOST_DEVICE INLINE float3 safeInvdir(float3 d) 
 {
     #define MYCOPYSIGN(a, b) b < 0.0f ? -a : a
     const float eps = 1e-5f;
-    float x = abs(d.x) > eps ? d.x : MYCOPYSIGN(eps, d.x);
-    float y = abs(d.y) > eps ? d.y : MYCOPYSIGN(eps, d.y);
-    float z = abs(d.z) > eps ? d.z : MYCOPYSIGN(eps, d.z);
+    float x = fabsf(d.x) > eps ? d.x : MYCOPYSIGN(eps, d.x);
+    float y = fabsf(d.y) > eps ? d.y : MYCOPYSIGN(eps, d.y);
+    float z = fabsf(d.z) > eps ? d.z : MYCOPYSIGN(eps, d.z);
 
     return make_float3(1.0f / x, 1.0f / y, 1.0f / z);
 }
 
-HOST_DEVICE float2 aabbHit(
+HOST_DEVICE INLINE float2 aabbHit(
     const float3& aabbMin, 
     const float3& aabbMax,
     const float3& invdir,
@@ -37,68 +37,128 @@ HOST_DEVICE float2 aabbHit(
     return make_float2(t0, t1);
 }
 
-HOST_DEVICE float triangleHit(
-    const Ray& r, 
+// Ray set up for the watertight triangle test of Woop, Benthin and Wald. The test shears
+// the ray to point along z from the origin and checks triangles in 2d with edge functions.
+// Edges shared by triangles are evaluated from the same vertices in the same way,
+// so rays can not slip between neighbouring triangles.
+struct TriangleRay {
+    float3 origin;
+    int kx;
+    int ky;
+    int kz;
+    float sx;
+    float sy;
+    float sz;
+};
+
+HOST_DEVICE INLINE float getComponent(const float3& v, int i)
+{
+    return i == 0 ? v.x : (i == 1 ? v.y : v.z);
+}
+
+HOST_DEVICE INLINE TriangleRay makeTriangleRay(const Ray& r)
+{
+    TriangleRay triangleRay;
+    triangleRay.origin = r.origin;
+
+    // z is the dominant axis of the direction, x and y are swapped for a negative one
+    // to keep the winding of triangles
+    float3 d = make_float3(fabsf(r.direction.x), fabsf(r.direction.y), fabsf(r.direction.z));
+    triangleRay.kz = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+    triangleRay.kx = triangleRay.kz == 2 ? 0 : triangleRay.kz + 1;
+    triangleRay.ky = triangleRay.kx == 2 ? 0 : triangleRay.kx + 1;
+    float dz = getComponent(r.direction, triangleRay.kz);
+    if (dz < 0.0f)
+    {
+        int kx = triangleRay.kx;
+        triangleRay.kx = triangleRay.ky;
+        triangleRay.ky = kx;
+    }
+
+    triangleRay.sx = getComponent(r.direction, triangleRay.kx) / dz;
+    triangleRay.sy = getComponent(r.direction, triangleRay.ky) / dz;
+    triangleRay.sz = 1.0f / dz;
+    return triangleRay;
+}
+
+HOST_DEVICE INLINE float triangleHit(
+    const TriangleRay& r, 
     const Triangle& triangle,
     float tmin,
     float tmax,
     float2* uv) 
 {
-    float3 e1 = triangle.v1 - triangle.v0;
-    float3 e2 = triangle.v2 - triangle.v0;
-
-    float3 s1 = cross(r.direction, e2);
-    float determinant = dot(s1, e1);
-    float invd = 1.0f / determinant;
+    float3 a = triangle.v0 - r.origin;
+    float3 b = triangle.v1 - r.origin;
+    float3 c = triangle.v2 - r.origin;
 
-    float3 d = r.origin - triangle.v0;
-    float u = dot(d, s1) * invd;
+    float az = getComponent(a, r.kz);
+    float bz = getComponent(b, r.kz);
+    float cz = getComponent(c, r.kz);
+    float ax = getComponent(a, r.kx) - r.sx * az;
+    float ay = getComponent(a, r.ky) - r.sy * az;
+    float bx = getComponent(b, r.kx) - r.sx * bz;
+    float by = getComponent(b, r.ky) - r.sy * bz;
+    float cx = getComponent(c, r.kx) - r.sx * cz;
+    float cy = getComponent(c, r.ky) - r.sy * cz;
 
-    // Barycentric coordinate U is outside range
-    if (u < 0.0f || u > 1.0f) 
+    // edge functions, the ray misses when they differ in sign,
+    // both windings are hit
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f)) 
     {
         return tmax;
     }
 
-    float3 s2 = cross(d, e1);
-    float v = dot(r.direction, s2) * invd;
-
-    // Barycentric coordinate V is outside range
-    if (v < 0.0f || u + v > 1.0f) 
+    float determinant = u + v + w;
+    if (determinant == 0.0f) 
     {
         return tmax;
     }
 
-    // t
-    float t = dot(e2, s2) * invd;
+    float invd = 1.0f / determinant;
+    float t = (u * az + v * bz + w * cz) * r.sz * invd;
     if (t < tmin || t > tmax) 
     {
         return tmax;
     } 
     else
     {
-        *uv = make_float2(u, v);
+        // barycentric coordinates of v1 and v2
+        *uv = make_float2(v * invd, w * invd);
         return t;
     }
 }
 
-HOST_DEVICE float sphereHit(const Ray& ray, float tmin, float tmax)
+HOST_DEVICE INLINE float sphereHit(const Ray& ray, const float3& center, float radius, float tmin, float tmax)
 {
-    #define SPHERE_CENTER make_float3(0.0f)
-    #define SPHERE_RADIUS 1.0f
-
-    float3 oc = ray.origin - SPHERE_CENTER;
+    float3 oc = ray.origin - center;
     float a = length_squared(ray.direction);
     float halfB = dot(oc, ray.direction);
-    float c = length_squared(oc) - SPHERE_RADIUS * SPHERE_RADIUS;
-    float discriminant = halfB * halfB - a * c;
+    float c = length_squared(oc) - radius * radius;
+    // from the distance of the center to the ray line, halfB * halfB - a * c cancels out
+    // for small spheres far from the ray origin
+    float3 l = oc - (halfB / a) * ray.direction;
+    float discriminant = a * (radius * radius - length_squared(l));
     if (discriminant < 0.0f) { return tmax; }
-    float sqrtd = sqrtf(discriminant);
 
-    float t = (-halfB - sqrtd) / a;
+    // roots without subtracting close values, c / q is the near one when the sphere is ahead
+    float q = -halfB - copysignf(sqrtf(discriminant), halfB);
+    float t0 = c / q;
+    float t1 = q / a;
+    if (t1 < t0)
+    {
+        float t = t0;
+        t0 = t1;
+        t1 = t;
+    }
+
+    float t = t0;
     if (t < tmin || tmax < t)
     {
-        t = (-halfB + sqrtd) / a;
+        t = t1;
         if (t < tmin || tmax < t)
         {
             return tmax;
@@ -108,30 +168,87 @@ HOST_DEVICE float sphereHit(const Ray& ray, float tmin, float tmax)
     return t;
 }
 
+// unit sphere in the space of a sphere instance
+HOST_DEVICE INLINE float sphereHit(const Ray& ray, float tmin, float tmax)
+{
+    return sphereHit(ray, make_float3(0.0f), 1.0f, tmin, tmax);
+}
+
+// Closest of the spheres of a packet, the ray is in the space of the sphere set.
+// Lanes are independent, so the loop maps onto simd lanes or gpu registers.
+HOST_DEVICE INLINE float spherePacketHit(const SpherePacket& packet, const Ray& ray, float tmin, float tmax, uint32_t* lane)
+{
+    for (uint32_t i = 0; i < spherePacketWidth; i++)
+    {
+        float3 center = make_float3(packet.centerX[i], packet.centerY[i], packet.centerZ[i]);
+        float t = sphereHit(ray, center, packet.radius[i], tmin, tmax);
+        if (t < tmax)
+        {
+            tmax = t;
+            *lane = i;
+        }
+    }
+    return tmax;
+}
+
 struct BvhHitResult {
     float t;
     uint32_t materialId;
     BvhNodeType nodeType;
-    uint32_t invertedTransformId;
+    // world to object space transform of the hit sphere or mesh, group instances on the way included
+    float3x4 transform;
+    // global id of the hit triangle, for a sphere of a sphere set
+    // the packet id times spherePacketWidth plus the lane
     uint32_t triangleId;
     float2 triangleBarycentricUV;
 };
 
-HOST_DEVICE bool bvhHit(const Bvh& bvh,
+// Group instances entered by a traversal. The tlas is level 0 in world space,
+// transforms[level] maps world space to the space of a deeper level.
+struct InstanceLevels {
+    uint32_t level;
+    float3x4 transforms[maxInstanceLevels];
+
+    // world to object space transform of an instance met at the current level
+    HOST_DEVICE INLINE float3x4 getInstanceTransform(const float3x4& transform) const
+    {
+        return level == 0 ? transform : combineTransforms(transform, transforms[level]);
+    }
+
+    HOST_DEVICE INLINE void enter(const float3x4& transform)
+    {
+        transforms[level + 1] = getInstanceTransform(transform);
+        level++;
+    }
+
+    // ray in the space of the current level
+    HOST_DEVICE INLINE Ray getRay(const Ray& worldRay) const
+    {
+        return level == 0 ? worldRay : transformRay(transforms[level], worldRay);
+    }
+};
+
+HOST_DEVICE INLINE bool bvhHit(const Bvh& bvh,
     const Ray& notTransformedRay,
     float rayCastEpsilon,
     BvhHitResult* result)
 {
-    #define FINISH_TRAVERSE_BLAS 0xffffffff
+    #define FINISH_TRAVERSE_INSTANCE 0xffffffff
     float tmin = rayCastEpsilon;
     float tmax = 3.40282e+38;
 
     int stackTop = 0;
-    // here push top of tlas tree to the stack
-    uint32_t addr = bvh.tlasNodes.len - 1;
-    uint32_t nodeStack[64];
+    // stacked are node references, the bottom of the stack is the tlas root
+    uint32_t addr = bvh.tlasRootId;
+    uint32_t nodeStack[bvhStackSize];
+    // ray t where the box of a stacked node is entered
+    float entryStack[bvhStackSize];
     nodeStack[stackTop] = addr;
+    entryStack[stackTop] = tmin;
+    // the tlas and trees of groups are in tlas nodes
     bool traverseTlas = true;
+    InstanceLevels levels;
+    levels.level = 0;
 
     bool hitAnything = false;
 
@@ -141,36 +258,61 @@ HOST_DEVICE bool bvhHit(const Bvh& bvh,
 
     float3 notTransformedInvdir = invdir;
     float3 notTransformedOxinvdir = oxinvdir;
+    // triangles are only tested in blas, it is set up when one is entered
+    TriangleRay triangleRay;
     uint32_t materialId;
-    uint32_t invertedTransformId;
+    uint32_t transformId;
     while (stackTop >= 0)
     {
-        BvhNode node = traverseTlas ? bvh.tlasNodes[addr] : bvh.blasNodes[addr];
-        switch (node.type)
+        uint32_t nodeId = getNodeId(addr);
+        switch (getNodeType(addr))
         {
             case InternalNodeType: 
             {
-                float2 left = aabbHit(node.internalNode.leftAabbMin, node.internalNode.leftAabbMax, invdir, oxinvdir, tmin, tmax);
-                float2 right = aabbHit(node.internalNode.rightAabbMin, node.internalNode.rightAabbMax, invdir, oxinvdir, tmin, tmax);
-                
-                if (left.x <= left.y) 
+                BvhNode node = traverseTlas ? bvh.tlasNodes[nodeId] : bvh.blasNodes[nodeId];
+                float2 left = aabbHit(node.leftAabbMin, node.leftAabbMax, invdir, oxinvdir, tmin, tmax);
+                float2 right = aabbHit(node.rightAabbMin, node.rightAabbMax, invdir, oxinvdir, tmin, tmax);
+                bool leftHit = left.x <= left.y;
+                bool rightHit = right.x <= right.y;
+
+                // the nearer child is pushed last and visited first,
+                // so hits in it shrink tmax before the farther one is popped
+                uint32_t nearNodeId = node.leftNodeId;
+                uint32_t farNodeId = node.rightNodeId;
+                float2 nearT = left;
+                float2 farT = right;
+                bool nearHit = leftHit;
+                bool farHit = rightHit;
+                if (right.x < left.x)
+                {
+                    nearNodeId = node.rightNodeId;
+                    farNodeId = node.leftNodeId;
+                    nearT = right;
+                    farT = left;
+                    nearHit = rightHit;
+                    farHit = leftHit;
+                }
+
+                if (farHit) 
                 {
                     stackTop++;
-                    nodeStack[stackTop] = node.internalNode.leftNodeId;
+                    nodeStack[stackTop] = farNodeId;
+                    entryStack[stackTop] = farT.x;
                 }
 
-                if (right.x <= right.y) 
+                if (nearHit) 
                 {
                     stackTop++;
-                    nodeStack[stackTop] = node.internalNode.rightNodeId;
+                    nodeStack[stackTop] = nearNodeId;
+                    entryStack[stackTop] = nearT.x;
                 }
                 break;
             }
             case SphereType: 
             {
-                invertedTransformId = node.sphereNode.transformId * 2;
+                Instance instance = bvh.instances[nodeId];
                 float t = sphereHit(
-                    transformRay(bvh.transforms[invertedTransformId], ray), 
+                    transformRay(bvh.transforms[instance.transformId], ray), 
                     tmin, 
                     tmax);
                 if (t < tmax) 
@@ -178,73 +320,290 @@ HOST_DEVICE bool bvhHit(const Bvh& bvh,
                     hitAnything = true;
                     tmax = t;
                     result->t = t;
-                    result->materialId = node.sphereNode.materialId;
+                    result->materialId = instance.materialId;
                     result->nodeType = SphereType;
-                    result->invertedTransformId = invertedTransformId;
+                    result->transform = levels.getInstanceTransform(bvh.transforms[instance.transformId]);
                 }
                 break;
             }
             case MeshType: 
             {
+                Instance instance = bvh.instances[nodeId];
+
                 // push signal to restore transformation after finshing mesh bvh
                 traverseTlas = false;
                 stackTop++;
-                nodeStack[stackTop] = FINISH_TRAVERSE_BLAS;
+                nodeStack[stackTop] = FINISH_TRAVERSE_INSTANCE;
+                entryStack[stackTop] = tmin;
 
                 // push mesh bvh
                 stackTop++;
-                nodeStack[stackTop] = node.meshNode.blasNodeId;
+                nodeStack[stackTop] = instance.blasNodeId;
+                entryStack[stackTop] = tmin;
 
-                invertedTransformId = node.meshNode.transformId * 2;
-                materialId = node.meshNode.materialId;
-                ray = transformRay(bvh.transforms[invertedTransformId], ray);
+                transformId = instance.transformId;
+                materialId = instance.materialId;
+                ray = transformRay(bvh.transforms[transformId], ray);
+                invdir = safeInvdir(ray.direction);
+                oxinvdir = -ray.origin * invdir;
+                triangleRay = makeTriangleRay(ray);
+                break;
+            }
+            case GroupType: 
+            {
+                Instance instance = bvh.instances[nodeId];
+
+                // the tree of the group is traversed one level deeper, in the space of the group
+                stackTop++;
+                nodeStack[stackTop] = FINISH_TRAVERSE_INSTANCE;
+                entryStack[stackTop] = tmin;
+
+                stackTop++;
+                nodeStack[stackTop] = instance.blasNodeId;
+                entryStack[stackTop] = tmin;
+
+                levels.enter(bvh.transforms[instance.transformId]);
+                ray = levels.getRay(notTransformedRay);
                 invdir = safeInvdir(ray.direction);
                 oxinvdir = -ray.origin * invdir;
                 break;
             }
             case TriangleType: 
             {
-                float2 uv;
-                float t = triangleHit(
-                    ray, 
-                    node.triangleNode,
-                    tmin, 
-                    tmax,
-                    &uv
-                );
+                for (uint32_t i = nodeId; ; i++)
+                {
+                    const Triangle& triangle = bvh.triangles[i];
+                    float2 uv;
+                    float t = triangleHit(
+                        triangleRay, 
+                        triangle,
+                        tmin, 
+                        tmax,
+                        &uv
+                    );
+
+                    if (t < tmax)
+                    {
+                        hitAnything = true;
+                        tmax = t;
+                        result->t = t;
+                        result->materialId = materialId;
+                        result->nodeType = MeshType;
+                        result->transform = levels.getInstanceTransform(bvh.transforms[transformId]);
+                        result->triangleId = triangle.triangleId & ~lastTriangleFlag;
+                        result->triangleBarycentricUV = uv;
+                    }
 
+                    if (triangle.triangleId & lastTriangleFlag)
+                    {
+                        break;
+                    }
+                }
+                break;
+            }
+            case SpherePacketType: 
+            {
+                uint32_t lane;
+                float t = spherePacketHit(bvh.spherePackets[nodeId], ray, tmin, tmax, &lane);
                 if (t < tmax)
                 {
                     hitAnything = true;
                     tmax = t;
                     result->t = t;
-                    result->materialId = materialId;
-                    result->nodeType = MeshType;
-                    result->invertedTransformId = invertedTransformId;
-                    result->triangleId = node.triangleNode.triangleId * 3;
-                    result->triangleBarycentricUV = uv;
+                    result->materialId = bvh.spherePackets[nodeId].materialIds[lane];
+                    result->nodeType = SpherePacketType;
+                    result->transform = levels.getInstanceTransform(bvh.transforms[transformId]);
+                    result->triangleId = nodeId * spherePacketWidth + lane;
+                }
+                break;
+            }
+            default: { break; }
+        }
+
+        // nodes entered beyond the closest hit found since they were pushed are dropped,
+        // the bottom of the stack is the root which ends the traversal when popped
+        while (stackTop >= 0)
+        {
+            addr = nodeStack[stackTop];
+            float entryT = entryStack[stackTop];
+            stackTop--;
+
+            if (addr == FINISH_TRAVERSE_INSTANCE)
+            {
+                // a finished blas returns to the tree of its level, a finished group tree to the level above
+                if (traverseTlas)
+                {
+                    levels.level--;
+                }
+                traverseTlas = true;
+                if (levels.level == 0)
+                {
+                    ray = notTransformedRay;
+                    invdir = notTransformedInvdir;
+                    oxinvdir = notTransformedOxinvdir;
+                }
+                else
+                {
+                    ray = levels.getRay(notTransformedRay);
+                    invdir = safeInvdir(ray.direction);
+                    oxinvdir = -ray.origin * invdir;
+                }
+                continue;
+            }
+
+            if (entryT <= tmax)
+            {
+                break;
+            }
+        }
+    }
+
+    return hitAnything;
+}
+
+// Any hit query for shadow and visibility rays, returns true as soon as anything is hit
+// between tmin and tmax. Children are not ordered and no hit attributes are recorded.
+HOST_DEVICE INLINE bool bvhOccluded(const Bvh& bvh,
+    const Ray& notTransformedRay,
+    float tmin,
+    float tmax)
+{
+    #define FINISH_TRAVERSE_INSTANCE 0xffffffff
+    int stackTop = 0;
+    // the tlas root is the bottom of the stack
+    uint32_t addr = bvh.tlasRootId;
+    uint32_t nodeStack[bvhStackSize];
+    nodeStack[stackTop] = addr;
+    bool traverseTlas = true;
+    InstanceLevels levels;
+    levels.level = 0;
+
+    Ray ray = notTransformedRay;
+    float3 invdir = safeInvdir(ray.direction);
+    float3 oxinvdir = -ray.origin * invdir;
+
+    float3 notTransformedInvdir = invdir;
+    float3 notTransformedOxinvdir = oxinvdir;
+    TriangleRay triangleRay;
+    while (stackTop >= 0)
+    {
+        uint32_t nodeId = getNodeId(addr);
+        switch (getNodeType(addr))
+        {
+            case InternalNodeType: 
+            {
+                BvhNode node = traverseTlas ? bvh.tlasNodes[nodeId] : bvh.blasNodes[nodeId];
+                float2 left = aabbHit(node.leftAabbMin, node.leftAabbMax, invdir, oxinvdir, tmin, tmax);
+                float2 right = aabbHit(node.rightAabbMin, node.rightAabbMax, invdir, oxinvdir, tmin, tmax);
+                if (left.x <= left.y) 
+                {
+                    stackTop++;
+                    nodeStack[stackTop] = node.leftNodeId;
+                }
+
+                if (right.x <= right.y) 
+                {
+                    stackTop++;
+                    nodeStack[stackTop] = node.rightNodeId;
+                }
+                break;
+            }
+            case SphereType: 
+            {
+                Ray sphereRay = transformRay(bvh.transforms[bvh.instances[nodeId].transformId], ray);
+                if (sphereHit(sphereRay, tmin, tmax) < tmax) 
+                {
+                    return true;
+                }
+                break;
+            }
+            case MeshType: 
+            {
+                Instance instance = bvh.instances[nodeId];
+                traverseTlas = false;
+                stackTop++;
+                nodeStack[stackTop] = FINISH_TRAVERSE_INSTANCE;
+                stackTop++;
+                nodeStack[stackTop] = instance.blasNodeId;
+
+                ray = transformRay(bvh.transforms[instance.transformId], ray);
+                invdir = safeInvdir(ray.direction);
+                oxinvdir = -ray.origin * invdir;
+                triangleRay = makeTriangleRay(ray);
+                break;
+            }
+            case GroupType: 
+            {
+                Instance instance = bvh.instances[nodeId];
+                stackTop++;
+                nodeStack[stackTop] = FINISH_TRAVERSE_INSTANCE;
+                stackTop++;
+                nodeStack[stackTop] = instance.blasNodeId;
+
+                levels.enter(bvh.transforms[instance.transformId]);
+                ray = levels.getRay(notTransformedRay);
+                invdir = safeInvdir(ray.direction);
+                oxinvdir = -ray.origin * invdir;
+                break;
+            }
+            case TriangleType: 
+            {
+                for (uint32_t i = nodeId; ; i++)
+                {
+                    float2 uv;
+                    if (triangleHit(triangleRay, bvh.triangles[i], tmin, tmax, &uv) < tmax)
+                    {
+                        return true;
+                    }
+
+                    if (bvh.triangles[i].triangleId & lastTriangleFlag)
+                    {
+                        break;
+                    }
+                }
+                break;
+            }
+            case SpherePacketType: 
+            {
+                uint32_t lane;
+                if (spherePacketHit(bvh.spherePackets[nodeId], ray, tmin, tmax, &lane) < tmax)
+                {
+                    return true;
                 }
                 break;
             }
             default: { break; }
         }
 
+        // finished blas and group trees are left until a node is popped
         addr = nodeStack[stackTop];
         stackTop--;
-
-        if (addr == FINISH_TRAVERSE_BLAS)
+        while (addr == FINISH_TRAVERSE_INSTANCE)
         {
+            if (traverseTlas)
+            {
+                levels.level--;
+            }
             traverseTlas = true;
-            ray = notTransformedRay;
-            invdir = notTransformedInvdir;
-            oxinvdir = notTransformedOxinvdir;
+            if (levels.level == 0)
+            {
+                ray = notTransformedRay;
+                invdir = notTransformedInvdir;
+                oxinvdir = notTransformedOxinvdir;
+            }
+            else
+            {
+                ray = levels.getRay(notTransformedRay);
+                invdir = safeInvdir(ray.direction);
+                oxinvdir = -ray.origin * invdir;
+            }
             addr = nodeStack[stackTop];
             stackTop--;
         }
     }
 
-    return hitAnything;
+    return false;
 }
 
 }
-}
\ No newline at end of file
+}
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
+#include "common.hip.hpp"
 #include "global_structs.hip.hpp"
 #include "ray.hip.hpp"
 #include "random.hip.hpp"
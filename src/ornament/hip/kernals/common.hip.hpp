@@ -4,6 +4,16 @@
 #define __KERNELCC__
 #endif
 
+#if defined( __KERNELCC__ )
+#include <hip/hip_runtime.h>
+#include <hip/hip_math_constants.h>
+#else
+#include <cstdint>
+#ifndef HIP_PI_F
+#define HIP_PI_F 3.14159265358979323846f
+#endif
+#endif
+
 #if !defined( __KERNELCC__ )
 #define HOST
 #define DEVICE
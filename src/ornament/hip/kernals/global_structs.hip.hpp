@@ -1,6 +1,6 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
+#include "common.hip.hpp"
 #include "vec_math.hip.hpp"
 
 namespace ornament {
@@ -63,65 +63,132 @@ enum BvhNodeType : uint32_t
 {
     InternalNodeType = 0,
     SphereType = 1,
+    // instance of a blas, of a mesh or of a sphere set
     MeshType = 2,
     TriangleType = 3,
+    // instance of a group, the tree of the group is in the tlas nodes
+    GroupType = 4,
+    // blas leaf of a sphere set, a single packet of spheres
+    SpherePacketType = 5,
 };
 
+// Child references of internal nodes keep the type of the child in the top three bits.
+// The rest is the id of an internal node, of an instance or of the first triangle of a blas leaf.
+HOST_DEVICE INLINE uint32_t makeNodeRef(BvhNodeType type, uint32_t id)
+{
+    return ((uint32_t)type << 29) | id;
+}
+
+HOST_DEVICE INLINE BvhNodeType getNodeType(uint32_t nodeRef)
+{
+    return (BvhNodeType)(nodeRef >> 29);
+}
+
+HOST_DEVICE INLINE uint32_t getNodeId(uint32_t nodeRef)
+{
+    return nodeRef & 0x1fffffff;
+}
+
+#ifndef ORNAMENT_MAX_INSTANCE_LEVELS
+#define ORNAMENT_MAX_INSTANCE_LEVELS 4
+#endif
+
+// instance levels a traversal can enter, the tlas is the first one and every nested
+// group instance adds one, the bvh build rejects groups nested deeper
+const uint32_t maxInstanceLevels = ORNAMENT_MAX_INSTANCE_LEVELS;
+
+#ifndef ORNAMENT_MAX_BVH_DEPTH
+#define ORNAMENT_MAX_BVH_DEPTH 32
+#endif
+
+// internal nodes on a path from the root of the tlas, of a group tree or of a blas to a leaf,
+// the bvh build splits at the median once a subtree would get deeper
+const uint32_t maxBvhDepth = ORNAMENT_MAX_BVH_DEPTH;
+
+// A traversal keeps the far child of every internal node on its path and a marker per entered
+// instance, the tree it enters last pushes both children of its deepest node. The root is the bottom.
+// This is the worst case, 166 entries or about 1.3 KB of scratch per thread with the defaults,
+// traversals of scenes with thousands of shapes stay around 20. Lower the two limits above
+// to save scratch memory, the build never makes a tree the stack cannot hold.
+const uint32_t bvhStackSize = maxInstanceLevels * (maxBvhDepth + 1) + maxBvhDepth + 2;
+
+// set in Triangle::triangleId of the last triangle of a blas leaf
+const uint32_t lastTriangleFlag = 0x80000000;
+
+// spheres in a blas leaf of a sphere set
+const uint32_t spherePacketWidth = 4;
+
 #pragma pack(push, 1)
-struct InternalNode 
+// internal node of the tlas or of a blas, leafs are not nodes of their own
+struct BvhNode 
 {
     float3 leftAabbMin;
     uint32_t leftNodeId;
     float3 leftAabbMax;
     uint32_t rightNodeId;
     float3 rightAabbMin;
-    uint32_t _padding;
+    uint32_t _padding0;
     float3 rightAabbMax;
+    uint32_t _padding1;
 };
 
-struct Sphere
-{
-    uint32_t materialId;
-    uint32_t transformId;
-};
-
-struct Mesh
+// sphere, mesh, sphere set or group leaf of the tlas or of a group tree
+struct Instance
 {
     uint32_t materialId;
     uint32_t transformId;
+    // reference to the blas root of a mesh or a sphere set or to the tree root of a group
     uint32_t blasNodeId;
 };
 
+// triangles of a blas leaf follow each other up to the one with lastTriangleFlag
 struct Triangle
 {
     float3 v0;
-    uint32_t triangleId;
     float3 v1;
-    uint32_t _padding;
     float3 v2;
+    uint32_t triangleId;
 };
-#pragma pack(pop)
 
-struct BvhNode
+// shading attributes of one triangle in 24 bytes, normals are octahedral encoded
+// and uvs are pairs of half floats, see packing.hip.hpp
+struct ShadingRecord
 {
-    union {
-        InternalNode internalNode;
-        Sphere sphereNode;
-        Mesh meshNode;
-        Triangle triangleNode;
-    };
-    BvhNodeType type;
+    uint32_t normals[3];
+    uint32_t uvs[3];
 };
 
+// Spheres of a sphere set blas leaf, every component in an array of its own so all of them
+// are tested at once. Centers are in the space of the set. A leaf of fewer spheres repeats
+// its last one in the unused lanes.
+struct SpherePacket
+{
+    float centerX[spherePacketWidth];
+    float centerY[spherePacketWidth];
+    float centerZ[spherePacketWidth];
+    float radius[spherePacketWidth];
+    uint32_t materialIds[spherePacketWidth];
+};
+#pragma pack(pop)
+
 struct Bvh
 {
+    // trees of groups followed by the tlas
     Array<BvhNode> tlasNodes;
+    Array<Instance> instances;
     Array<BvhNode> blasNodes;
+    Array<Triangle> triangles;
+    Array<SpherePacket> spherePackets;
     Array<float4> normals;
     Array<uint32_t> normalIndices;
     Array<float2> uvs;
     Array<uint32_t> uvIndices;
-    Array<float4x4> transforms;
+    // one per triangle when shading attributes are packed, normals and uvs are empty then
+    Array<ShadingRecord> shadingRecords;
+    // inverse of the transform of every sphere, mesh, mesh instance, sphere set and group instance
+    Array<float3x4> transforms;
+    // the root is a leaf when the scene has a single object
+    uint32_t tlasRootId;
 };
 
 enum MaterialType : uint32_t
@@ -170,11 +237,24 @@ struct Material
     uint32_t _padding[2];
 };
 
+// host side replacement of hipTextureObject_t, used by the cpu path tracer
+struct HostTexture
+{
+    const uint8_t* data;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numComponents;
+    uint32_t bytesPerComponent;
+    uint32_t bytesPerRow;
+    uint32_t isHdr;
+};
+
+template <typename TextureObject, typename BvhType = Bvh>
 struct KernalBuffers
 {
-    Bvh bvh;
+    BvhType bvh;
     Array<Material> materials;
-    Array<hipTextureObject_t> textures;
+    Array<TextureObject> textures;
     Array<float4> frameBuffer;
     Array<float4> accumulationBuffer;
     Array<uint32_t> rngSeedBuffer;
@@ -1,23 +1,24 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
 #include "common.hip.hpp"
 #include "random.hip.hpp"
 #include "ray.hip.hpp"
 #include "hitrecord.hip.hpp"
+#include "texture.hip.hpp"
 
 namespace ornament {
 namespace kernals {
 
 #define EPS 1E-8f
-#define NEAR_ZERO(e) abs(e.x) < EPS && abs(e.y) < EPS && abs(e.z) < EPS
+#define NEAR_ZERO(e) fabsf(e.x) < EPS && fabsf(e.y) < EPS && fabsf(e.z) < EPS
 
-HOST_DEVICE INLINE  float3 getColor(const Array<hipTextureObject_t>& textures, 
+template <typename TextureObject>
+HOST_DEVICE INLINE  float3 getColor(const Array<TextureObject>& textures, 
     const float3& color, 
     uint32_t textureId, 
     const float2& uv)
 {
-    return textureId < textures.len ? make_float3(tex2D<float4>(textures[textureId], uv.x, uv.y)) : color;
+    return textureId < textures.len ? make_float3(textureSample(textures[textureId], uv)) : color;
 }
 
 HOST_DEVICE INLINE float reflectance(float cosine, float refIdx)
@@ -28,11 +29,12 @@ HOST_DEVICE INLINE float reflectance(float cosine, float refIdx)
     return r0 + (1.0f - r0) * pow((1.0f - cosine), 5.0f);
 }
 
-HOST_DEVICE bool scatter(const Lambertian& lambertian,
+template <typename TextureObject>
+HOST_DEVICE INLINE bool scatter(const Lambertian& lambertian,
     const Ray& r,
     const HitRecord& hit,
     RndGen& rnd,
-    const Array<hipTextureObject_t>& textures,
+    const Array<TextureObject>& textures,
     float3* attenuation,
     Ray* scattered)
 {
@@ -49,11 +51,12 @@ HOST_DEVICE bool scatter(const Lambertian& lambertian,
     return true;
 }
 
-HOST_DEVICE bool scatter(const Metal& metal, 
+template <typename TextureObject>
+HOST_DEVICE INLINE bool scatter(const Metal& metal, 
     const Ray& r, 
     const HitRecord& hit, 
     RndGen& rnd,
-    const Array<hipTextureObject_t>& textures,
+    const Array<TextureObject>& textures,
     float3* attenuation,
     Ray* scattered)
 {
@@ -63,7 +66,7 @@ HOST_DEVICE bool scatter(const Metal& metal,
     return true;
 }
 
-HOST_DEVICE bool scatter(const Dielectric& dielectric,
+HOST_DEVICE INLINE bool scatter(const Dielectric& dielectric,
     const Ray& r,
     const HitRecord& hit,
     RndGen& rnd,
@@ -89,11 +92,12 @@ HOST_DEVICE bool scatter(const Dielectric& dielectric,
     return true;
 }
 
-HOST_DEVICE bool materialScatter(const Material& material,
+template <typename TextureObject>
+HOST_DEVICE INLINE bool materialScatter(const Material& material,
     const Ray& r,
     const HitRecord& hit,
     RndGen& rnd,
-    const Array<hipTextureObject_t>& textures,
+    const Array<TextureObject>& textures,
     float3* attenuation,
     Ray* scattered)
 {
@@ -106,9 +110,10 @@ HOST_DEVICE bool materialScatter(const Material& material,
     }
 }
 
-HOST_DEVICE float3 materialEmit(const Material& material,
+template <typename TextureObject>
+HOST_DEVICE INLINE float3 materialEmit(const Material& material,
     const HitRecord& hit,
-    const Array<hipTextureObject_t>& textures)
+    const Array<TextureObject>& textures)
 {
     switch(material.type) 
     {
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "common.hip.hpp"
+#include "vec_math.hip.hpp"
+
+namespace ornament {
+namespace kernals {
+
+// Encoders run on the host when shading records are built, decoders in the kernals.
+// Both are plain arithmetic, so they give the same results on the cpu and on the gpu.
+
+HOST_DEVICE INLINE uint32_t encodeSnorm16(float value)
+{
+    float clamped = fminf(fmaxf(value, -1.0f), 1.0f);
+    return (uint32_t)(int32_t)rintf(clamped * 32767.0f) & 0xffff;
+}
+
+HOST_DEVICE INLINE float decodeSnorm16(uint32_t bits)
+{
+    return fmaxf((float)(int16_t)(uint16_t)bits / 32767.0f, -1.0f);
+}
+
+// unit vector projected onto the octahedron and unfolded into a square,
+// x and y of the square are stored as 16 bit snorms
+HOST_DEVICE INLINE uint32_t encodeOctahedral(const float3& n)
+{
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    if (l1 == 0.0f)
+    {
+        return 0;
+    }
+
+    float x = n.x / l1;
+    float y = n.y / l1;
+    if (n.z < 0.0f)
+    {
+        float foldedX = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        float foldedY = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = foldedX;
+        y = foldedY;
+    }
+    return encodeSnorm16(x) | (encodeSnorm16(y) << 16);
+}
+
+HOST_DEVICE INLINE float3 decodeOctahedral(uint32_t bits)
+{
+    float x = decodeSnorm16(bits);
+    float y = decodeSnorm16(bits >> 16);
+    float3 n = make_float3(x, y, 1.0f - fabsf(x) - fabsf(y));
+    if (n.z < 0.0f)
+    {
+        n.x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        n.y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
+// ieee half float rounded to nearest even, values out of its range become infinity
+HOST_DEVICE INLINE uint32_t encodeHalf(float value)
+{
+    uint32_t sign = value < 0.0f ? 0x8000 : 0;
+    float a = fabsf(value);
+    if (!(a < 65520.0f))
+    {
+        return sign | 0x7c00;
+    }
+
+    // subnormals are multiples of 2^-24, rounding up to 0x400 gives the smallest normal
+    if (a < 6.103515625e-05f)
+    {
+        return sign | (uint32_t)rintf(a * 16777216.0f);
+    }
+
+    // a = m * 2^e with m in [0.5, 1), a carry of the rounded mantissa moves into the exponent
+    int exponent;
+    float m = frexpf(a, &exponent);
+    uint32_t mantissa = (uint32_t)rintf((2.0f * m - 1.0f) * 1024.0f);
+    return sign | (((uint32_t)(exponent + 14) << 10) + mantissa);
+}
+
+HOST_DEVICE INLINE float decodeHalf(uint32_t bits)
+{
+    uint32_t exponent = (bits >> 10) & 0x1f;
+    uint32_t mantissa = bits & 0x3ff;
+    float value = exponent == 0
+        ? ldexpf((float)mantissa, -24)
+        : ldexpf((float)(mantissa | 0x400), (int)exponent - 25);
+    return bits & 0x8000 ? -value : value;
+}
+
+HOST_DEVICE INLINE uint32_t encodeHalf2(const float2& v)
+{
+    return encodeHalf(v.x) | (encodeHalf(v.y) << 16);
+}
+
+HOST_DEVICE INLINE float2 decodeHalf2(uint32_t bits)
+{
+    return make_float2(decodeHalf(bits & 0xffff), decodeHalf(bits >> 16));
+}
+
+}
+}
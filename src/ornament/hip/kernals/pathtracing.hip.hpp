@@ -0,0 +1,154 @@
+#pragma once
+
+#include "common.hip.hpp"
+#include "vec_math.hip.hpp"
+#include "global_structs.hip.hpp"
+#include "random.hip.hpp"
+#include "camera.hip.hpp"
+#include "bvh.hip.hpp"
+#include "material.hip.hpp"
+#include "hitrecord.hip.hpp"
+#include "transform.hip.hpp"
+#include "packing.hip.hpp"
+
+namespace ornament {
+namespace kernals {
+
+// texture coordinates of a unit sphere point, longitude and latitude
+HOST_DEVICE INLINE float2 getSphereUv(const float3& normal)
+{
+    float theta = acos(-normal.y);
+    float phi = atan2(-normal.z, normal.x) + HIP_PI_F;
+    return make_float2(phi / (2.0f * HIP_PI_F), theta / HIP_PI_F);
+}
+
+template <typename TextureObject, typename BvhType>
+HOST_DEVICE INLINE void pathTracing(const ConstantParams& constantParams, KernalBuffers<TextureObject, BvhType>& kbuffs, uint32_t globalId)
+{
+    uint32_t globalX = globalId % constantParams.width;
+    uint32_t globalY = globalId / constantParams.width;
+    RndGen rnd(kbuffs.rngSeedBuffer[globalId]);
+
+    float u = ((float)globalX + rnd.genFloat()) / (constantParams.width - 1);
+    float v = ((float)globalY + rnd.genFloat()) / (constantParams.height - 1);
+
+    Ray ray = cameraGetRay(constantParams.camera, rnd, u, v);
+    float3 finalColor = make_float3(1.0f);
+
+    for (int i = 0; i < constantParams.depth; i += 1)
+    {
+        BvhHitResult bvhHitResult;
+        if (!bvhHit(kbuffs.bvh, ray, constantParams.rayCastEpsilon, &bvhHitResult)) {
+            float3 unitDirection = normalize(ray.direction);
+            float tt = 0.5f * (unitDirection.y + 1.0f);
+            finalColor = finalColor * ((1.0f - tt) * make_float3(1.0f) + tt * make_float3(0.5f, 0.7f, 1.0f));
+            //finalColor = make_float3(0.0f);
+            break;
+        }
+
+        const float3x4& inversedTransform = bvhHitResult.transform;
+        HitRecord hit;
+        hit.t = bvhHitResult.t;
+        hit.p = ray.at(bvhHitResult.t);
+        hit.materialId = bvhHitResult.materialId;
+        switch (bvhHitResult.nodeType)
+        {
+            case SphereType: 
+            {
+                // the hit point on the unit sphere is its normal in object space
+                float3 outwardNormal = normalize(transformNormal(inversedTransform, transformPoint(inversedTransform, hit.p)));
+                hit.uv = getSphereUv(outwardNormal);
+                hit.setFaceNormal(ray, outwardNormal);
+                break;
+            }
+            case SpherePacketType: 
+            {
+                const SpherePacket& packet = kbuffs.bvh.spherePackets[bvhHitResult.triangleId / spherePacketWidth];
+                uint32_t lane = bvhHitResult.triangleId % spherePacketWidth;
+                float3 center = make_float3(packet.centerX[lane], packet.centerY[lane], packet.centerZ[lane]);
+                float3 normal = (transformPoint(inversedTransform, hit.p) - center) / packet.radius[lane];
+                float3 outwardNormal = normalize(transformNormal(inversedTransform, normal));
+                hit.uv = getSphereUv(normalize(normal));
+                hit.setFaceNormal(ray, outwardNormal);
+                break;
+            }
+            case MeshType: 
+            {
+                float2 barycentric = bvhHitResult.triangleBarycentricUV;
+                float w = 1.0f - barycentric.x - barycentric.y;
+                float3 normal;
+                if (kbuffs.bvh.shadingRecords.len > 0)
+                {
+                    // one 24 byte record instead of six scattered loads
+                    ShadingRecord record = kbuffs.bvh.shadingRecords[bvhHitResult.triangleId];
+                    normal = w * decodeOctahedral(record.normals[0])
+                        + barycentric.x * decodeOctahedral(record.normals[1])
+                        + barycentric.y * decodeOctahedral(record.normals[2]);
+                    hit.uv = w * decodeHalf2(record.uvs[0])
+                        + barycentric.x * decodeHalf2(record.uvs[1])
+                        + barycentric.y * decodeHalf2(record.uvs[2]);
+                }
+                else
+                {
+                    uint32_t firstIndex = bvhHitResult.triangleId * 3;
+                    float4 n0 = kbuffs.bvh.normals[kbuffs.bvh.normalIndices[firstIndex]];
+                    float4 n1 = kbuffs.bvh.normals[kbuffs.bvh.normalIndices[firstIndex + 1]];
+                    float4 n2 = kbuffs.bvh.normals[kbuffs.bvh.normalIndices[firstIndex + 2]];
+
+                    float2 uv0 = kbuffs.bvh.uvs[kbuffs.bvh.uvIndices[firstIndex]];
+                    float2 uv1 = kbuffs.bvh.uvs[kbuffs.bvh.uvIndices[firstIndex + 1]];
+                    float2 uv2 = kbuffs.bvh.uvs[kbuffs.bvh.uvIndices[firstIndex + 2]];
+
+                    normal = make_float3(w * n0 + barycentric.x * n1 + barycentric.y * n2);
+                    hit.uv = w * uv0 + barycentric.x * uv1 + barycentric.y * uv2;
+                }
+                float3 outwardNormal = normalize(transformNormal(inversedTransform, normal));
+                hit.setFaceNormal(ray, outwardNormal);
+                break;
+            }
+            default: { break; }
+        }
+
+        float3 attenuation;
+        Ray scattered;
+        Material material = kbuffs.materials[hit.materialId];
+        if (materialScatter(material, ray, hit, rnd, kbuffs.textures, &attenuation, &scattered)) {
+            ray = scattered;
+            finalColor = finalColor * attenuation;
+        } else {
+            finalColor = finalColor * materialEmit(material, hit, kbuffs.textures);
+            break;
+        }
+    }
+    
+    float4 accumulatedRgba = make_float4(finalColor, 1.0f);
+    if (constantParams.currentIteration > 1.0f) {
+        accumulatedRgba = kbuffs.accumulationBuffer[globalId] + accumulatedRgba;
+    }
+
+    kbuffs.accumulationBuffer[globalId] = accumulatedRgba;
+    kbuffs.rngSeedBuffer[globalId] = rnd.state;
+}
+
+template <typename TextureObject, typename BvhType>
+HOST_DEVICE INLINE void postProcessing(const ConstantParams& constantParams, KernalBuffers<TextureObject, BvhType>& kbuffs, uint32_t globalId)
+{
+    float4 rgba = kbuffs.accumulationBuffer[globalId] / constantParams.currentIteration;
+    rgba.x = pow(rgba.x, constantParams.invertedGamma);
+    rgba.y = pow(rgba.y, constantParams.invertedGamma);
+    rgba.z = pow(rgba.z, constantParams.invertedGamma);
+    rgba = clamp(rgba, 0.0f, 1.0f);
+
+    uint32_t fbIndex = globalId;
+    if (constantParams.flipY != 0) {
+        uint32_t globalX = globalId % constantParams.width;
+        uint32_t globalY = globalId / constantParams.width;
+        uint32_t flippedY = constantParams.height - globalY - 1;
+        fbIndex = constantParams.width * flippedY + globalX;
+    }
+
+    kbuffs.frameBuffer[fbIndex] = rgba;
+}
+
+}
+}
@@ -1,7 +1,5 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
-#include <hip/hip_math_constants.h>
 #include "common.hip.hpp"
 #include "vec_math.hip.hpp"
 
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
 #include "common.hip.hpp"
 #include "vec_math.hip.hpp"
 
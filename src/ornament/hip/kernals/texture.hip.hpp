@@ -0,0 +1,37 @@
+#pragma once
+
+#include "common.hip.hpp"
+#include "global_structs.hip.hpp"
+#include "vec_math.hip.hpp"
+
+namespace ornament {
+namespace kernals {
+
+#if defined( __KERNELCC__ )
+DEVICE INLINE float4 textureSample(hipTextureObject_t texture, const float2& uv)
+{
+    return tex2D<float4>(texture, uv.x, uv.y);
+}
+#endif
+
+// mirrors the hip texture object setup: point filtering, wrap addressing,
+// normalized coordinates and unsigned int8 data read as normalized float
+HOST INLINE float4 textureSample(const HostTexture& texture, const float2& uv)
+{
+    float u = uv.x - floorf(uv.x);
+    float v = uv.y - floorf(uv.y);
+    uint32_t x = RT_MIN((uint32_t)(u * texture.width), texture.width - 1);
+    uint32_t y = RT_MIN((uint32_t)(v * texture.height), texture.height - 1);
+
+    const uint8_t* texel = texture.data + y * texture.bytesPerRow + x * texture.numComponents * texture.bytesPerComponent;
+    float c[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    for (uint32_t i = 0; i < texture.numComponents && i < 4; i++)
+    {
+        c[i] = texture.isHdr != 0 ? ((const float*)texel)[i] : texel[i] / 255.0f;
+    }
+
+    return make_float4(c[0], c[1], c[2], c[3]);
+}
+
+}
+}
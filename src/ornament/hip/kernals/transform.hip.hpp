@@ -1,6 +1,6 @@
 #pragma once
 
-#include <hip/hip_runtime.h>
+#include "common.hip.hpp"
 #include "vec_math.hip.hpp"
 #include "ray.hip.hpp"
 
@@ -8,26 +8,38 @@
 namespace ornament {
 namespace kernals {
 
-HOST_DEVICE INLINE float3 transformPoint(const float4x4& transform, const float3& point)
+// Only inverses of object transforms are stored, they map world space to object space.
+
+HOST_DEVICE INLINE float3 transformPoint(const float3x4& transform, const float3& point)
 {
-    float4 p = transform * make_float4(point, 1.0f);
-    return make_float3(p);
+    return transform * make_float4(point, 1.0f);
 }
 
-HOST_DEVICE INLINE Ray transformRay(const float4x4& inversedTransform, const Ray& ray)
+HOST_DEVICE INLINE Ray transformRay(const float3x4& inversedTransform, const Ray& ray)
 {
-    float4 o = inversedTransform * make_float4(ray.origin, 1.0f);
-    float4 d = inversedTransform * make_float4(ray.direction, 0.0f);
-
     return Ray(
-        make_float3(o),
-        make_float3(d)
+        inversedTransform * make_float4(ray.origin, 1.0f),
+        inversedTransform * make_float4(ray.direction, 0.0f)
     );
 }
 
-HOST_DEVICE INLINE float3 transformNormal(const float4x4& inversedTransform, const float3& normal)
+// object space normal to world space, by the transposed inverse
+HOST_DEVICE INLINE float3 transformNormal(const float3x4& inversedTransform, const float3& normal)
+{
+    return normal.x * make_float3(inversedTransform.r[0])
+        + normal.y * make_float3(inversedTransform.r[1])
+        + normal.z * make_float3(inversedTransform.r[2]);
+}
+
+// transform which applies b and then a
+HOST_DEVICE INLINE float3x4 combineTransforms(const float3x4& a, const float3x4& b)
 {
-    return make_float3(transpose(inversedTransform) * make_float4(normal, 0.0f));
+    float3x4 m;
+    for (int i = 0; i < 3; i++)
+    {
+        m.r[i] = a.r[i].x * b.r[0] + a.r[i].y * b.r[1] + a.r[i].z * b.r[2] + make_float4(0.0f, 0.0f, 0.0f, a.r[i].w);
+    }
+    return m;
 }
 
 }
@@ -4,7 +4,25 @@
 #define __KERNELCC__
 #endif
 
+#if defined( __KERNELCC__ ) || __has_include( <hiprt/hiprt_vec.h> )
 #include <hiprt/hiprt_vec.h>
+#else
+// hip free host build, minimal replacement of the hiprt vector types
+struct hiprtInt2 { int x, y; };
+struct hiprtInt3 { int x, y, z; };
+struct hiprtInt4 { int x, y, z, w; };
+struct hiprtFloat2 { float x, y; };
+struct hiprtFloat3 { float x, y, z; };
+struct hiprtFloat4 { float x, y, z, w; };
+
+inline hiprtInt2 make_hiprtInt2( int x, int y ) { return { x, y }; }
+inline hiprtInt3 make_hiprtInt3( int x, int y, int z ) { return { x, y, z }; }
+inline hiprtInt4 make_hiprtInt4( int x, int y, int z, int w ) { return { x, y, z, w }; }
+inline hiprtFloat2 make_hiprtFloat2( float x, float y ) { return { x, y }; }
+inline hiprtFloat3 make_hiprtFloat3( float x, float y, float z ) { return { x, y, z }; }
+inline hiprtFloat4 make_hiprtFloat4( float x, float y, float z, float w ) { return { x, y, z, w }; }
+#endif
+
 #if !defined( __KERNELCC__ )
 #include <cmath>
 
@@ -15,8 +33,16 @@ inline float min(float a, float b)
 
 inline float max(float a, float b) 
 {
-	return max(a, b);
+	return fmax(a, b);
+}
+
+#if defined( _MSC_VER )
+inline void sincosf(float x, float* s, float* c)
+{
+	*s = sinf(x);
+	*c = cosf(x);
 }
+#endif
 
 #define int2 hiprtInt2
 #define int3 hiprtInt3
@@ -46,6 +72,16 @@ struct float4x4
 	};
 };
 
+// affine transform, the last row 0 0 0 1 of its 4x4 matrix is not stored
+struct float3x4
+{
+	union
+	{
+		float4 r[3];
+		float  e[3][4];
+	};
+};
+
 #define RT_MIN( a, b ) ( ( ( b ) < ( a ) ) ? ( b ) : ( a ) )
 #define RT_MAX( a, b ) ( ( ( b ) > ( a ) ) ? ( b ) : ( a ) )
 
@@ -945,6 +981,12 @@ HOST_DEVICE INLINE float4 operator*( const float4x4& m, const float4& v )
 	// );
 }
 
+HOST_DEVICE INLINE float3 operator*( const float3x4& m, const float4& v )
+{
+	// ROW MAJOR
+	return make_float3( dot( m.r[0], v ), dot( m.r[1], v ), dot( m.r[2], v ) );
+}
+
 HOST_DEVICE INLINE float4x4 operator*( const float4x4& a, const float4x4& b )
 {
 	float4x4 m;
@@ -25,12 +25,38 @@ glm::vec3 Aabb::max() const noexcept
     return m_max;
 }
 
+glm::vec3 Aabb::centroid() const noexcept
+{
+    return (m_min + m_max) * 0.5f;
+}
+
+float Aabb::area() const noexcept
+{
+    glm::vec3 d = m_max - m_min;
+    if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f) {
+        return 0.0f;
+    }
+
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+bool Aabb::empty() const noexcept
+{
+    return m_min.x > m_max.x || m_min.y > m_max.y || m_min.z > m_max.z;
+}
+
 void Aabb::grow(const glm::vec3& p) noexcept
 {
     m_min = glm::min(m_min, p);
     m_max = glm::max(m_max, p);
 }
 
+void Aabb::grow(const Aabb& aabb) noexcept
+{
+    m_min = glm::min(m_min, aabb.m_min);
+    m_max = glm::max(m_max, aabb.m_max);
+}
+
 Aabb transform(const glm::mat4& m, const Aabb& aabb)
 {
     glm::vec3 p0 = aabb.min();
@@ -62,4 +88,9 @@ Aabb transform(const glm::mat4& m, const Aabb& aabb)
     return result;
 }
 
+Aabb intersection(const Aabb& a, const Aabb& b)
+{
+    return Aabb(glm::max(a.min(), b.min()), glm::min(a.max(), b.max()));
+}
+
 }
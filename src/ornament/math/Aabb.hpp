@@ -9,7 +9,11 @@ public:
     Aabb(const glm::vec3& min, const glm::vec3& max) noexcept;
     glm::vec3 min() const noexcept;
     glm::vec3 max() const noexcept;
+    glm::vec3 centroid() const noexcept;
+    float area() const noexcept;
+    bool empty() const noexcept;
     void grow(const glm::vec3& p) noexcept;
+    void grow(const Aabb& aabb) noexcept;
 
 private:
     glm::vec3 m_min;
@@ -17,4 +21,5 @@ private:
 };
 
 Aabb transform(const glm::mat4& m, const Aabb& aabb);
+Aabb intersection(const Aabb& a, const Aabb& b);
 }
\ No newline at end of file
@@ -30,7 +30,7 @@ glm::mat4 rotationBetweenVectors(const glm::vec3& a, const glm::vec3& b)
         return glm::mat4(1.0f);
     }
 
-    float k = std::sqrtf(lengthSq(a) * lengthSq(b));
+    float k = std::sqrt(lengthSq(a) * lengthSq(b));
     if (approxEql(kCosTheta / k, -1.0f)) {
         glm::vec3 orthogonal = glm::cross(a, UnitX);
         if (approxEql(lengthSq(orthogonal), 0.0f)) {
@@ -1,5 +1,9 @@
 #pragma once
 
 #include "Bvh.hpp"
+#include "Renderer.hpp"
 #include "Scene.hpp"
-#include "hip/PathTracer.hpp"
\ No newline at end of file
+#include "cpu/PathTracer.hpp"
+#ifdef ORNAMENT_HIP
+#include "hip/PathTracer.hpp"
+#endif
\ No newline at end of file